@@ -5,34 +5,41 @@
   See the file COPYING.
 */
 
+// fallocate() and FALLOC_FL_PUNCH_HOLE
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "block.h"
+#include "stats.h"
 
-int diskfile = -1;
-
-void disk_open(const char* diskfile_path)
+/** Open (creating if needed) an image file
+ *
+ * Returns the disk handle to pass to the other calls, or a negative
+ * errno value on failure.
+ */
+int disk_open(const char* diskfile_path)
 {
-    if(diskfile >= 0){
-	return;
-    }
-    
-    diskfile = open(diskfile_path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+    int diskfile = open(diskfile_path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
     if (diskfile < 0) {
+	int err = errno;
 	perror("disk_open failed");
-	exit(EXIT_FAILURE);
+	return -err;
     }
+    return diskfile;
 }
 
-void disk_close()
+void disk_close(int disk)
 {
-    if(diskfile >= 0){
-	close(diskfile);
+    if(disk >= 0){
+	close(disk);
     }
 }
 
@@ -41,10 +48,11 @@ void disk_close()
  * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the requested block has never been touched before, or (3) a negtive value when failed. 
  * In cases of error or return value equals to 0, the content of the @buf is set to 0.
  */
-int block_read(const int block_num, void *buf)
+int block_read(int disk, uint64_t block_num, void *buf)
 {
+    stats_scope(STAT_BLOCK_READ);
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    retstat = pread(disk, buf, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
     if (retstat <= 0){
 	memset(buf, 0, BLOCK_SIZE);
 	if(retstat<0)
@@ -58,13 +66,88 @@ int block_read(const int block_num, void *buf)
  *
  * Write should return exactly @BLOCK_SIZE except on error. 
  */
-int block_write(const int block_num, const void *buf)
+int block_write(int disk, uint64_t block_num, const void *buf)
 {
+    stats_scope(STAT_BLOCK_WRITE);
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    retstat = pwrite(disk, buf, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
     if (retstat < 0)
 	perror("block_write failed");
     
     return retstat;
 }
 
+/** Read count consecutive blocks with a single request
+ *
+ * Returns 0, or a negative errno value on failure. Blocks past the end
+ * of the image read as zeros.
+ */
+int block_read_range(int disk, uint64_t block_num, unsigned int count, void *buf)
+{
+    stats_scope(STAT_BLOCK_READ);
+    size_t len = (size_t) count * BLOCK_SIZE, done = 0;
+    while (done < len) {
+	ssize_t ret = pread(disk, (char *) buf + done, len - done, (off_t) block_num * BLOCK_SIZE + done);
+	if (ret < 0) {
+	    int err = errno;
+	    perror("block_read_range failed");
+	    return -err;
+	}
+	if (ret == 0) {
+	    memset((char *) buf + done, 0, len - done);
+	    break;
+	}
+	done += ret;
+    }
+    return 0;
+}
+
+/** Write count consecutive blocks with a single request
+ *
+ * Returns 0, or a negative errno value on failure.
+ */
+int block_write_range(int disk, uint64_t block_num, unsigned int count, const void *buf)
+{
+    stats_scope(STAT_BLOCK_WRITE);
+    size_t len = (size_t) count * BLOCK_SIZE, done = 0;
+    while (done < len) {
+	ssize_t ret = pwrite(disk, (const char *) buf + done, len - done, (off_t) block_num * BLOCK_SIZE + done);
+	if (ret < 0) {
+	    int err = errno;
+	    perror("block_write_range failed");
+	    return -err;
+	}
+	done += ret;
+    }
+    return 0;
+}
+
+/** Tell the image that count blocks from block_num on are no longer in use
+ *
+ * The range is punched out of the image file, which keeps its size: the
+ * host reclaims the space, and the blocks read as zeros. Returns 0, or a
+ * negative errno value on failure; -EOPNOTSUPP if the host file system
+ * cannot punch holes.
+ */
+int block_discard(int disk, uint64_t block_num, uint64_t count)
+{
+    if (fallocate(disk, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  (off_t) block_num * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) < 0) {
+	return -errno;
+    }
+    return 0;
+}
+
+/** Flush everything written to the disk so far to stable storage
+ *
+ * Returns 0, or a negative errno value on failure.
+ */
+int disk_sync(int disk)
+{
+    if (fdatasync(disk) < 0) {
+	int err = errno;
+	perror("disk_sync failed");
+	return -err;
+    }
+    return 0;
+}
@@ -8,11 +8,20 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 512
 
-void disk_open(const char* diskfile_path);
-void disk_close();
-int block_read(const int block_num, void *buf);
-int block_write(const int block_num, const void *buf);
+// Block numbers are 64-bit and byte offsets are computed in off_t, so an
+// image is not limited to what 32-bit arithmetic can address.
+// A disk is the descriptor returned by disk_open; each mounted image has its own
+int disk_open(const char* diskfile_path);
+void disk_close(int disk);
+int block_read(int disk, uint64_t block_num, void *buf);
+int block_write(int disk, uint64_t block_num, const void *buf);
+int block_read_range(int disk, uint64_t block_num, unsigned int count, void *buf);
+int block_write_range(int disk, uint64_t block_num, unsigned int count, const void *buf);
+int block_discard(int disk, uint64_t block_num, uint64_t count);
+int disk_sync(int disk);
 
 #endif
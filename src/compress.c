@@ -0,0 +1,275 @@
+//
+// Transparent compression of file data, see compress.h.
+//
+
+#include "params.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef SFS_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "block.h"
+#include "compress.h"
+#include "lfs.h"
+#include "log.h"
+#include "stats.h"
+
+int compress_available(void) {
+#ifdef SFS_HAVE_LZ4
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Compress len bytes of data into out
+ * @return the compressed length, or 0 if it would take more than max bytes
+ */
+static unsigned int cluster_compress(const char *data, size_t len, char *out, size_t max) {
+#ifdef SFS_HAVE_LZ4
+    int ret = LZ4_compress_default(data, out, (int) len, (int) max);
+    return ret > 0 ? (unsigned int) ret : 0;
+#else
+    (void) data, (void) len, (void) out, (void) max;
+    return 0;
+#endif
+}
+
+/**
+ * Decompress len bytes into out, which has room for a cluster
+ * @return the decompressed length, or -EIO
+ */
+static int cluster_decompress(const char *in, unsigned int len, char *out) {
+#ifdef SFS_HAVE_LZ4
+    int ret = LZ4_decompress_safe(in, out, (int) len, COMPRESS_CLUSTER_SIZE);
+    if (ret < 0) {
+        log_error(LOG_CAT_FILE, "cluster_decompress: corrupt cluster of %u bytes\n", len);
+        return -EIO;
+    }
+    return ret;
+#else
+    (void) in, (void) out;
+    log_error(LOG_CAT_FILE, "cluster_decompress: built without LZ4, cannot read a %u-byte cluster\n", len);
+    return -EIO;
+#endif
+}
+
+int compress_read(sfs_fs *fs, uint64_t pointer, size_t offset, char *out, size_t len) {
+    char packed[COMPRESS_CLUSTER_SIZE], cluster[COMPRESS_CLUSTER_SIZE];
+    unsigned int length = BMAP_LENGTH(pointer);
+    // Only clusters that save a block are stored compressed
+    if (length == 0 || length > COMPRESS_CLUSTER_SIZE - BLOCK_SIZE) {
+        log_error(LOG_CAT_FILE, "compress_read: bad compressed pointer %#llx\n", (unsigned long long) pointer);
+        return -EIO;
+    }
+    int ret = block_read_range(fs->disk, pointer & BMAP_BLOCK_MASK, BMAP_RUN_BLOCKS(pointer), packed);
+    if (ret < 0) {
+        return ret;
+    }
+    // A read of the whole cluster decompresses straight into the caller's buffer
+    char *target = offset == 0 && len == COMPRESS_CLUSTER_SIZE ? out : cluster;
+    ret = cluster_decompress(packed, length, target);
+    if (ret < 0) {
+        return ret;
+    }
+    memset(&target[ret], 0, COMPRESS_CLUSTER_SIZE - (size_t) ret);
+    if (target != out) {
+        memcpy(out, &cluster[offset], len);
+    }
+    return 0;
+}
+
+/** Look up the block pointers of cluster c of ino */
+static int cluster_map(sfs_fs *fs, const inode *ino, uint64_t c, uint64_t *pointers) {
+    unsigned int k;
+    for (k = 0; k < COMPRESS_CLUSTER_BLOCKS; k++) {
+        int ret = inode_bmap(fs, ino, c * COMPRESS_CLUSTER_BLOCKS + k, &pointers[k]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/** Read a cluster, compressed or not, given its block pointers; holes read as zeros */
+static int cluster_load(sfs_fs *fs, const uint64_t *pointers, char *cluster) {
+    unsigned int k;
+    if (pointers[0] & BMAP_COMPRESSED) {
+        return compress_read(fs, pointers[0], 0, cluster, COMPRESS_CLUSTER_SIZE);
+    }
+    for (k = 0; k < COMPRESS_CLUSTER_BLOCKS; k++) {
+        if (pointers[k] == 0) {
+            memset(&cluster[k * BLOCK_SIZE], 0, BLOCK_SIZE);
+        } else if (data_read(fs, pointers[k], &cluster[k * BLOCK_SIZE]) < 0) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/** Give back a block or compressed run that no pointer of the cluster uses any more */
+static void cluster_release(sfs_fs *fs, inode *ino, uint64_t pointer) {
+    if (pointer & BMAP_COMPRESSED) {
+        release_blocks(fs, pointer & BMAP_BLOCK_MASK, BMAP_RUN_BLOCKS(pointer));
+        ino->blocks_number -= BMAP_RUN_BLOCKS(pointer);
+    } else {
+        release_block(fs, pointer);
+        ino->blocks_number--;
+    }
+}
+
+/**
+ * Store the first valid bytes of cluster c of ino, which has the block
+ * pointers old, and free what the cluster no longer uses. cluster holds
+ * a whole cluster, zero past valid. It is compressed if that saves a
+ * block and written as plain blocks, reusing the old ones, if not.
+ */
+static int cluster_store(sfs_fs *fs, inode *ino, uint64_t c, const uint64_t *old, const char *cluster, size_t valid) {
+    char packed[COMPRESS_CLUSTER_SIZE];
+    uint64_t pointers[COMPRESS_CLUSTER_BLOCKS], run = 0;
+    unsigned int nblocks = (unsigned int) ((valid + BLOCK_SIZE - 1) / BLOCK_SIZE), n = 0, k, j;
+    unsigned int length = nblocks > 1 ? cluster_compress(cluster, valid, packed, (nblocks - 1) * BLOCK_SIZE) : 0;
+    int ret = 0;
+
+    if (length > 0) {
+        n = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        run = assign_block_run(fs, n);
+    }
+    if (run != 0) {
+        memset(&packed[length], 0, n * BLOCK_SIZE - length);
+        ret = block_write_range(fs->disk, run, n, packed);
+        if (ret < 0) {
+            reclaim_blocks(fs, run, n);
+            return ret;
+        }
+        for (k = 0; k < COMPRESS_CLUSTER_BLOCKS; k++) {
+            pointers[k] = k < nblocks ? BMAP_COMPRESSED | (uint64_t) length << BMAP_LENGTH_SHIFT | run : 0;
+        }
+        ino->blocks_number += n;
+        stats_add(STAT_COMPRESS_IN, valid);
+        stats_add(STAT_COMPRESS_OUT, length);
+    } else {
+        for (k = 0; k < COMPRESS_CLUSTER_BLOCKS; k++) {
+            pointers[k] = k < nblocks && old[k] != 0 && !(old[k] & BMAP_COMPRESSED) ? old[k] : 0;
+            if (k < nblocks && pointers[k] == 0) {
+                pointers[k] = assign_block(fs);
+                if (pointers[k] == 0) {
+                    ret = -ENOSPC;
+                    break;
+                }
+                ino->blocks_number++;
+            }
+            if (k < nblocks && data_write(fs, pointers[k], &cluster[k * BLOCK_SIZE]) != BLOCK_SIZE) {
+                k++;
+                ret = -EIO;
+                break;
+            }
+        }
+        if (ret < 0) {
+            for (j = 0; j < k; j++) {
+                if (pointers[j] != 0 && pointers[j] != old[j]) {
+                    cluster_release(fs, ino, pointers[j]);
+                }
+            }
+            return ret;
+        }
+    }
+
+    for (k = 0; k < COMPRESS_CLUSTER_BLOCKS; k++) {
+        uint64_t pointer = pointers[k];
+        if (pointer == old[k]) continue;
+        ret = inode_bmap_store(fs, ino, c * COMPRESS_CLUSTER_BLOCKS + k, &pointer);
+        if (ret < 0) break;
+    }
+    if (ret < 0) {
+        // Only a missing indirect block can fail to be allocated, and the
+        // pointers already changed had theirs: put them back as they were
+        for (j = 0; j < k; j++) {
+            uint64_t pointer = old[j];
+            if (pointers[j] != old[j]) {
+                inode_bmap_store(fs, ino, c * COMPRESS_CLUSTER_BLOCKS + j, &pointer);
+            }
+        }
+        if (run != 0) {
+            cluster_release(fs, ino, pointers[0]);
+        } else {
+            for (j = 0; j < COMPRESS_CLUSTER_BLOCKS; j++) {
+                if (pointers[j] != 0 && pointers[j] != old[j]) {
+                    cluster_release(fs, ino, pointers[j]);
+                }
+            }
+        }
+        return ret;
+    }
+
+    // Free the old copy: a compressed run once, plain blocks not reused
+    for (k = 0; k < COMPRESS_CLUSTER_BLOCKS; k++) {
+        if (old[k] & BMAP_COMPRESSED) {
+            cluster_release(fs, ino, old[k]);
+            break;
+        }
+        if (old[k] != 0 && old[k] != pointers[k]) {
+            cluster_release(fs, ino, old[k]);
+        }
+    }
+    return 0;
+}
+
+ssize_t compress_write(sfs_fs *fs, inode *ino, off_t offset, const char *data, size_t size) {
+    char cluster[COMPRESS_CLUSTER_SIZE];
+    uint64_t pointers[COMPRESS_CLUSTER_BLOCKS];
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + (off_t) done;
+        uint64_t c = (uint64_t) pos / COMPRESS_CLUSTER_SIZE;
+        off_t start = (off_t) c * COMPRESS_CLUSTER_SIZE;
+        size_t within = (size_t) (pos - start);
+        size_t n = size - done < COMPRESS_CLUSTER_SIZE - within ? size - done : COMPRESS_CLUSTER_SIZE - within;
+        // The bytes of the cluster that will be inside the file
+        off_t end = ino->size > pos + (off_t) n ? ino->size : pos + (off_t) n;
+        size_t valid = end - start < COMPRESS_CLUSTER_SIZE ? (size_t) (end - start) : COMPRESS_CLUSTER_SIZE;
+
+        int ret = cluster_map(fs, ino, c, pointers);
+        if (ret == 0 && (within > 0 || n < valid)) {
+            ret = cluster_load(fs, pointers, cluster);
+        } else {
+            memset(cluster, 0, COMPRESS_CLUSTER_SIZE);
+        }
+        if (ret == 0) {
+            memcpy(&cluster[within], &data[done], n);
+            memset(&cluster[valid], 0, COMPRESS_CLUSTER_SIZE - valid);
+            ret = cluster_store(fs, ino, c, pointers, cluster, valid);
+        }
+        if (ret < 0) {
+            return done > 0 ? (ssize_t) done : ret;
+        }
+        done += n;
+    }
+    return (ssize_t) done;
+}
+
+int compress_truncate(sfs_fs *fs, inode *ino, off_t newsize) {
+    char cluster[COMPRESS_CLUSTER_SIZE];
+    uint64_t pointers[COMPRESS_CLUSTER_BLOCKS];
+    uint64_t c = (uint64_t) newsize / COMPRESS_CLUSTER_SIZE;
+    size_t valid = (size_t) (newsize % COMPRESS_CLUSTER_SIZE);
+    // Whole clusters past newsize are simply freed, and so are the blocks
+    // of a plain one
+    if (valid == 0) {
+        return 0;
+    }
+    int ret = cluster_map(fs, ino, c, pointers);
+    if (ret < 0 || !(pointers[0] & BMAP_COMPRESSED)) {
+        return ret;
+    }
+    ret = cluster_load(fs, pointers, cluster);
+    if (ret < 0) {
+        return ret;
+    }
+    memset(&cluster[valid], 0, COMPRESS_CLUSTER_SIZE - valid);
+    return cluster_store(fs, ino, c, pointers, cluster, valid);
+}
@@ -0,0 +1,45 @@
+//
+// Transparent compression of file data (-o compress).
+//
+// A file with INODE_COMPRESSED set is stored in clusters of
+// COMPRESS_CLUSTER_BLOCKS logical blocks.  Each cluster is compressed with
+// LZ4 when it is written, and kept that way if that saves at least one
+// block: the compressed bytes go to a run of contiguous blocks, and every
+// block pointer of the cluster holds the same compressed pointer, which
+// carries the start of the run and the compressed length (see sfs.h).  A
+// cluster that does not compress is stored as plain blocks, like any
+// other file data, so a compressed file can mix both.
+//
+// Compressed clusters are rewritten to a new run on every write and read
+// back whole, decompressing straight into the caller's buffer when the
+// read covers the cluster.  Without LZ4 at build time compressed files
+// cannot be created and their compressed clusters cannot be read.
+//
+
+#ifndef SFS_COMPRESS_H
+#define SFS_COMPRESS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sfs_helper_functions.h"
+
+#define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE)
+
+// Whether this build can compress; mounting with compress fails otherwise
+int compress_available(void);
+
+// Read len bytes at offset within the compressed cluster that pointer
+// (any of its block pointers) maps. Returns 0 or -errno.
+int compress_read(sfs_fs *fs, uint64_t pointer, size_t offset, char *out, size_t len);
+
+// Write size bytes at offset into a compressed file, one cluster at a
+// time. Caller holds fs->lock exclusively and writes ino back, setting its
+// size. Returns the bytes written, or -errno if none were.
+ssize_t compress_write(sfs_fs *fs, inode *ino, off_t offset, const char *data, size_t size);
+
+// Before ino is cut down to newsize, rewrite the cluster newsize falls in
+// so that it holds no bytes past it. The caller goes on to free the rest.
+int compress_truncate(sfs_fs *fs, inode *ino, off_t newsize);
+
+#endif //SFS_COMPRESS_H
@@ -0,0 +1,448 @@
+//
+// Shared data blocks and write-time deduplication, see dedup.h.
+//
+
+#include "params.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "dedup.h"
+#include "lfs.h"
+#include "log.h"
+#include "stats.h"
+
+// Blocks with a matching hash whose contents are compared before giving up
+#define DEDUP_MAX_CANDIDATES 4
+
+/** A slot of an open-addressing table from a block number or hash to an entry of fs->refs */
+typedef struct ref_slot {
+    uint64_t key;
+    unsigned int entry;     // the entry plus one, 0 for an empty slot
+    unsigned int reserved;
+} ref_slot;
+
+/** Linear probing; keys may repeat, each (key, entry) pair is in once */
+typedef struct ref_table {
+    ref_slot *slots;
+    unsigned int mask;      // the number of slots, a power of two, minus one
+    unsigned int count;
+} ref_table;
+
+struct dedup {
+    ref_table by_block;         // every entry in use
+    ref_table by_hash;          // the entries with a fingerprint
+    unsigned int *free_entries; // given-back entries, taken before the index grows
+    unsigned int free_count;
+    unsigned int free_capacity;
+};
+
+static unsigned int table_home(const ref_table *t, uint64_t key) {
+    return (unsigned int) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & t->mask;
+}
+
+static int table_init(ref_table *t, unsigned int size) {
+    t->slots = calloc(size, sizeof(ref_slot));
+    if (t->slots == NULL) {
+        return -ENOMEM;
+    }
+    t->mask = size - 1;
+    t->count = 0;
+    return 0;
+}
+
+static void table_put(ref_table *t, uint64_t key, unsigned int entry) {
+    unsigned int i = table_home(t, key);
+    while (t->slots[i].entry != 0) {
+        i = (i + 1) & t->mask;
+    }
+    t->slots[i].key = key;
+    t->slots[i].entry = entry + 1;
+    t->count++;
+}
+
+/** Add (key, entry), doubling the table once it is half full */
+static int table_insert(ref_table *t, uint64_t key, unsigned int entry) {
+    if ((t->count + 1) * 2 > t->mask + 1) {
+        ref_table grown;
+        unsigned int i;
+        if (table_init(&grown, (t->mask + 1) * 2) < 0) {
+            return -ENOMEM;
+        }
+        for (i = 0; i <= t->mask; i++) {
+            if (t->slots[i].entry != 0) {
+                table_put(&grown, t->slots[i].key, t->slots[i].entry - 1);
+            }
+        }
+        free(t->slots);
+        *t = grown;
+    }
+    table_put(t, key, entry);
+    return 0;
+}
+
+/**
+ * Walk the entries stored under key; *pos starts at UINT_MAX
+ * @return the next entry plus one, or 0 when there are no more
+ */
+static unsigned int table_next(const ref_table *t, uint64_t key, unsigned int *pos) {
+    unsigned int i = *pos == UINT_MAX ? table_home(t, key) : (*pos + 1) & t->mask;
+    for (; t->slots[i].entry != 0; i = (i + 1) & t->mask) {
+        if (t->slots[i].key == key) {
+            *pos = i;
+            return t->slots[i].entry;
+        }
+    }
+    return 0;
+}
+
+/** Remove (key, entry), shifting back the slots that probed past it */
+static void table_remove(ref_table *t, uint64_t key, unsigned int entry) {
+    unsigned int i = table_home(t, key), j, home;
+    for (; t->slots[i].entry != 0; i = (i + 1) & t->mask) {
+        if (t->slots[i].key == key && t->slots[i].entry == entry + 1) break;
+    }
+    if (t->slots[i].entry == 0) {
+        return;
+    }
+    for (j = (i + 1) & t->mask; t->slots[j].entry != 0; j = (j + 1) & t->mask) {
+        home = table_home(t, t->slots[j].key);
+        // Slot j may move to i unless its home lies cyclically in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].entry = 0;
+    t->count--;
+}
+
+/** The entry of block, or -1 if it has none */
+static long ref_lookup(sfs_fs *fs, uint64_t block) {
+    unsigned int pos = UINT_MAX;
+    unsigned int entry = table_next(&fs->dedup->by_block, block, &pos);
+    return entry != 0 ? (long) entry - 1 : -1;
+}
+
+/** Record that entry e is free for reuse; losing track of it only wastes it until the next mount */
+static void ref_push_free(struct dedup *d, unsigned int e) {
+    if (d->free_count == d->free_capacity) {
+        unsigned int capacity = d->free_capacity ? d->free_capacity * 2 : INDEX_ENTRIES_PER_BLOCK;
+        unsigned int *p = realloc(d->free_entries, capacity * sizeof(unsigned int));
+        if (p == NULL) return;
+        d->free_entries = p;
+        d->free_capacity = capacity;
+    }
+    d->free_entries[d->free_count++] = e;
+}
+
+/** Give block an entry saying it has one pointer and no fingerprint */
+static long ref_add(sfs_fs *fs, uint64_t block) {
+    struct dedup *d = fs->dedup;
+    unsigned int e;
+    if (d->free_count > 0) {
+        e = d->free_entries[--d->free_count];
+    } else {
+        if (ref_index_reserve(fs, fs->sb.ref_entries + 1) < 0) {
+            return -ENOMEM;
+        }
+        e = fs->sb.ref_entries++;
+        write_superblock(fs);
+    }
+    if (table_insert(&d->by_block, block, e) < 0) {
+        ref_push_free(d, e);
+        return -ENOMEM;
+    }
+    fs->refs[e].block = block;
+    fs->refs[e].refs = 1;
+    fs->refs[e].hash = 0;
+    return e;
+}
+
+/** Write entry e back, or give it back if it says no more than the default */
+static void ref_update(sfs_fs *fs, unsigned int e) {
+    block_ref *ref = &fs->refs[e];
+    if (ref->refs <= 1 && ref->hash == 0) {
+        table_remove(&fs->dedup->by_block, ref->block, e);
+        ref->block = 0;
+        ref->refs = 0;
+        ref_push_free(fs->dedup, e);
+    }
+    write_ref_entry(fs, e);
+}
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c)(const unsigned char *data);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_soft(const unsigned char *data) {
+    uint32_t crc = 0xffffffff;
+    unsigned int i;
+    for (i = 0; i < BLOCK_SIZE; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const unsigned char *data) {
+    uint64_t crc = 0xffffffff, word;
+    unsigned int i;
+    for (i = 0; i < BLOCK_SIZE; i += sizeof(word)) {
+        memcpy(&word, &data[i], sizeof(word));
+        crc = __builtin_ia32_crc32di(crc, word);
+    }
+    return ~(uint32_t) crc;
+}
+#endif
+
+static void crc32c_setup(void) {
+    unsigned int i, k;
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+    crc32c = crc32c_soft;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c = crc32c_sse42;
+    }
+#endif
+}
+
+/** The fingerprint of a block's contents; never 0, which marks blocks without one */
+static unsigned int block_hash(const void *data) {
+    uint32_t hash = crc32c(data);
+    return hash != 0 ? hash : 1;
+}
+
+int dedup_start(sfs_fs *fs) {
+    struct dedup *d = calloc(1, sizeof(struct dedup));
+    unsigned int size = 64, e;
+    if (d == NULL) {
+        return -ENOMEM;
+    }
+    pthread_once(&crc32c_once, crc32c_setup);
+    while (size < fs->sb.ref_entries * 2) {
+        size *= 2;
+    }
+    int ret = table_init(&d->by_block, size);
+    if (ret == 0) {
+        ret = table_init(&d->by_hash, size);
+    }
+    for (e = 0; ret == 0 && e < fs->sb.ref_entries; e++) {
+        const block_ref *ref = &fs->refs[e];
+        if (ref->block == 0) {
+            ref_push_free(d, e);
+            continue;
+        }
+        ret = table_insert(&d->by_block, ref->block, e);
+        if (ret == 0 && ref->hash != 0) {
+            ret = table_insert(&d->by_hash, ref->hash, e);
+        }
+    }
+    fs->dedup = d;
+    if (ret < 0) {
+        dedup_stop(fs);
+        return ret;
+    }
+    log_info(LOG_CAT_MOUNT, "dedup_start: %u shared or fingerprinted blocks\n", d->by_block.count);
+    return 0;
+}
+
+void dedup_stop(sfs_fs *fs) {
+    struct dedup *d = fs->dedup;
+    if (d == NULL) {
+        return;
+    }
+    fs->dedup = NULL;
+    free(d->by_block.slots);
+    free(d->by_hash.slots);
+    free(d->free_entries);
+    free(d);
+}
+
+unsigned int dedup_refs(sfs_fs *fs, uint64_t block) {
+    if (fs->dedup == NULL || fs->dedup->by_block.count == 0) {
+        return 1;
+    }
+    long e = ref_lookup(fs, block);
+    return e < 0 ? 1 : fs->refs[e].refs;
+}
+
+int dedup_ref_get(sfs_fs *fs, uint64_t block) {
+    long e = ref_lookup(fs, block);
+    if (e < 0 && (e = ref_add(fs, block)) < 0) {
+        return (int) e;
+    }
+    fs->refs[e].refs++;
+    write_ref_entry(fs, (unsigned int) e);
+    return 0;
+}
+
+unsigned int dedup_ref_put(sfs_fs *fs, uint64_t block) {
+    if (fs->dedup->by_block.count == 0) {
+        return 0;
+    }
+    long e = ref_lookup(fs, block);
+    if (e < 0) {
+        return 0;
+    }
+    block_ref *ref = &fs->refs[e];
+    unsigned int left = ref->refs - 1;
+    ref->refs = left;
+    // A block about to be freed can no longer be shared
+    if (left == 0 && ref->hash != 0) {
+        table_remove(&fs->dedup->by_hash, ref->hash, (unsigned int) e);
+        ref->hash = 0;
+    }
+    ref_update(fs, (unsigned int) e);
+    return left;
+}
+
+void dedup_forget(sfs_fs *fs, uint64_t block) {
+    if (fs->dedup == NULL || fs->dedup->by_hash.count == 0) {
+        return;
+    }
+    long e = ref_lookup(fs, block);
+    if (e < 0 || fs->refs[e].hash == 0) {
+        return;
+    }
+    table_remove(&fs->dedup->by_hash, fs->refs[e].hash, (unsigned int) e);
+    fs->refs[e].hash = 0;
+    ref_update(fs, (unsigned int) e);
+}
+
+int dedup_unshare(sfs_fs *fs, inode *ino, uint64_t index, uint64_t *block) {
+    char buffer[BLOCK_SIZE];
+    if (fs->dedup == NULL || fs->dedup->by_block.count == 0 || *block == 0) {
+        return 0;
+    }
+    if (dedup_refs(fs, *block) <= 1) {
+        dedup_forget(fs, *block);
+        return 0;
+    }
+    uint64_t copy = assign_block(fs);
+    if (copy == 0) {
+        return -ENOSPC;
+    }
+    if (data_read(fs, *block, buffer) < 0 || data_write(fs, copy, buffer) != BLOCK_SIZE) {
+        release_block(fs, copy);
+        return -EIO;
+    }
+    uint64_t old = copy;
+    int ret = inode_bmap_set(fs, ino, index, &old);
+    if (ret < 0) {
+        release_block(fs, copy);
+        return ret;
+    }
+    release_block(fs, old);
+    *block = copy;
+    return 0;
+}
+
+/** Find a block holding exactly the BLOCK_SIZE bytes of data, or 0 */
+static uint64_t dedup_find(sfs_fs *fs, unsigned int hash, const char *data) {
+    char buffer[BLOCK_SIZE];
+    unsigned int pos = UINT_MAX, entry, tries = 0;
+    while (tries++ < DEDUP_MAX_CANDIDATES && (entry = table_next(&fs->dedup->by_hash, hash, &pos)) != 0) {
+        uint64_t block = fs->refs[entry - 1].block;
+        if (data_read(fs, block, buffer) == BLOCK_SIZE && memcmp(buffer, data, BLOCK_SIZE) == 0) {
+            return block;
+        }
+    }
+    return 0;
+}
+
+/** Enter block, which holds contents with the given hash, into the fingerprint index */
+static void dedup_remember(sfs_fs *fs, uint64_t block, unsigned int hash) {
+    long e = ref_lookup(fs, block);
+    if (e < 0 && (e = ref_add(fs, block)) < 0) {
+        return;
+    }
+    if (table_insert(&fs->dedup->by_hash, hash, (unsigned int) e) < 0) {
+        ref_update(fs, (unsigned int) e);
+        return;
+    }
+    fs->refs[e].hash = hash;
+    write_ref_entry(fs, (unsigned int) e);
+}
+
+int dedup_write(sfs_fs *fs, inode *ino, uint64_t index, unsigned int offset, const void *data, size_t len) {
+    char buffer[BLOCK_SIZE];
+    uint64_t old, block, prev;
+    int ret = inode_bmap(fs, ino, index, &old);
+    if (ret < 0) {
+        return ret;
+    }
+    if (len < BLOCK_SIZE) {
+        if (old != 0 && !BMAP_IS_UNWRITTEN(old)) {
+            data_read(fs, old, buffer);
+        } else {
+            memset(buffer, 0, BLOCK_SIZE);
+        }
+    }
+    memcpy(&buffer[offset], data, len);
+
+    unsigned int hash = block_hash(buffer);
+    block = dedup_find(fs, hash, buffer);
+    if (block != 0 && block == old) {
+        return 0;
+    }
+    if (block != 0) {
+        ret = dedup_ref_get(fs, block);
+        if (ret < 0) {
+            return ret;
+        }
+        prev = block;
+        ret = inode_bmap_set(fs, ino, index, &prev);
+        if (ret < 0) {
+            dedup_ref_put(fs, block);
+            return ret;
+        }
+        release_block(fs, prev);
+        stats_add(STAT_DEDUP_BLOCKS, 1);
+        return 0;
+    }
+
+    // New contents go where the block is, unless other pointers share it
+    if (old != 0 && dedup_refs(fs, old) > 1) {
+        block = assign_block(fs);
+        if (block == 0) {
+            return -ENOSPC;
+        }
+        if (data_write(fs, block, buffer) != BLOCK_SIZE) {
+            release_block(fs, block);
+            return -EIO;
+        }
+        prev = block;
+        ret = inode_bmap_set(fs, ino, index, &prev);
+        if (ret < 0) {
+            release_block(fs, block);
+            return ret;
+        }
+        release_block(fs, prev);
+    } else {
+        dedup_forget(fs, old);
+        ret = fs->lfs != NULL ? lfs_write(fs, ino, index, 0, buffer, BLOCK_SIZE) : 1;
+        if (ret == 1) {
+            ret = inode_bmap_alloc(fs, ino, index, &block);
+            if (ret >= 0) {
+                ret = data_write(fs, block, buffer) == BLOCK_SIZE ? 0 : -EIO;
+            }
+        }
+        if (ret < 0 || (ret = inode_bmap(fs, ino, index, &block)) < 0) {
+            return ret;
+        }
+    }
+    dedup_remember(fs, block, hash);
+    return 0;
+}
@@ -0,0 +1,56 @@
+//
+// Shared data blocks and write-time deduplication (-o dedup).
+//
+// A data block may be pointed to by several files, or several times by
+// one.  The block reference index (see sfs.h) counts the pointers to each
+// such block; releasing a pointer only frees the block once the count
+// drops to one pointer's worth.  A shared block is never changed in
+// place: a write copies it to a block of its own first.
+//
+// With dedup on, every block written to a regular, uncompressed file is
+// hashed with CRC32C (SSE4.2 where the CPU has it) and looked up in the
+// fingerprint index, the hashes kept in the same entries.  A block with
+// the same contents already on disk is shared instead of written; the
+// contents are compared, so a hash collision only costs the sharing.
+// The entries are kept in memory and looked up through hash tables built
+// at mount.  Sharing is part of the format, so the tables exist whether
+// dedup is on or not.
+//
+
+#ifndef SFS_DEDUP_H
+#define SFS_DEDUP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sfs_helper_functions.h"
+
+int dedup_start(sfs_fs *fs);
+
+void dedup_stop(sfs_fs *fs);
+
+// The number of pointers to an allocated data block
+unsigned int dedup_refs(sfs_fs *fs, uint64_t block);
+
+// Count one more pointer to block. Caller holds fs->lock exclusively.
+int dedup_ref_get(sfs_fs *fs, uint64_t block);
+
+// Drop a pointer to block. Returns the pointers left besides the one
+// dropped: 0 if the caller must free the block.
+unsigned int dedup_ref_put(sfs_fs *fs, uint64_t block);
+
+// Before block index of ino, mapped to *block, is changed in place: give
+// it a copy of its own if the block is shared, updating *block, and take
+// it out of the fingerprint index. Caller holds fs->lock exclusively and
+// writes ino back.
+int dedup_unshare(sfs_fs *fs, inode *ino, uint64_t index, uint64_t *block);
+
+// Take block out of the fingerprint index, before its contents change
+void dedup_forget(sfs_fs *fs, uint64_t block);
+
+// Write len bytes at offset into block index of ino, sharing the block
+// with an identical one if there is one. Caller holds fs->lock
+// exclusively and writes ino back. Returns 0 or -errno.
+int dedup_write(sfs_fs *fs, inode *ino, uint64_t index, unsigned int offset, const void *data, size_t len);
+
+#endif //SFS_DEDUP_H
@@ -0,0 +1,778 @@
+//
+// Write-ahead journal for metadata blocks, see journal.h.
+//
+// The journal region is split in two halves, and transaction n goes to
+// half n % 2. Each holds one transaction:
+//
+//   header | run blocks (blocks freed) | tag blocks (home block numbers) | block images
+//
+// The runs, tags and images are written and flushed first, then the header
+// with a checksum over them, then the images are checkpointed home. The
+// flush before the next header makes that checkpoint durable, so on mount
+// only the newer of the two committed transactions is replayed, and
+// replaying it twice is harmless.
+//
+// The blocks a transaction freed stay allocated until it is checkpointed,
+// and are marked free in the transaction after it. Until that one has
+// committed, the runs of the last are on disk to give back after a crash.
+//
+#include "params.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "journal.h"
+#include "lfs.h"
+#include "log.h"
+#include "stats.h"
+
+// Commit interval when libsfs_options leaves it at 0
+#define JOURNAL_COMMIT_INTERVAL_MS 50
+#define JOURNAL_CHECKSUM_SEED 0xcbf29ce484222325ULL
+
+typedef struct freed_run {
+    uint64_t block;
+    unsigned int count;
+} freed_run;
+
+typedef struct journal_txn {
+    uint64_t sequence;
+    unsigned int count;         // images, in order of first write
+    unsigned int capacity;
+    uint64_t *homes;
+    char *images;
+    unsigned int *slots;        // open addressing on the home block: image index + 1, 0 if empty
+    unsigned int nslots;        // a power of two, more than twice count
+    freed_run *freed;           // blocks to give back once the transaction has committed
+    unsigned int nfreed;
+    unsigned int freed_capacity;
+} journal_txn;
+
+struct journal {
+    pthread_t thread;
+    pthread_mutex_t mutex;      // protects the fields below down to error
+    pthread_cond_t wake;        // for the commit thread
+    pthread_cond_t done;        // for journal_commit waiters, and journal_split
+    int stop;
+    int force;
+    int busy;                   // a closed transaction is not checkpointed yet
+    uint64_t committed;         // last sequence that is durable
+    int error;                  // of the commit that failed, after which nothing is committed
+    pthread_rwlock_t map_lock;  // meta_read against the commit thread dropping committing
+    journal_txn txns[2];
+    journal_txn *running;       // modified under fs->lock held exclusively
+    journal_txn *committing;    // read-only until it is checkpointed
+    journal_txn *reclaimable;   // checkpointed, its freed runs given back when the next one closes;
+                                // set under map_lock as well, for journal_commit
+    unsigned int interval_ms;
+};
+
+static uint64_t journal_checksum(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/** Journal blocks needed by a transaction of count images and runs freed runs */
+static uint64_t journal_span(unsigned int count, unsigned int runs) {
+    return 1 + (runs + JOURNAL_RUNS_PER_BLOCK - 1) / JOURNAL_RUNS_PER_BLOCK
+           + (count + JOURNAL_TAGS_PER_BLOCK - 1) / JOURNAL_TAGS_PER_BLOCK + (uint64_t) count;
+}
+
+/**
+ * Whether the running transaction should be committed before it grows out
+ * of its half of the journal, leaving room for what the operations still
+ * under way add to it
+ */
+static int journal_full(const sfs_fs *fs, const journal_txn *txn) {
+    return journal_span(txn->count, txn->nfreed) > fs->sb.journal_blocks / 4;
+}
+
+/** First block of the half of the journal transaction sequence goes to */
+static uint64_t journal_area(const sfs_fs *fs, uint64_t sequence) {
+    return fs->sb.journal_start + (sequence % 2) * (fs->sb.journal_blocks / 2);
+}
+
+static unsigned int txn_hash(uint64_t block, unsigned int nslots) {
+    return (unsigned int) ((block * 0x9e3779b97f4a7c15ULL) >> 32) & (nslots - 1);
+}
+
+static long txn_find(const journal_txn *txn, uint64_t block) {
+    unsigned int i;
+    if (txn->count == 0) {
+        return -1;
+    }
+    for (i = txn_hash(block, txn->nslots); txn->slots[i] != 0; i = (i + 1) & (txn->nslots - 1)) {
+        if (txn->homes[txn->slots[i] - 1] == block) {
+            return txn->slots[i] - 1;
+        }
+    }
+    return -1;
+}
+
+static int txn_grow(journal_txn *txn) {
+    unsigned int capacity = txn->capacity ? txn->capacity * 2 : 64, i;
+    uint64_t *homes = realloc(txn->homes, capacity * sizeof(uint64_t));
+    if (homes == NULL) {
+        return -ENOMEM;
+    }
+    txn->homes = homes;
+    char *images = realloc(txn->images, (size_t) capacity * BLOCK_SIZE);
+    if (images == NULL) {
+        return -ENOMEM;
+    }
+    txn->images = images;
+    unsigned int *slots = calloc(capacity * 4, sizeof(unsigned int));
+    if (slots == NULL) {
+        return -ENOMEM;
+    }
+    free(txn->slots);
+    txn->slots = slots;
+    txn->nslots = capacity * 4;
+    txn->capacity = capacity;
+    for (i = 0; i < txn->count; i++) {
+        unsigned int s = txn_hash(txn->homes[i], txn->nslots);
+        while (txn->slots[s] != 0) {
+            s = (s + 1) & (txn->nslots - 1);
+        }
+        txn->slots[s] = i + 1;
+    }
+    return 0;
+}
+
+static int txn_put(journal_txn *txn, uint64_t block, const void *buf) {
+    long i = txn_find(txn, block);
+    if (i < 0) {
+        if (txn->count == txn->capacity && txn_grow(txn) < 0) {
+            return -ENOMEM;
+        }
+        unsigned int s = txn_hash(block, txn->nslots);
+        while (txn->slots[s] != 0) {
+            s = (s + 1) & (txn->nslots - 1);
+        }
+        i = txn->count++;
+        txn->slots[s] = (unsigned int) i + 1;
+        txn->homes[i] = block;
+    }
+    memcpy(&txn->images[(size_t) i * BLOCK_SIZE], buf, BLOCK_SIZE);
+    return 0;
+}
+
+/** Empty a transaction, keeping its buffers for the next one */
+static void txn_reset(journal_txn *txn) {
+    if (txn->count > 0) {
+        memset(txn->slots, 0, txn->nslots * sizeof(unsigned int));
+    }
+    txn->count = 0;
+    txn->nfreed = 0;
+}
+
+static void txn_free(journal_txn *txn) {
+    free(txn->homes);
+    free(txn->images);
+    free(txn->slots);
+    free(txn->freed);
+}
+
+int meta_read(sfs_fs *fs, uint64_t block, void *buf) {
+    struct journal *j = fs->journal;
+    if (j == NULL) {
+        return block_read(fs->disk, block, buf);
+    }
+    pthread_rwlock_rdlock(&j->map_lock);
+    const journal_txn *txn = j->running;
+    long i = txn_find(txn, block);
+    if (i < 0 && j->committing != NULL) {
+        txn = j->committing;
+        i = txn_find(txn, block);
+    }
+    if (i >= 0) {
+        memcpy(buf, &txn->images[(size_t) i * BLOCK_SIZE], BLOCK_SIZE);
+    }
+    pthread_rwlock_unlock(&j->map_lock);
+    return i >= 0 ? BLOCK_SIZE : block_read(fs->disk, block, buf);
+}
+
+int meta_write(sfs_fs *fs, uint64_t block, const void *buf) {
+    struct journal *j = fs->journal;
+    if (j == NULL) {
+        return block_write(fs->disk, block, buf);
+    }
+    pthread_rwlock_wrlock(&j->map_lock);
+    int ret = txn_put(j->running, block, buf);
+    int full = journal_full(fs, j->running);
+    pthread_rwlock_unlock(&j->map_lock);
+    if (ret < 0) {
+        log_error(LOG_CAT_JOURNAL, "meta_write: block %llu: %s\n", (unsigned long long) block, strerror(-ret));
+        return ret;
+    }
+    if (full) {
+        pthread_mutex_lock(&j->mutex);
+        j->force = 1;
+        pthread_cond_signal(&j->wake);
+        pthread_mutex_unlock(&j->mutex);
+    }
+    return BLOCK_SIZE;
+}
+
+static int txn_add_freed(journal_txn *txn, uint64_t block, unsigned int count) {
+    if (txn->nfreed == txn->freed_capacity) {
+        unsigned int capacity = txn->freed_capacity ? txn->freed_capacity * 2 : 64;
+        freed_run *freed = realloc(txn->freed, capacity * sizeof(freed_run));
+        if (freed == NULL) {
+            return -ENOMEM;
+        }
+        txn->freed = freed;
+        txn->freed_capacity = capacity;
+    }
+    // Runs usually come in block order, from truncating a file front to back
+    if (txn->nfreed > 0) {
+        freed_run *last = &txn->freed[txn->nfreed - 1];
+        if (last->block + last->count == block && last->count <= UINT_MAX - count) {
+            last->count += count;
+            return 0;
+        }
+    }
+    txn->freed[txn->nfreed].block = block;
+    txn->freed[txn->nfreed].count = count;
+    txn->nfreed++;
+    return 0;
+}
+
+int journal_defer_free(sfs_fs *fs, uint64_t block, unsigned int count) {
+    return txn_add_freed(fs->journal->running, block, count);
+}
+
+static int journal_compare_freed(const void *a, const void *b) {
+    uint64_t x = ((const freed_run *) a)->block, y = ((const freed_run *) b)->block;
+    return x < y ? -1 : x > y;
+}
+
+/** Sort the freed runs of txn and join those that touch within a group */
+static void journal_merge_freed(sfs_fs *fs, journal_txn *txn) {
+    unsigned int i, n = 0;
+    qsort(txn->freed, txn->nfreed, sizeof(freed_run), journal_compare_freed);
+    for (i = 1; i < txn->nfreed; i++) {
+        freed_run *last = &txn->freed[n], *run = &txn->freed[i];
+        if (last->block + last->count == run->block && last->count <= UINT_MAX - run->count
+            && last->block / fs->sb.blocks_per_group == run->block / fs->sb.blocks_per_group) {
+            last->count += run->count;
+        } else {
+            txn->freed[++n] = *run;
+        }
+    }
+    txn->nfreed = n + 1;
+}
+
+typedef struct journal_slot {
+    uint64_t home;
+    unsigned int index;
+} journal_slot;
+
+static int journal_compare_slots(const void *a, const void *b) {
+    uint64_t x = ((const journal_slot *) a)->home, y = ((const journal_slot *) b)->home;
+    return x < y ? -1 : x > y;
+}
+
+/** Write every image of txn to its home location, in block order */
+static int journal_checkpoint(sfs_fs *fs, const journal_txn *txn) {
+    journal_slot *order = malloc(txn->count * sizeof(journal_slot));
+    unsigned int i;
+    int ret = 0;
+    if (order == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < txn->count; i++) {
+        order[i].home = txn->homes[i];
+        order[i].index = i;
+    }
+    qsort(order, txn->count, sizeof(journal_slot), journal_compare_slots);
+    for (i = 0; i < txn->count; i++) {
+        if (block_write(fs->disk, order[i].home, &txn->images[(size_t) order[i].index * BLOCK_SIZE])
+            != BLOCK_SIZE) {
+            ret = -EIO;
+        }
+    }
+    free(order);
+    return ret;
+}
+
+/** Write txn to its half of the journal region and make it durable */
+static int journal_write_txn(sfs_fs *fs, const journal_txn *txn) {
+    uint64_t start = journal_area(fs, txn->sequence);
+    unsigned int runs = (txn->nfreed + JOURNAL_RUNS_PER_BLOCK - 1) / JOURNAL_RUNS_PER_BLOCK;
+    unsigned int tags = (txn->count + JOURNAL_TAGS_PER_BLOCK - 1) / JOURNAL_TAGS_PER_BLOCK;
+    char *lists = calloc(runs + tags, BLOCK_SIZE);
+    journal_run *run_blocks = (journal_run *) lists;
+    char header_block[BLOCK_SIZE];
+    journal_header *header = (journal_header *) header_block;
+    unsigned int i;
+    int ret;
+
+    if (lists == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < txn->nfreed; i++) {
+        run_blocks[i].block = txn->freed[i].block;
+        run_blocks[i].count = txn->freed[i].count;
+    }
+    memcpy(lists + (size_t) runs * BLOCK_SIZE, txn->homes, txn->count * sizeof(uint64_t));
+    ret = block_write_range(fs->disk, start + 1, runs + tags, lists);
+    if (ret == 0) {
+        ret = block_write_range(fs->disk, start + 1 + runs + tags, txn->count, txn->images);
+    }
+    // Flushes the images, the file data written by the same operations and
+    // the checkpoint of the transaction before, which is not replayed again
+    // once this header is in place
+    if (ret == 0) {
+        ret = disk_sync(fs->disk);
+    }
+    if (ret == 0) {
+        memset(header_block, 0, BLOCK_SIZE);
+        header->magic = JOURNAL_MAGIC;
+        header->count = txn->count;
+        header->runs = txn->nfreed;
+        header->sequence = txn->sequence;
+        header->checksum = journal_checksum(JOURNAL_CHECKSUM_SEED, lists, (size_t) (runs + tags) * BLOCK_SIZE);
+        header->checksum = journal_checksum(header->checksum, txn->images, (size_t) txn->count * BLOCK_SIZE);
+        ret = block_write(fs->disk, start, header_block) == BLOCK_SIZE ? disk_sync(fs->disk) : -EIO;
+    }
+    free(lists);
+    return ret;
+}
+
+/** Leave neither half of the journal with a transaction to replay */
+static int journal_clear(sfs_fs *fs) {
+    char zero[BLOCK_SIZE];
+    memset(zero, 0, BLOCK_SIZE);
+    if (block_write(fs->disk, journal_area(fs, 0), zero) != BLOCK_SIZE
+        || block_write(fs->disk, journal_area(fs, 1), zero) != BLOCK_SIZE) {
+        return -EIO;
+    }
+    return disk_sync(fs->disk);
+}
+
+/**
+ * Find the newer of the transactions committed to the two halves of the
+ * journal, if either is whole
+ * @return 1 with its header, and its run, tag and image blocks in *body to
+ * be freed, 0 if there is none, or -errno
+ */
+static int journal_last(sfs_fs *fs, journal_header *last, char **body) {
+    uint64_t half = fs->sb.journal_blocks / 2, start, blocks;
+    char header_block[BLOCK_SIZE];
+    const journal_header *header = (const journal_header *) header_block;
+    unsigned int h;
+    int found = 0;
+
+    *body = NULL;
+    for (h = 0; h < 2; h++) {
+        start = fs->sb.journal_start + h * half;
+        if (block_read(fs->disk, start, header_block) < 0) {
+            free(*body);
+            return -EIO;
+        }
+        if (header->magic != JOURNAL_MAGIC || (found && header->sequence <= last->sequence)) {
+            continue;
+        }
+        if ((header->count == 0 && header->runs == 0) || header->sequence % 2 != h
+            || journal_span(header->count, header->runs) > half) {
+            log_warn(LOG_CAT_JOURNAL, "journal: bad header in half %u, ignored\n", h);
+            continue;
+        }
+        blocks = journal_span(header->count, header->runs) - 1;
+        char *data = malloc(blocks * BLOCK_SIZE);
+        if (data == NULL || block_read_range(fs->disk, start + 1, (unsigned int) blocks, data) < 0) {
+            free(data);
+            free(*body);
+            return data == NULL ? -ENOMEM : -EIO;
+        }
+        if (journal_checksum(JOURNAL_CHECKSUM_SEED, data, blocks * BLOCK_SIZE) != header->checksum) {
+            // The crash came before the header was written over an old one
+            log_warn(LOG_CAT_JOURNAL, "journal: transaction %llu incomplete, ignored\n",
+                     (unsigned long long) header->sequence);
+            free(data);
+            continue;
+        }
+        free(*body);
+        *body = data;
+        *last = *header;
+        found = 1;
+    }
+    return found;
+}
+
+int journal_error(sfs_fs *fs) {
+    struct journal *j = fs->journal;
+    if (j == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&j->mutex);
+    int ret = j->error;
+    pthread_mutex_unlock(&j->mutex);
+    return ret;
+}
+
+void journal_abort(sfs_fs *fs, int err) {
+    struct journal *j = fs->journal;
+    if (j == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&j->mutex);
+    j->error = err;
+    j->busy = 0;
+    pthread_cond_broadcast(&j->done);
+    pthread_mutex_unlock(&j->mutex);
+}
+
+/**
+ * Give back the blocks the transaction checkpointed last freed, then close
+ * the running transaction for committing. Caller holds fs->lock
+ * exclusively, so that no operation is half done, and no other
+ * transaction is closed and not yet checkpointed.
+ * @return 1 if there was anything to commit, 0 if not, or -errno if the
+ * data appended to the log could not be written, which stops the journal
+ */
+static int journal_close(sfs_fs *fs) {
+    struct journal *j = fs->journal;
+    journal_txn *txn = j->running, *next = txn == &j->txns[0] ? &j->txns[1] : &j->txns[0];
+    unsigned int i;
+
+    if (journal_error(fs) < 0) {
+        return 0;
+    }
+    // The data appended to the log goes out with the same flush as the
+    // journal; no metadata pointing at it may commit without it
+    int ret = lfs_flush(fs);
+    if (ret < 0) {
+        log_error(LOG_CAT_JOURNAL, "journal: transaction %llu not committed, no more commits: %s\n",
+                  (unsigned long long) txn->sequence, strerror(-ret));
+        journal_abort(fs, ret);
+        return ret;
+    }
+    // Nothing at home refers to these any more. Should this transaction
+    // not commit, the runs of the last one are still on disk.
+    if (j->reclaimable != NULL) {
+        for (i = 0; i < j->reclaimable->nfreed; i++) {
+            reclaim_blocks(fs, j->reclaimable->freed[i].block, j->reclaimable->freed[i].count);
+        }
+        if (j->reclaimable->nfreed > 0) {
+            write_superblock(fs);
+        }
+        pthread_rwlock_wrlock(&j->map_lock);
+        j->reclaimable = NULL;
+        pthread_rwlock_unlock(&j->map_lock);
+    }
+    if (txn->count == 0 && txn->nfreed == 0) {
+        return 0;
+    }
+    if (txn->nfreed > 1) {
+        journal_merge_freed(fs, txn);
+    }
+    txn_reset(next);
+    pthread_rwlock_wrlock(&j->map_lock);
+    j->committing = txn;
+    j->running = next;
+    j->running->sequence = txn->sequence + 1;
+    pthread_rwlock_unlock(&j->map_lock);
+    pthread_mutex_lock(&j->mutex);
+    j->busy = 1;
+    pthread_mutex_unlock(&j->mutex);
+    return 1;
+}
+
+/**
+ * Commit the transaction journal_close closed, then checkpoint it and
+ * discard the blocks it freed, without fs->lock. After a failure it stays
+ * the committing one for meta_read to find, and nothing is committed again.
+ */
+static void journal_write_closed(sfs_fs *fs) {
+    struct journal *j = fs->journal;
+    journal_txn *txn = j->committing;
+    uint64_t span = journal_span(txn->count, txn->nfreed);
+    int in_place = span > fs->sb.journal_blocks / 2;
+    unsigned int i;
+    int ret;
+
+    stats_timer timer = stats_timer_start(STAT_JOURNAL_COMMIT);
+    if (!in_place) {
+        ret = journal_write_txn(fs, txn);
+        stats_add(STAT_JOURNAL_BLOCKS, span);
+    } else {
+        // Too big for its half of the journal: write it in place, without
+        // atomicity, once no older transaction can be replayed over it. The
+        // blocks it frees leak if the next one does not commit.
+        log_warn(LOG_CAT_JOURNAL, "journal: transaction %llu has %u blocks, more than the journal holds\n",
+                 (unsigned long long) txn->sequence, txn->count);
+        ret = journal_clear(fs);
+        if (ret == 0) {
+            ret = journal_checkpoint(fs, txn);
+        }
+        if (ret == 0) {
+            ret = disk_sync(fs->disk);
+        }
+    }
+    stats_timer_stop(&timer);
+    if (ret == 0) {
+        pthread_mutex_lock(&j->mutex);
+        j->committed = txn->sequence;
+        pthread_cond_broadcast(&j->done);
+        pthread_mutex_unlock(&j->mutex);
+        if (!in_place) {
+            ret = journal_checkpoint(fs, txn);
+        }
+    }
+    if (ret < 0) {
+        log_error(LOG_CAT_JOURNAL, "journal: transaction %llu failed, no more commits: %s\n",
+                  (unsigned long long) txn->sequence, strerror(-ret));
+        journal_abort(fs, ret);
+        return;
+    }
+    log_debug(LOG_CAT_JOURNAL, "journal: transaction %llu, %u blocks, %u freed runs\n",
+              (unsigned long long) txn->sequence, txn->count, txn->nfreed);
+
+    // Until the next transaction marks them free nobody can take the freed
+    // blocks, so they are discarded now, without the lock
+    if (fs->opts.discard) {
+        for (i = 0; i < txn->nfreed; i++) {
+            discard_blocks(fs, txn->freed[i].block, txn->freed[i].count);
+        }
+    }
+    pthread_rwlock_wrlock(&j->map_lock);
+    j->committing = NULL;
+    j->reclaimable = txn;
+    pthread_rwlock_unlock(&j->map_lock);
+    pthread_mutex_lock(&j->mutex);
+    j->busy = 0;
+    pthread_cond_broadcast(&j->done);
+    pthread_mutex_unlock(&j->mutex);
+}
+
+/**
+ * Close the running transaction and commit it, then checkpoint it
+ * @return 1 if there was anything to commit, 0 if not
+ */
+static int journal_commit_running(sfs_fs *fs) {
+    pthread_rwlock_wrlock(&fs->lock);
+    int closed = journal_close(fs) > 0;
+    pthread_rwlock_unlock(&fs->lock);
+    if (closed) {
+        journal_write_closed(fs);
+    }
+    return closed;
+}
+
+int journal_split(sfs_fs *fs, inode *ino) {
+    struct journal *j = fs->journal;
+    if (j == NULL || !journal_full(fs, j->running)) {
+        return 0;
+    }
+    if (ino != NULL) {
+        write_inode(fs, ino);
+    }
+    write_superblock(fs);
+    // The commit thread checkpoints without fs->lock
+    pthread_mutex_lock(&j->mutex);
+    while (j->busy) {
+        pthread_cond_wait(&j->done, &j->mutex);
+    }
+    pthread_mutex_unlock(&j->mutex);
+    if (journal_close(fs) > 0) {
+        journal_write_closed(fs);
+    }
+    return journal_error(fs);
+}
+
+static void *journal_thread(void *arg) {
+    sfs_fs *fs = arg;
+    struct journal *j = fs->journal;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&j->mutex);
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) (j->interval_ms % 1000) * 1000000;
+        deadline.tv_sec += j->interval_ms / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!j->stop && !j->force
+               && pthread_cond_timedwait(&j->wake, &j->mutex, &deadline) != ETIMEDOUT);
+        int stop = j->stop;
+        j->force = 0;
+        pthread_mutex_unlock(&j->mutex);
+        inode_times_flush(fs, 0, time(NULL) - LAZYTIME_EXPIRE_SECS);
+        // Giving back freed blocks dirties bitmaps, so stopping takes until
+        // a commit finds nothing to do
+        int more = journal_commit_running(fs);
+        pthread_mutex_lock(&j->mutex);
+        if (stop && !more) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&j->mutex);
+    return NULL;
+}
+
+int journal_start(sfs_fs *fs) {
+    journal_header last;
+    char *body;
+    const journal_run *runs;
+    unsigned int i;
+
+    // The runs of the transaction committed last, which journal_recover
+    // left, are given back by the first one of this mount
+    int ret = journal_last(fs, &last, &body);
+    if (ret < 0) {
+        return ret;
+    }
+    struct journal *j = calloc(1, sizeof(struct journal));
+    if (j == NULL) {
+        free(body);
+        return -ENOMEM;
+    }
+    j->running = &j->txns[0];
+    j->running->sequence = ret > 0 ? last.sequence + 1 : 1;
+    for (runs = (const journal_run *) body, i = 0; ret > 0 && i < last.runs; i++) {
+        if (runs[i].count == 0 || runs[i].block >= fs->sb.total_blocks
+            || runs[i].count > fs->sb.total_blocks - runs[i].block
+            || runs[i].block / fs->sb.blocks_per_group
+               != (runs[i].block + runs[i].count - 1) / fs->sb.blocks_per_group) {
+            log_warn(LOG_CAT_JOURNAL, "journal_start: bad freed run %llu+%u, ignored\n",
+                     (unsigned long long) runs[i].block, runs[i].count);
+        } else if (txn_add_freed(&j->txns[1], runs[i].block, runs[i].count) < 0) {
+            ret = -ENOMEM;
+        }
+    }
+    free(body);
+    if (ret < 0) {
+        txn_free(&j->txns[1]);
+        free(j);
+        return ret;
+    }
+    j->reclaimable = &j->txns[1];
+    pthread_mutex_init(&j->mutex, NULL);
+    pthread_cond_init(&j->wake, NULL);
+    pthread_cond_init(&j->done, NULL);
+    pthread_rwlock_init(&j->map_lock, NULL);
+    j->interval_ms = fs->opts.commit_interval_ms ? fs->opts.commit_interval_ms : JOURNAL_COMMIT_INTERVAL_MS;
+    fs->journal = j;
+    ret = pthread_create(&j->thread, NULL, journal_thread, fs);
+    if (ret != 0) {
+        fs->journal = NULL;
+        txn_free(&j->txns[1]);
+        pthread_rwlock_destroy(&j->map_lock);
+        pthread_cond_destroy(&j->done);
+        pthread_cond_destroy(&j->wake);
+        pthread_mutex_destroy(&j->mutex);
+        free(j);
+        return -ret;
+    }
+    return 0;
+}
+
+void journal_stop(sfs_fs *fs) {
+    struct journal *j = fs->journal;
+    if (j == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&j->mutex);
+    j->stop = 1;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->mutex);
+    pthread_join(j->thread, NULL);
+    // Everything is home and given back: the next mount has nothing to replay
+    if (j->error == 0) {
+        journal_clear(fs);
+    }
+    fs->journal = NULL;
+    txn_free(&j->txns[0]);
+    txn_free(&j->txns[1]);
+    pthread_rwlock_destroy(&j->map_lock);
+    pthread_cond_destroy(&j->done);
+    pthread_cond_destroy(&j->wake);
+    pthread_mutex_destroy(&j->mutex);
+    free(j);
+}
+
+int journal_commit(sfs_fs *fs) {
+    struct journal *j = fs->journal;
+    if (j == NULL) {
+        return disk_sync(fs->disk);
+    }
+    pthread_rwlock_rdlock(&fs->lock);
+    pthread_rwlock_rdlock(&j->map_lock);
+    uint64_t target = j->running->sequence;
+    // Blocks freed by the last transaction are given back by the next
+    int empty = j->running->count == 0 && (j->reclaimable == NULL || j->reclaimable->nfreed == 0);
+    pthread_rwlock_unlock(&j->map_lock);
+    pthread_rwlock_unlock(&fs->lock);
+    // Only file data can be outstanding; a transaction being committed
+    // is waited for all the same
+    pthread_mutex_lock(&j->mutex);
+    if (empty) {
+        target--;
+    } else {
+        j->force = 1;
+        pthread_cond_signal(&j->wake);
+    }
+    while (j->committed < target && j->error == 0) {
+        pthread_cond_wait(&j->done, &j->mutex);
+    }
+    int ret = j->error;
+    pthread_mutex_unlock(&j->mutex);
+    return ret < 0 ? ret : empty ? disk_sync(fs->disk) : 0;
+}
+
+int journal_recover(sfs_fs *fs) {
+    journal_header last;
+    char *body, header_block[BLOCK_SIZE];
+    uint64_t journal_end = fs->sb.journal_start + fs->sb.journal_blocks;
+    unsigned int i;
+
+    int ret = journal_last(fs, &last, &body);
+    if (ret <= 0 || last.count == 0) {
+        free(body);
+        return ret < 0 ? ret : 0;
+    }
+    unsigned int runs = (last.runs + JOURNAL_RUNS_PER_BLOCK - 1) / JOURNAL_RUNS_PER_BLOCK;
+    unsigned int tags = (last.count + JOURNAL_TAGS_PER_BLOCK - 1) / JOURNAL_TAGS_PER_BLOCK;
+    const uint64_t *homes = (const uint64_t *) (body + (size_t) runs * BLOCK_SIZE);
+    const char *images = body + (size_t) (runs + tags) * BLOCK_SIZE;
+    ret = 0;
+    for (i = 0; ret == 0 && i < last.count; i++) {
+        if (homes[i] >= fs->sb.total_blocks || (homes[i] >= fs->sb.journal_start && homes[i] < journal_end)) {
+            ret = -EINVAL;
+            break;
+        }
+        if (block_write(fs->disk, homes[i], &images[(size_t) i * BLOCK_SIZE]) != BLOCK_SIZE) {
+            ret = -EIO;
+        }
+    }
+    if (ret == 0) {
+        ret = disk_sync(fs->disk);
+    }
+    // With its images home, what is left of the transaction are the runs
+    // it freed, for journal_start to give back. It stays the newer one, so
+    // the older is not replayed over it.
+    if (ret == 0 && last.runs == 0) {
+        ret = journal_clear(fs);
+    } else if (ret == 0) {
+        last.count = 0;
+        last.checksum = journal_checksum(JOURNAL_CHECKSUM_SEED, body, (size_t) runs * BLOCK_SIZE);
+        memset(header_block, 0, BLOCK_SIZE);
+        memcpy(header_block, &last, sizeof(journal_header));
+        ret = block_write(fs->disk, journal_area(fs, last.sequence), header_block) == BLOCK_SIZE
+              ? disk_sync(fs->disk) : -EIO;
+    }
+    log_info(LOG_CAT_JOURNAL, "journal_recover: replayed transaction %llu, %u blocks, %u freed runs: %d\n",
+             (unsigned long long) last.sequence, i, last.runs, ret);
+    free(body);
+    return ret < 0 ? ret : 1;
+}
@@ -0,0 +1,68 @@
+//
+// Write-ahead journal for metadata blocks.
+//
+// Metadata (superblock, group descriptors, bitmaps, inodes, directory,
+// pointer and index blocks) is read and written through meta_read and
+// meta_write instead of block_read and block_write.  Writes land in the
+// running transaction in memory.  A commit thread closes that transaction
+// every commit interval, or sooner when it fills half the journal or on
+// fsync, so the updates of many concurrent operations go to the journal
+// region as one sequential write.  The blocks are then checkpointed to
+// their home locations in the background; on mount the last committed
+// transaction is replayed.  Operations that may touch more metadata than
+// half the journal holds commit part way through with journal_split.
+// Should a commit fail, nothing is committed after it, and every later
+// update fails with the error.
+//
+// File data bypasses the journal.  It lives in the same image file, so the
+// flush before each commit record also orders the data written by the
+// operations in that transaction before their metadata.
+//
+
+#ifndef SFS_JOURNAL_H
+#define SFS_JOURNAL_H
+
+#include <stdint.h>
+
+#include "sfs_helper_functions.h"
+
+// File blocks an operation goes through between calls to journal_split
+#define JOURNAL_SPLIT_BLOCKS 1024
+
+// Replay a committed transaction left in the journal region by a crash.
+// Returns 1 if one was replayed, 0 if the journal was clean, or -errno.
+int journal_recover(sfs_fs *fs);
+
+int journal_start(sfs_fs *fs);
+
+// Commit and checkpoint everything, then stop the commit thread
+void journal_stop(sfs_fs *fs);
+
+// Make every operation completed so far durable, or return the error that
+// stopped the journal. Must be called without fs->lock.
+int journal_commit(sfs_fs *fs);
+
+// The error a commit failed with, 0 if none has
+int journal_error(sfs_fs *fs);
+
+// Stop committing for good after err, as a failed commit does, and wake
+// everybody waiting on a commit
+void journal_abort(sfs_fs *fs, int err);
+
+// Commit what the running transaction holds once it is filling up, with ino
+// (if not NULL) and the superblock written first. For operations that hold
+// fs->lock exclusively across many blocks, between steps that leave the
+// file system consistent. Returns 0, or the error that stopped the journal.
+int journal_split(sfs_fs *fs, inode *ino);
+
+// Keep count blocks from block on allocated until the running transaction,
+// which frees them, has committed. Returns 0, or -errno if the caller must
+// free them at once.
+int journal_defer_free(sfs_fs *fs, uint64_t block, unsigned int count);
+
+// Like block_read and block_write, for metadata blocks: BLOCK_SIZE on
+// success, negative on failure
+int meta_read(sfs_fs *fs, uint64_t block, void *buf);
+int meta_write(sfs_fs *fs, uint64_t block, const void *buf);
+
+#endif //SFS_JOURNAL_H
@@ -0,0 +1,488 @@
+//
+// Log-structured write mode, see lfs.h.
+//
+
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "dedup.h"
+#include "journal.h"
+#include "lfs.h"
+#include "log.h"
+#include "stats.h"
+
+// The cleaner looks at the segments this often, and works once fewer than
+// LFS_CLEAN_MIN_FREE (or a quarter of all) segments are free. It moves the
+// data out of the LFS_CLEAN_BATCH emptiest segments at most 3/4 full.
+// Writes leave the last LFS_RESERVE_SEGMENTS free segments to the cleaner,
+// which needs somewhere to move that data to.
+#define LFS_CLEAN_INTERVAL_MS 1000
+#define LFS_CLEAN_MIN_FREE 8
+#define LFS_CLEAN_BATCH 8
+#define LFS_CLEAN_MAX_USED (LFS_SEGMENT_BLOCKS * 3 / 4)
+#define LFS_RESERVE_SEGMENTS 1
+
+_Static_assert(LFS_SEGMENT_DATA + 2 <= LFS_SUMMARY_BLOCKS * SEGMENT_ENTRIES_PER_BLOCK,
+               "the summary names every block of its segment");
+
+struct lfs {
+    // The log head; all of these change under fs->lock held exclusively
+    uint64_t start;         // first block of the current segment, 0 if there is none
+    uint64_t head;          // the next block to append
+    uint64_t flushed;       // the blocks from start up to here are on disk
+    uint64_t next;          // where the search for the next segment begins
+    int search_failed;      // no free segment was found, and since then
+    uint64_t failed_free;   // sb.free_blocks has not grown beyond this
+    char *buffer;           // LFS_SEGMENT_BLOCKS blocks, the current segment and its summary
+
+    pthread_t cleaner;
+    pthread_mutex_t mutex;  // protects stop
+    pthread_cond_t wake;
+    int stop;
+    uint64_t idle_free;     // sb.free_blocks after a pass that could move nothing
+};
+
+/** Whether block was appended since the last flush, so it lives in the buffer only */
+static int lfs_buffered(const struct lfs *l, uint64_t block) {
+    return block >= l->flushed && block < l->head;
+}
+
+/** The summary of the current segment, at the end of the buffer as it is on disk */
+static segment_entry *lfs_summary(const struct lfs *l) {
+    return (segment_entry *) &l->buffer[(size_t) LFS_SEGMENT_DATA * BLOCK_SIZE];
+}
+
+/** Whether summary starts with the header this file system's log gives the summary of segment */
+static int lfs_summary_valid(const sfs_fs *fs, uint64_t segment, const segment_entry *summary) {
+    return summary[0].inum == SEGMENT_SUMMARY_MAGIC
+           && summary[0].index == (unsigned int) (segment / LFS_SEGMENT_BLOCKS)
+           && summary[1].inum == (unsigned int) fs->sb.log_id
+           && summary[1].index == (unsigned int) (fs->sb.log_id >> 32);
+}
+
+int data_read(sfs_fs *fs, uint64_t block, void *buf) {
+    const struct lfs *l = fs->lfs;
+    if (l != NULL && lfs_buffered(l, block)) {
+        memcpy(buf, &l->buffer[(block - l->start) * BLOCK_SIZE], BLOCK_SIZE);
+        return BLOCK_SIZE;
+    }
+    return block_read(fs->disk, block, buf);
+}
+
+int data_write(sfs_fs *fs, uint64_t block, const void *buf) {
+    struct lfs *l = fs->lfs;
+    if (l != NULL && lfs_buffered(l, block)) {
+        memcpy(&l->buffer[(block - l->start) * BLOCK_SIZE], buf, BLOCK_SIZE);
+        return BLOCK_SIZE;
+    }
+    return block_write(fs->disk, block, buf);
+}
+
+int lfs_flush(sfs_fs *fs) {
+    struct lfs *l = fs->lfs;
+    uint64_t k;
+    if (l == NULL || l->head == l->flushed) {
+        return 0;
+    }
+    int ret = block_write_range(fs->disk, l->flushed, (unsigned int) (l->head - l->flushed),
+                                &l->buffer[(l->flushed - l->start) * BLOCK_SIZE]);
+    if (ret < 0) {
+        log_error(LOG_CAT_ALLOC, "lfs_flush: blocks %llu-%llu: %s\n", (unsigned long long) l->flushed,
+                  (unsigned long long) l->head - 1, strerror(-ret));
+        return ret;
+    }
+    // The summary blocks naming them are metadata, committed with the
+    // pointers to them
+    for (k = (l->flushed - l->start + 2) / SEGMENT_ENTRIES_PER_BLOCK;
+         k <= (l->head - l->start + 1) / SEGMENT_ENTRIES_PER_BLOCK; k++) {
+        ret = meta_write(fs, l->start + LFS_SEGMENT_DATA + k, &l->buffer[(LFS_SEGMENT_DATA + k) * BLOCK_SIZE]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    l->flushed = l->head;
+    return 0;
+}
+
+static void lfs_wake_cleaner(struct lfs *l) {
+    pthread_mutex_lock(&l->mutex);
+    pthread_cond_signal(&l->wake);
+    pthread_mutex_unlock(&l->mutex);
+}
+
+/**
+ * Flush the current segment and move the log head to the next free one;
+ * for a write rather than the cleaner, only if that leaves the reserve
+ */
+static int lfs_next_segment(sfs_fs *fs, int cleaner) {
+    struct lfs *l = fs->lfs;
+    uint64_t count = fs->sb.total_blocks / LFS_SEGMENT_BLOCKS, i, found = 0, segment = 0;
+    segment_entry *summary = lfs_summary(l);
+    unsigned int needed = cleaner ? 1 : 1 + LFS_RESERVE_SEGMENTS;
+    int ret = lfs_flush(fs);
+    if (ret < 0) {
+        return ret;
+    }
+    l->start = l->head = l->flushed = 0;
+    // Searching again is pointless until something has been freed
+    if (!cleaner && l->search_failed && fs->sb.free_blocks <= l->failed_free) {
+        return -ENOSPC;
+    }
+    for (i = 0; i < count && found < needed; i++) {
+        uint64_t candidate = (l->next / LFS_SEGMENT_BLOCKS + i) % count * LFS_SEGMENT_BLOCKS;
+        if (fs->groups[candidate / fs->sb.blocks_per_group].free_blocks >= LFS_SEGMENT_BLOCKS
+            && count_used_blocks(fs, candidate, LFS_SEGMENT_BLOCKS) == 0 && found++ == 0) {
+            segment = candidate;
+        }
+    }
+    if (found == needed) {
+        for (i = LFS_SEGMENT_DATA; i < LFS_SEGMENT_BLOCKS; i++) {
+            claim_block(fs, segment + i);
+        }
+        memset(summary, 0, (size_t) LFS_SUMMARY_BLOCKS * BLOCK_SIZE);
+        summary[0].inum = SEGMENT_SUMMARY_MAGIC;
+        summary[0].index = (unsigned int) (segment / LFS_SEGMENT_BLOCKS);
+        summary[1].inum = (unsigned int) fs->sb.log_id;
+        summary[1].index = (unsigned int) (fs->sb.log_id >> 32);
+        fs->sb.log_segments++;
+        l->start = l->head = l->flushed = segment;
+        l->next = segment + LFS_SEGMENT_BLOCKS;
+        l->search_failed = 0;
+        return 0;
+    }
+    if (!cleaner) {
+        if (!l->search_failed) {
+            log_warn(LOG_CAT_ALLOC, "lfs: free segments used up, writing in place\n");
+        }
+        l->search_failed = 1;
+        l->failed_free = fs->sb.free_blocks;
+    }
+    lfs_wake_cleaner(l);
+    return -ENOSPC;
+}
+
+/**
+ * Allocate the block at the log head and put buf in it, for block index of
+ * inode inum
+ * @return the block, or 0 if there is no free segment to go to
+ */
+static uint64_t lfs_append(sfs_fs *fs, const void *buf, unsigned int inum, uint64_t index, int cleaner) {
+    struct lfs *l = fs->lfs;
+    // A block taken by some other allocation ends the segment early
+    while (l->start == 0 || l->head == l->start + LFS_SEGMENT_DATA || claim_block(fs, l->head) < 0) {
+        if (lfs_next_segment(fs, cleaner) < 0) {
+            return 0;
+        }
+    }
+    memcpy(&l->buffer[(l->head - l->start) * BLOCK_SIZE], buf, BLOCK_SIZE);
+    lfs_summary(l)[l->head - l->start + 2].inum = inum;
+    lfs_summary(l)[l->head - l->start + 2].index = (unsigned int) index;
+    return l->head++;
+}
+
+/**
+ * Move block index of ino to the log head with buf as its contents, and
+ * free the old copy
+ * @return 0, 1 if there is no free segment to go to, or -errno
+ */
+static int lfs_relocate(sfs_fs *fs, inode *ino, uint64_t index, const void *buf, int cleaner) {
+    uint64_t block = lfs_append(fs, buf, ino->inum, index, cleaner);
+    if (block == 0) {
+        return 1;
+    }
+    int ret = inode_bmap_set(fs, ino, index, &block);
+    if (ret < 0) {
+        release_block(fs, block);
+        return ret;
+    }
+    // The old copy stays allocated until this transaction has committed
+    release_block(fs, block);
+    return 0;
+}
+
+int lfs_write(sfs_fs *fs, inode *ino, uint64_t index, unsigned int offset, const void *data, size_t len) {
+    struct lfs *l = fs->lfs;
+    char buffer[BLOCK_SIZE];
+    uint64_t old;
+    int ret = inode_bmap(fs, ino, index, &old);
+    if (ret < 0) {
+        return ret;
+    }
+    // Nothing committed points at a block appended since the last flush,
+    // so that one can be updated where it is, unless another file shares it
+    if (old != 0 && lfs_buffered(l, old) && dedup_refs(fs, old) == 1) {
+        dedup_forget(fs, old);
+        memcpy(&l->buffer[(old - l->start) * BLOCK_SIZE + offset], data, len);
+        return 0;
+    }
+    if (len < BLOCK_SIZE) {
+        if (old != 0 && !BMAP_IS_UNWRITTEN(old)) {
+            data_read(fs, old, buffer);
+        } else {
+            memset(buffer, 0, BLOCK_SIZE);
+        }
+    }
+    memcpy(&buffer[offset], data, len);
+    return lfs_relocate(fs, ino, index, buffer, 0);
+}
+
+/** Give back the summary of segment once nothing it names lives there any more */
+static void lfs_drop_summary(sfs_fs *fs, uint64_t segment) {
+    char zero[BLOCK_SIZE];
+    // The header is cleared in the same transaction, so that no summary is
+    // trusted once its blocks may be reused
+    memset(zero, 0, BLOCK_SIZE);
+    meta_write(fs, segment + LFS_SEGMENT_DATA, zero);
+    release_blocks(fs, segment + LFS_SEGMENT_DATA, LFS_SUMMARY_BLOCKS);
+    fs->sb.log_segments--;
+}
+
+/**
+ * Move the file data still living in segment to the log head. Its summary
+ * says what was appended there; the inode of each entry is read once for a
+ * run of entries of the same file. Caller holds fs->lock exclusively.
+ * @return 0 once the segment holds no more file data and its summary has
+ * been given back, 1 if some is left there or its summary could not be
+ * read, or -1 once the log is full
+ */
+static int lfs_clean_segment(sfs_fs *fs, uint64_t segment, unsigned long *moved) {
+    segment_entry summary[LFS_SUMMARY_BLOCKS * SEGMENT_ENTRIES_PER_BLOCK];
+    char buffer[BLOCK_SIZE];
+    inode ino;
+    uint64_t block;
+    unsigned int i, left = 0, dirty = 0;
+    int ret = 0;
+
+    for (i = 0; i < LFS_SUMMARY_BLOCKS; i++) {
+        if (meta_read(fs, segment + LFS_SEGMENT_DATA + i, &summary[i * SEGMENT_ENTRIES_PER_BLOCK]) != BLOCK_SIZE) {
+            return 1;
+        }
+    }
+    if (!lfs_summary_valid(fs, segment, summary)) {
+        return 1;
+    }
+    ino.inum = 0;
+    for (i = 0; i < LFS_SEGMENT_DATA; i++) {
+        const segment_entry *e = &summary[i + 2];
+        if (e->inum == 0) {
+            continue;
+        }
+        if (e->inum != ino.inum) {
+            if (dirty) {
+                write_inode(fs, &ino);
+                dirty = 0;
+            }
+            if (read_inode(fs, e->inum, &ino) < 0) {
+                ino.inum = 0;
+                continue;
+            }
+        }
+        // Compressed files are rewritten to new runs on every write, and
+        // left where they are. Long symlink targets live in the log like
+        // file data. Whatever the file block maps to now, the block here is
+        // no longer its.
+        if (ino.type == DIRECTORY || (ino.flags & (INODE_INLINE_DATA | INODE_COMPRESSED))
+            || inode_bmap(fs, &ino, e->index, &block) < 0 || block != segment + i) {
+            continue;
+        }
+        // The summary names one of the files sharing a block, and moving
+        // it for that one would leave the others on the old copy
+        if (dedup_refs(fs, block) > 1) {
+            left++;
+            continue;
+        }
+        data_read(fs, block, buffer);
+        ret = lfs_relocate(fs, &ino, e->index, buffer, 1);
+        if (ret != 0) {
+            break;
+        }
+        dirty = 1;
+        (*moved)++;
+    }
+    if (dirty) {
+        write_inode(fs, &ino);
+    }
+    if (ret == 0 && left == 0) {
+        lfs_drop_summary(fs, segment);
+    }
+    write_superblock(fs);
+    return ret != 0 ? -1 : left != 0;
+}
+
+unsigned int lfs_release_summaries(sfs_fs *fs) {
+    const struct lfs *l = fs->lfs;
+    segment_entry header[SEGMENT_ENTRIES_PER_BLOCK];
+    uint64_t count = fs->sb.total_blocks / LFS_SEGMENT_BLOCKS, i;
+    unsigned int dropped = 0;
+
+    for (i = 0; i < count && fs->sb.log_segments > 0; i++) {
+        uint64_t segment = i * LFS_SEGMENT_BLOCKS;
+        if ((l == NULL || segment != l->start) && count_used_blocks(fs, segment, LFS_SEGMENT_BLOCKS) == LFS_SUMMARY_BLOCKS
+            && count_used_blocks(fs, segment + LFS_SEGMENT_DATA, LFS_SUMMARY_BLOCKS) == LFS_SUMMARY_BLOCKS
+            && meta_read(fs, segment + LFS_SEGMENT_DATA, header) == BLOCK_SIZE
+            && lfs_summary_valid(fs, segment, header)) {
+            lfs_drop_summary(fs, segment);
+            dropped++;
+        }
+    }
+    if (dropped > 0) {
+        write_superblock(fs);
+    }
+    return dropped;
+}
+
+/** One cleaner pass: if free segments are short, empty the emptiest others */
+static void lfs_clean(sfs_fs *fs) {
+    struct lfs *l = fs->lfs;
+    segment_entry header[SEGMENT_ENTRIES_PER_BLOCK];
+    uint64_t victims[LFS_CLEAN_BATCH], count = fs->sb.total_blocks / LFS_SEGMENT_BLOCKS, i;
+    unsigned int used[LFS_CLEAN_BATCH], nvictims = 0, v, emptied = 0, dead = 0;
+    uint64_t free_segments = 0, min_free = count / 4 < LFS_CLEAN_MIN_FREE ? count / 4 : LFS_CLEAN_MIN_FREE;
+    if (min_free <= LFS_RESERVE_SEGMENTS) {
+        min_free = LFS_RESERVE_SEGMENTS + 1;
+    }
+    unsigned long moved = 0;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    if (fs->sb.free_blocks == l->idle_free) {
+        pthread_rwlock_unlock(&fs->lock);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        uint64_t segment = i * LFS_SEGMENT_BLOCKS;
+        unsigned int n = count_used_blocks(fs, segment, LFS_SEGMENT_BLOCKS), k;
+        if (n == 0) {
+            free_segments++;
+            continue;
+        }
+        if (n > LFS_CLEAN_MAX_USED || segment == l->start
+            || (nvictims == LFS_CLEAN_BATCH && n >= used[nvictims - 1])) {
+            continue;
+        }
+        // Only the segments the log wrote say what lives in them
+        if (count_used_blocks(fs, segment + LFS_SEGMENT_DATA, LFS_SUMMARY_BLOCKS) != LFS_SUMMARY_BLOCKS
+            || meta_read(fs, segment + LFS_SEGMENT_DATA, header) != BLOCK_SIZE
+            || !lfs_summary_valid(fs, segment, header)) {
+            continue;
+        }
+        dead += n == LFS_SUMMARY_BLOCKS;
+        // Keep the victims sorted, emptiest first
+        k = nvictims < LFS_CLEAN_BATCH ? nvictims++ : nvictims - 1;
+        for (; k > 0 && used[k - 1] > n; k--) {
+            victims[k] = victims[k - 1];
+            used[k] = used[k - 1];
+        }
+        victims[k] = segment;
+        used[k] = n;
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    // Segments only their summary is left in cost nothing to free
+    if (dead > 0) {
+        pthread_rwlock_wrlock(&fs->lock);
+        emptied = lfs_release_summaries(fs);
+        pthread_rwlock_unlock(&fs->lock);
+    }
+    if (free_segments + emptied >= min_free || nvictims <= emptied) {
+        return;
+    }
+
+    // One segment under the lock at a time
+    for (v = 0; v < nvictims; v++) {
+        pthread_rwlock_wrlock(&fs->lock);
+        int ret = lfs_clean_segment(fs, victims[v], &moved);
+        emptied += ret == 0;
+        if (moved == 0 && emptied == 0 && v + 1 == nvictims) {
+            // Nothing there could be moved; wait until something is freed
+            l->idle_free = fs->sb.free_blocks;
+        }
+        pthread_rwlock_unlock(&fs->lock);
+        pthread_mutex_lock(&l->mutex);
+        int stop = l->stop;
+        pthread_mutex_unlock(&l->mutex);
+        if (stop || ret < 0) {
+            break;
+        }
+    }
+    stats_add(STAT_CLEANER_BLOCKS, moved);
+    log_info(LOG_CAT_ALLOC, "lfs_clean: %llu free segments, moved %lu blocks out of %u segments, emptied %u\n",
+             (unsigned long long) free_segments, moved, nvictims, emptied);
+}
+
+static void *lfs_cleaner(void *arg) {
+    sfs_fs *fs = arg;
+    struct lfs *l = fs->lfs;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&l->mutex);
+    while (!l->stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += LFS_CLEAN_INTERVAL_MS / 1000;
+        pthread_cond_timedwait(&l->wake, &l->mutex, &deadline);
+        if (l->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&l->mutex);
+        lfs_clean(fs);
+        pthread_mutex_lock(&l->mutex);
+    }
+    pthread_mutex_unlock(&l->mutex);
+    return NULL;
+}
+
+int lfs_start(sfs_fs *fs) {
+    struct lfs *l = calloc(1, sizeof(struct lfs));
+    if (l == NULL) {
+        return -ENOMEM;
+    }
+    l->buffer = malloc((size_t) LFS_SEGMENT_BLOCKS * BLOCK_SIZE);
+    if (l->buffer == NULL) {
+        free(l);
+        return -ENOMEM;
+    }
+    l->idle_free = UINT64_MAX;
+    pthread_mutex_init(&l->mutex, NULL);
+    pthread_cond_init(&l->wake, NULL);
+    fs->lfs = l;
+    int ret = pthread_create(&l->cleaner, NULL, lfs_cleaner, fs);
+    if (ret != 0) {
+        fs->lfs = NULL;
+        pthread_cond_destroy(&l->wake);
+        pthread_mutex_destroy(&l->mutex);
+        free(l->buffer);
+        free(l);
+        return -ret;
+    }
+    return 0;
+}
+
+void lfs_stop(sfs_fs *fs) {
+    struct lfs *l = fs->lfs;
+    if (l == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&l->mutex);
+    l->stop = 1;
+    pthread_cond_signal(&l->wake);
+    pthread_mutex_unlock(&l->mutex);
+    pthread_join(l->cleaner, NULL);
+    // The journal commits the metadata for these blocks after this, unless
+    // they are lost
+    pthread_rwlock_wrlock(&fs->lock);
+    lfs_release_summaries(fs);
+    int ret = lfs_flush(fs);
+    if (ret < 0) {
+        journal_abort(fs, ret);
+    }
+    fs->lfs = NULL;
+    pthread_rwlock_unlock(&fs->lock);
+    pthread_cond_destroy(&l->wake);
+    pthread_mutex_destroy(&l->mutex);
+    free(l->buffer);
+    free(l);
+}
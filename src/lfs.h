@@ -0,0 +1,59 @@
+//
+// Log-structured write mode (-o log).
+//
+// File data is never overwritten in place: every block written goes to the
+// head of the log, the next free block of the current segment, an aligned
+// run of LFS_SEGMENT_BLOCKS blocks that was entirely free when the log moved
+// there.  The blocks appended since the last commit are kept in a segment
+// buffer and written out in one request before the journal commits the
+// metadata that points at them, so random writes reach the image as
+// sequential ones.  The superseded blocks are freed once that commit is done.
+//
+// Metadata already goes to disk sequentially through the journal, and the
+// chunk index is what locates inodes, so neither changes.  A cleaner thread
+// keeps free segments available: when they run low it picks the emptiest
+// segments and moves the file data still living there to the log head.
+// The last LFS_SUMMARY_BLOCKS blocks of a segment are its summary, which
+// names the file block each block before them was appended for, so the
+// cleaner only looks at the files that wrote to the segment.  A block is
+// still live while that file block maps to it.  Blocks shared by several
+// files (see dedup.h) stay where they are.
+//
+
+#ifndef SFS_LFS_H
+#define SFS_LFS_H
+
+#include <stdint.h>
+
+#include "sfs_helper_functions.h"
+
+// 1 MB segments; a segment never straddles a group or a bitmap block
+#define LFS_SEGMENT_BLOCKS 2048
+#define LFS_SUMMARY_BLOCKS 32
+#define LFS_SEGMENT_DATA (LFS_SEGMENT_BLOCKS - LFS_SUMMARY_BLOCKS)
+
+int lfs_start(sfs_fs *fs);
+
+// Flush the segment buffer and stop the cleaner
+void lfs_stop(sfs_fs *fs);
+
+// Write out the blocks appended since the last flush. Caller holds fs->lock exclusively.
+int lfs_flush(sfs_fs *fs);
+
+// Give back the summaries of the segments that hold nothing else any more,
+// with the log on or off. Caller holds fs->lock exclusively. Returns the
+// number of segments freed.
+unsigned int lfs_release_summaries(sfs_fs *fs);
+
+// Write len bytes at offset into block index of ino by appending a new
+// version of the block to the log. Caller holds fs->lock exclusively and
+// writes ino back. Returns 0, 1 if the log has no free segment left and
+// the block must be written in place, or -errno.
+int lfs_write(sfs_fs *fs, inode *ino, uint64_t index, unsigned int offset, const void *data, size_t len);
+
+// Like block_read and block_write, for file data, which may still be in
+// the segment buffer
+int data_read(sfs_fs *fs, uint64_t block, void *buf);
+int data_write(sfs_fs *fs, uint64_t block, const void *buf);
+
+#endif //SFS_LFS_H
@@ -0,0 +1,1587 @@
+//
+// libsfs: the Simple File System core, see libsfs.h.
+//
+// Locking: fs->lock is taken shared by lookups and reads and exclusive
+// by anything that changes the image.  fs->open_lock protects the table
+// of open inodes and nests inside fs->lock.
+//
+
+#include "params.h"
+#include "block.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <sys/types.h>
+
+#include "compress.h"
+#include "dedup.h"
+#include "journal.h"
+#include "lfs.h"
+#include "libsfs.h"
+#include "log.h"
+#include "reclaim.h"
+#include "sfs.h"
+#include "sfs_helper_functions.h"
+#include "stats.h"
+
+#define MAX_FILE_SIZE ((off_t) MAX_FILE_BLOCKS * BLOCK_SIZE)
+
+// A read moves an atime that is already past the last change only once this old
+#define RELATIME_SECS (24 * 60 * 60)
+
+/** Free an inode and all of its blocks. Caller holds fs->lock exclusively. */
+static void free_inode(sfs_fs *fs, inode *ino) {
+    truncate_blocks(fs, ino, 0);
+    ino->dtime = time(NULL);
+    ino->links_count = 0;
+    write_inode(fs, ino);
+    release_inode_number(fs, ino->inum);
+    write_superblock(fs);
+}
+
+/** Take a reference on an open inode, creating its entry if needed */
+static int open_inode_get(sfs_fs *fs, unsigned int inum) {
+    open_inode *oi;
+    pthread_mutex_lock(&fs->open_lock);
+    for (oi = fs->open_inodes; oi != NULL; oi = oi->next) {
+        if (oi->inum == inum) {
+            oi->refs++;
+            pthread_mutex_unlock(&fs->open_lock);
+            return 0;
+        }
+    }
+    oi = calloc(1, sizeof(open_inode));
+    if (oi == NULL) {
+        pthread_mutex_unlock(&fs->open_lock);
+        return -ENOMEM;
+    }
+    oi->inum = inum;
+    oi->refs = 1;
+    oi->next = fs->open_inodes;
+    fs->open_inodes = oi;
+    pthread_mutex_unlock(&fs->open_lock);
+    return 0;
+}
+
+#define LAST_CLOSE 1
+#define LAST_CLOSE_ORPHAN 2
+
+/**
+ * Drop a reference on an open inode
+ * @return 0 if the inode is still open, LAST_CLOSE if this was its last
+ *         reference, or LAST_CLOSE_ORPHAN if it has also been unlinked
+ *         meanwhile, so the reclaimer can free it now
+ */
+static int open_inode_put(sfs_fs *fs, unsigned int inum) {
+    open_inode **link, *oi;
+    int orphan = 0;
+    pthread_mutex_lock(&fs->open_lock);
+    for (link = &fs->open_inodes; (oi = *link) != NULL; link = &oi->next) {
+        if (oi->inum == inum) {
+            if (--oi->refs == 0) {
+                orphan = oi->unlinked ? LAST_CLOSE_ORPHAN : LAST_CLOSE;
+                // Timestamps not written back yet keep the entry until they are
+                if (oi->times_dirty == 0) {
+                    *link = oi->next;
+                    free(oi);
+                }
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    return orphan;
+}
+
+/**
+ * Mark an inode whose last name is gone
+ * @return 1 if it is still open (and will be freed after last close)
+ */
+static int open_inode_unlink(sfs_fs *fs, unsigned int inum) {
+    open_inode *oi;
+    int open = 0;
+    pthread_mutex_lock(&fs->open_lock);
+    for (oi = fs->open_inodes; oi != NULL; oi = oi->next) {
+        if (oi->inum == inum && oi->refs > 0) {
+            oi->unlinked = 1;
+            open = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    return open;
+}
+
+/**
+ * Take one name away from a file. Its last name sends it to the
+ * reclaimer, which frees it once it is closed if it is open. Caller
+ * holds fs->lock exclusively and writes the superblock back.
+ */
+static void drop_link(sfs_fs *fs, inode *ino) {
+    if (ino->links_count > 1) {
+        ino->links_count--;
+        ino->ctime = time(NULL);
+        write_inode(fs, ino);
+        return;
+    }
+    open_inode_unlink(fs, ino->inum);
+    orphan_add(fs, ino);
+    write_inode(fs, ino);
+    reclaim_wake(fs);
+}
+
+static int new_file_handle(sfs_fs *fs, unsigned int inum, int flags, libsfs_file **filep) {
+    libsfs_file *file = malloc(sizeof(libsfs_file));
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+    int ret = open_inode_get(fs, inum);
+    if (ret < 0) {
+        free(file);
+        return ret;
+    }
+    file->fs = fs;
+    file->inum = inum;
+    file->flags = flags;
+    *filep = file;
+    return 0;
+}
+
+/**
+ * Lay out an empty filesystem on an image, creating the file if needed
+ *
+ * Everything on the image is lost. The image must not be mounted. opts
+ * may be NULL; otherwise its zero fields are set to the values used.
+ */
+int libsfs_format(const char *image_path, libsfs_format_options *opts) {
+    libsfs_format_options defaults;
+    sfs_fs fs;
+    if (opts == NULL) {
+        memset(&defaults, 0, sizeof(defaults));
+        opts = &defaults;
+    }
+    memset(&fs, 0, sizeof(sfs_fs));
+    fs.disk = disk_open(image_path);
+    if (fs.disk < 0) {
+        return fs.disk;
+    }
+    int ret = format_disk(&fs, opts);
+    if (ret == 0 && fsync(fs.disk) < 0) {
+        ret = -errno;
+    }
+    free(fs.groups);
+    free(fs.chunks);
+    free(fs.frags);
+    free(fs.refs);
+    disk_close(fs.disk);
+    log_info(LOG_CAT_MOUNT, "libsfs_format(image=\"%s\") = %d\n", image_path, ret);
+    return ret;
+}
+
+/**
+ * Open an image and mount the filesystem on it
+ *
+ * Only the superblock, group descriptors and inode chunk index are read; the image must have been formatted with
+ * libsfs_format (or mkfs) first, and -EINVAL is returned if it was not.
+ */
+int libsfs_mount(const char *image_path, const libsfs_options *opts, sfs_fs **fsp) {
+    sfs_fs *fs = calloc(1, sizeof(sfs_fs));
+    if (fs == NULL) {
+        return -ENOMEM;
+    }
+    if (opts != NULL) {
+        fs->opts = *opts;
+    }
+    if (fs->opts.compress && !compress_available()) {
+        log_error(LOG_CAT_MOUNT, "libsfs_mount: compression requested but built without LZ4\n");
+        free(fs);
+        return -ENOTSUP;
+    }
+    fs->disk = disk_open(image_path);
+    if (fs->disk < 0) {
+        int ret = fs->disk;
+        free(fs);
+        return ret;
+    }
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->open_lock, NULL);
+
+    int ret = read_superblock(fs);
+    // Fail now, rather than on every free, if the host cannot punch holes
+    if (ret == 0 && fs->opts.discard && block_discard(fs->disk, fs->sb.total_blocks, 1) == -EOPNOTSUPP) {
+        log_error(LOG_CAT_MOUNT, "libsfs_mount: %s cannot punch holes, no discard\n", image_path);
+        ret = -EOPNOTSUPP;
+    }
+    if (ret == 0) {
+        ret = dedup_start(fs);
+    }
+    if (ret == 0) {
+        ret = journal_start(fs);
+    }
+    if (ret == 0 && fs->opts.log_structured) {
+        ret = lfs_start(fs);
+    } else if (ret == 0 && fs->sb.log_segments > 0) {
+        // Without the cleaner, nothing else would give these back
+        pthread_rwlock_wrlock(&fs->lock);
+        if (lfs_release_summaries(fs) > 0) {
+            log_info(LOG_CAT_MOUNT, "libsfs_mount: %u log segments left\n", fs->sb.log_segments);
+        }
+        pthread_rwlock_unlock(&fs->lock);
+    }
+    if (ret == 0) {
+        ret = reclaim_start(fs);
+    }
+    if (ret < 0) {
+        libsfs_unmount(fs);
+        return ret;
+    }
+    log_info(LOG_CAT_MOUNT, "libsfs_mount(image=\"%s\"): %u groups, %llu of %llu blocks free, "
+             "%u inodes in %u chunks\n", image_path, fs->sb.group_count,
+             (unsigned long long) fs->sb.free_blocks, (unsigned long long) fs->sb.total_blocks,
+             fs->sb.used_inodes, fs->sb.inode_chunks);
+    *fsp = fs;
+    return 0;
+}
+
+void libsfs_unmount(sfs_fs *fs) {
+    open_inode *oi, *next;
+    if (fs == NULL) {
+        return;
+    }
+    inode_times_flush(fs, 0, time(NULL));
+    reclaim_stop(fs);
+    lfs_stop(fs);
+    journal_stop(fs);
+    dedup_stop(fs);
+    for (oi = fs->open_inodes; oi != NULL; oi = next) {
+        next = oi->next;
+        free(oi);
+    }
+    free(fs->groups);
+    free(fs->chunks);
+    free(fs->frags);
+    free(fs->refs);
+    disk_close(fs->disk);
+    pthread_rwlock_destroy(&fs->lock);
+    pthread_mutex_destroy(&fs->open_lock);
+    free(fs);
+}
+
+int libsfs_stat(sfs_fs *fs, const char *path, struct stat *st) {
+    inode ino;
+    pthread_rwlock_rdlock(&fs->lock);
+    int ret = resolute_path(fs, path, &ino);
+    if (ret == 0) {
+        fill_stat(&ino, st);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+int libsfs_fstat(libsfs_file *file, struct stat *st) {
+    inode ino;
+    pthread_rwlock_rdlock(&file->fs->lock);
+    int ret = read_inode(file->fs, file->inum, &ino);
+    if (ret == 0) {
+        fill_stat(&ino, st);
+    }
+    pthread_rwlock_unlock(&file->fs->lock);
+    return ret;
+}
+
+/** Create a file that must not exist yet, and open it read-write */
+int libsfs_create(sfs_fs *fs, const char *path, mode_t mode, libsfs_file **filep) {
+    inode parent, ino;
+    char name[MAX_FILE_NAME + 1];
+    unsigned int existing;
+
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_parent(fs, path, &parent, name);
+    if (ret == 0 && retrieve_file(fs, name, &parent, &existing) == 0) {
+        ret = -EEXIST;
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+
+    memset(&ino, 0, sizeof(inode));
+    ino.inum = assign_inode_number(fs, parent.inum);
+    if (ino.inum == 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return -ENOSPC;
+    }
+    ino.mode = S_IFREG | (mode & 07777);
+    ino.uid = getuid();
+    ino.gid = getgid();
+    ino.size = 0;
+    ino.type = REGULAR_FILE;
+    ino.atime = time(NULL);
+    ino.ctime = ino.atime;
+    ino.mtime = ino.ctime;
+    ino.blocks_number = 0;
+    ino.links_count = 1;
+    ino.flags = INODE_INLINE_DATA | (fs->opts.compress ? INODE_COMPRESSED : 0);
+    ino.parent_Ptr = parent.inum;
+    ret = write_inode(fs, &ino);
+    if (ret == 0) {
+        ret = dir_add_entry(fs, &parent, name, ino.inum);
+    }
+    if (ret < 0) {
+        release_inode_number(fs, ino.inum);
+    } else if (filep != NULL) {
+        ret = new_file_handle(fs, ino.inum, O_RDWR, filep);
+    }
+    write_superblock(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+int libsfs_open(sfs_fs *fs, const char *path, int flags, libsfs_file **filep) {
+    inode ino;
+    int truncate = (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY;
+
+    if ((flags & O_ACCMODE) != O_RDONLY && journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    if (truncate) {
+        pthread_rwlock_wrlock(&fs->lock);
+    } else {
+        pthread_rwlock_rdlock(&fs->lock);
+    }
+    int ret = resolute_path(fs, path, &ino);
+    if (ret == 0 && ino.type == DIRECTORY && (flags & O_ACCMODE) != O_RDONLY) {
+        ret = -EISDIR;
+    }
+    // Symlinks are followed by the caller, as the kernel does
+    if (ret == 0 && ino.type == SYMLINK) {
+        ret = -ELOOP;
+    }
+    if (ret == 0 && truncate && ino.size != 0) {
+        orphan_truncate(fs, &ino);
+        ino.size = 0;
+        ino.mtime = time(NULL);
+        ino.ctime = ino.mtime;
+        write_inode(fs, &ino);
+        write_superblock(fs);
+    }
+    if (ret == 0) {
+        ret = new_file_handle(fs, ino.inum, flags, filep);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+int libsfs_close(libsfs_file *file) {
+    sfs_fs *fs = file->fs;
+    int last = open_inode_put(fs, file->inum);
+    inode ino;
+    if (last == LAST_CLOSE_ORPHAN) {
+        // It has been on the orphan list since its last name went
+        reclaim_wake(fs);
+    } else if (last == LAST_CLOSE) {
+        int writable = (file->flags & O_ACCMODE) != O_RDONLY;
+        int dirty = inode_times_dirty(fs, file->inum);
+        if (writable || dirty) {
+            // Writes are done with for now, so a short tail can be packed,
+            // and timestamps kept in memory go with the inode
+            pthread_rwlock_wrlock(&fs->lock);
+            if (read_inode(fs, file->inum, &ino) == 0) {
+                int packed = writable && inode_pack_tail(fs, &ino) == 1;
+                if (packed || dirty) {
+                    write_inode(fs, &ino);
+                }
+                if (packed) {
+                    write_superblock(fs);
+                }
+            }
+            pthread_rwlock_unlock(&fs->lock);
+        }
+    }
+    free(file);
+    return 0;
+}
+
+/**
+ * Read up to size bytes at offset out of ino. Caller holds fs->lock.
+ * @return the bytes read, short at EOF, or -errno
+ */
+static ssize_t inode_read(sfs_fs *fs, const inode *ino, char *out, size_t size, off_t offset) {
+    char buffer[BLOCK_SIZE];
+
+    // Never read past EOF: the kernel asks for whole pages
+    if (offset >= ino->size) {
+        return 0;
+    }
+    if (offset + (off_t) size > ino->size) {
+        size = (size_t) (ino->size - offset);
+    }
+    size_t cursor = 0;
+    uint64_t ptr_offset = (uint64_t) offset / BLOCK_SIZE;
+    unsigned int byte_offset = (unsigned int) (offset % BLOCK_SIZE);
+    // Inline data came in with the inode, there are no blocks to read
+    if (ino->flags & INODE_INLINE_DATA) {
+        memcpy(out, &ino->inline_data[offset], size);
+        cursor = size;
+    }
+    for (; cursor < size; ptr_offset++) {
+        uint64_t block;
+        size_t next_read = (size - cursor < BLOCK_SIZE - byte_offset) ?
+                           (size - cursor) : (BLOCK_SIZE - byte_offset);
+        if ((ino->flags & INODE_TAIL_PACKED) && ptr_offset == (uint64_t) ino->size / BLOCK_SIZE) {
+            // A packed tail shares its block with the tails of other files
+            meta_read(fs, fs->frags[ino->tail_frag].block, buffer);
+            memcpy(&out[cursor], &buffer[ino->tail_slot * FRAG_SIZE + byte_offset], next_read);
+        } else if (inode_bmap(fs, ino, ptr_offset, &block) < 0) {
+            memset(&out[cursor], 0, next_read);
+        } else if (block == 0 || BMAP_IS_UNWRITTEN(block)) {
+            // Blocks never written read back as zeros, the whole hole at once
+            uint64_t last = ((uint64_t) offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE, next;
+            if ((ino->flags & INODE_TAIL_PACKED) && last > (uint64_t) ino->size / BLOCK_SIZE) {
+                last = (uint64_t) ino->size / BLOCK_SIZE;
+            }
+            if (inode_seek(fs, ino, ptr_offset + 1, last, 1, &next) == 0) {
+                next = last > ptr_offset ? last : ptr_offset + 1;
+            }
+            uint64_t hole = (next - ptr_offset) * BLOCK_SIZE - byte_offset;
+            next_read = size - cursor < hole ? size - cursor : (size_t) hole;
+            memset(&out[cursor], 0, next_read);
+            ptr_offset = next - 1;
+        } else if (block & BMAP_COMPRESSED) {
+            // A compressed cluster is decompressed whole; take all of it the read wants
+            size_t within = (size_t) ((offset + cursor) % COMPRESS_CLUSTER_SIZE);
+            next_read = size - cursor < COMPRESS_CLUSTER_SIZE - within ? size - cursor : COMPRESS_CLUSTER_SIZE - within;
+            if (compress_read(fs, block, within, &out[cursor], next_read) < 0) {
+                return cursor > 0 ? (ssize_t) cursor : -EIO;
+            }
+            ptr_offset = (uint64_t) (offset + cursor + next_read - 1) / BLOCK_SIZE;
+        } else {
+            data_read(fs, block, buffer);
+            memcpy(&out[cursor], &buffer[byte_offset], next_read);
+        }
+        cursor += next_read;
+        byte_offset = 0;
+    }
+    return (ssize_t) size;
+}
+
+ssize_t libsfs_read(libsfs_file *file, void *buf, size_t size, off_t offset) {
+    sfs_fs *fs = file->fs;
+    inode ino;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    int ret = read_inode(fs, file->inum, &ino);
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+    ssize_t done = inode_read(fs, &ino, buf, size, offset);
+    // relatime: atime only moves past the last change, or once a day, and
+    // only in memory, so reads write no metadata
+    time_t now = time(NULL);
+    if (done >= 0 && (ino.atime <= ino.mtime || ino.atime <= ino.ctime || now - ino.atime >= RELATIME_SECS)) {
+        ino.atime = now;
+        inode_times_defer(fs, &ino);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    if (done > 0) {
+        stats_add(STAT_BYTES_READ, (uint64_t) done);
+    }
+    return done;
+}
+
+/** Write len bytes at offset into block index of a file, where that block lives now */
+static int write_in_place(sfs_fs *fs, inode *ino, uint64_t index, unsigned int offset, const char *data, size_t len) {
+    char buffer[BLOCK_SIZE];
+    uint64_t block;
+    int ret = inode_bmap_alloc(fs, ino, index, &block);
+    if (ret == 0) {
+        // A block other files share gets a copy of its own first
+        ret = dedup_unshare(fs, ino, index, &block);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    // Whole-block overwrites skip the read half of the RMW, and a new
+    // block has nothing worth reading
+    if (ret == 1) {
+        memset(buffer, 0, BLOCK_SIZE);
+    } else if (len < BLOCK_SIZE) {
+        data_read(fs, block, buffer);
+    }
+    memcpy(&buffer[offset], data, len);
+    return data_write(fs, block, buffer) == BLOCK_SIZE ? 0 : -EIO;
+}
+
+/**
+ * Write size bytes at offset into ino, growing it and setting its mtime
+ * if anything was written. Caller holds fs->lock exclusively and writes
+ * ino back, whatever the outcome.
+ * @return the bytes written, or -errno if none were
+ */
+static ssize_t inode_write(sfs_fs *fs, inode *ino, const char *in, size_t size, off_t offset) {
+    int ret = 0;
+    size_t cursor = 0;
+    uint64_t ptr_offset = (uint64_t) offset / BLOCK_SIZE;
+    unsigned int byte_offset = (unsigned int) (offset % BLOCK_SIZE);
+    // The offset is used as given, even for O_APPEND: the kernel has
+    // already placed appends at its own i_size
+    if (ino->flags & INODE_INLINE_DATA) {
+        if ((uint64_t) offset + size <= INODE_INLINE_SIZE) {
+            memcpy(&ino->inline_data[offset], in, size);
+            cursor = size;
+        } else if ((ret = inode_uninline(fs, ino)) < 0) {
+            return ret;
+        }
+    }
+    // A write reaching the packed tail gets it a block of its own again;
+    // the tail is packed anew, into fresh slots, on the last close
+    if ((ino->flags & INODE_TAIL_PACKED)
+        && (uint64_t) offset + size > (uint64_t) (ino->size - ino->size % BLOCK_SIZE)
+        && (ret = inode_unpack_tail(fs, ino)) < 0) {
+        return ret;
+    }
+    if ((ino->flags & INODE_COMPRESSED) && cursor < size) {
+        // Compressed files are written a cluster at a time
+        ssize_t written = compress_write(fs, ino, offset, in, size);
+        ret = written < 0 ? (int) written : 0;
+        cursor = written < 0 ? 0 : (size_t) written;
+    }
+    for (; cursor < size && !(ino->flags & INODE_COMPRESSED); ptr_offset++) {
+        size_t next_write = (size - cursor < BLOCK_SIZE - byte_offset) ?
+                            (size - cursor) : (BLOCK_SIZE - byte_offset);
+        // With dedup on the block may turn out to need no writing at all.
+        // In log-structured mode it goes to the head of the log, unless
+        // the log has run out of free segments
+        if (fs->opts.dedup) {
+            ret = dedup_write(fs, ino, ptr_offset, byte_offset, &in[cursor], next_write);
+        } else {
+            ret = fs->lfs != NULL ? lfs_write(fs, ino, ptr_offset, byte_offset, &in[cursor], next_write) : 1;
+        }
+        if (ret == 1) {
+            ret = write_in_place(fs, ino, ptr_offset, byte_offset, &in[cursor], next_write);
+        }
+        if (ret < 0) break;
+        cursor += next_write;
+        byte_offset = 0;
+    }
+    if (cursor == 0 && size > 0) {
+        return ret;
+    }
+    if (offset + (off_t) cursor > ino->size) {
+        ino->size = offset + (off_t) cursor;
+    }
+    ino->mtime = time(NULL);
+    ino->ctime = ino->mtime;
+    return (ssize_t) cursor;
+}
+
+ssize_t libsfs_write(libsfs_file *file, const void *buf, size_t size, off_t offset) {
+    sfs_fs *fs = file->fs;
+    inode ino;
+
+    if ((file->flags & O_ACCMODE) == O_RDONLY) {
+        return -EBADF;
+    }
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = read_inode(fs, file->inum, &ino);
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+    // An overwrite that changes nothing but the timestamps leaves them in
+    // memory with -o lazytime
+    inode before = ino;
+    ssize_t done = inode_write(fs, &ino, buf, size, offset);
+    before.atime = ino.atime;
+    before.mtime = ino.mtime;
+    before.ctime = ino.ctime;
+    if (!fs->opts.lazytime || memcmp(&before, &ino, sizeof(inode)) != 0 || inode_times_defer(fs, &ino) < 0) {
+        write_inode(fs, &ino);
+    }
+    write_superblock(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    if (done > 0) {
+        stats_add(STAT_BYTES_WRITTEN, (uint64_t) done);
+    }
+    return done;
+}
+
+static int truncate_inode(sfs_fs *fs, inode *ino, off_t size) {
+    if (ino->type != REGULAR_FILE) {
+        return ino->type == DIRECTORY ? -EISDIR : -EINVAL;
+    }
+    if (size > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    // Emptying a file hands its blocks to the reclaimer. Otherwise whole
+    // clusters past the new end go a batch per transaction first.
+    uint64_t keep = ((uint64_t) size + COMPRESS_CLUSTER_SIZE - 1) / COMPRESS_CLUSTER_SIZE * COMPRESS_CLUSTER_BLOCKS;
+    int ret = 0;
+    if (size > 0 && !(ino->flags & INODE_INLINE_DATA)) {
+        ret = punch_blocks_split(fs, ino, keep, MAX_FILE_BLOCKS);
+    }
+    if (ret == 0) {
+        ret = size == 0 ? orphan_truncate(fs, ino) : truncate_blocks(fs, ino, size);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    ino->size = size;
+    inode_pack_tail(fs, ino);
+    ino->mtime = time(NULL);
+    ino->ctime = ino->mtime;
+    write_inode(fs, ino);
+    return write_superblock(fs);
+}
+
+/**
+ * Change the size of a file. Space beyond the old size reads as zeros.
+ */
+int libsfs_truncate(sfs_fs *fs, const char *path, off_t size) {
+    inode ino;
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_path(fs, path, &ino);
+    if (ret == 0) {
+        ret = truncate_inode(fs, &ino, size);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+int libsfs_ftruncate(libsfs_file *file, off_t size) {
+    inode ino;
+    if (journal_error(file->fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&file->fs->lock);
+    int ret = read_inode(file->fs, file->inum, &ino);
+    if (ret == 0) {
+        ret = truncate_inode(file->fs, &ino, size);
+    }
+    pthread_rwlock_unlock(&file->fs->lock);
+    return ret;
+}
+
+/** Copy len bytes from src to dst through a buffer, a cluster at a time */
+static ssize_t copy_bytes(sfs_fs *fs, const inode *src, off_t off_in, inode *dst, off_t off_out, size_t len) {
+    char buffer[COMPRESS_CLUSTER_SIZE];
+    size_t done = 0;
+    while (done < len) {
+        // Stay within one cluster of the destination, so a compressed one
+        // is rewritten once
+        size_t within = (size_t) ((off_out + done) % COMPRESS_CLUSTER_SIZE);
+        size_t n = len - done < COMPRESS_CLUSTER_SIZE - within ? len - done : COMPRESS_CLUSTER_SIZE - within;
+        ssize_t ret = inode_read(fs, src, buffer, n, off_in + (off_t) done);
+        if (ret > 0) {
+            ret = inode_write(fs, dst, buffer, (size_t) ret, off_out + (off_t) done);
+        }
+        if (ret > 0 && journal_split(fs, dst) < 0) {
+            ret = journal_error(fs);
+        }
+        if (ret <= 0) {
+            return done > 0 ? (ssize_t) done : ret;
+        }
+        done += (size_t) ret;
+    }
+    return (ssize_t) done;
+}
+
+/**
+ * Point block index of dst at the block src maps at src_index, or make it
+ * a hole if that is one. Caller holds fs->lock exclusively.
+ */
+static int share_block(sfs_fs *fs, const inode *src, uint64_t src_index, inode *dst, uint64_t index) {
+    uint64_t block, prev;
+    int ret = inode_bmap(fs, src, src_index, &block);
+    if (ret < 0) {
+        return ret;
+    }
+    if (block == 0 || BMAP_IS_UNWRITTEN(block)) {
+        if (inode_bmap(fs, dst, index, &prev) < 0 || prev == 0) {
+            return 0;
+        }
+        block = 0;
+        ret = inode_bmap_store(fs, dst, index, &block);
+        if (ret == 0) {
+            release_block(fs, prev);
+            dst->blocks_number--;
+        }
+        return ret;
+    }
+    ret = dedup_ref_get(fs, block);
+    if (ret < 0) {
+        return ret;
+    }
+    prev = block;
+    ret = inode_bmap_set(fs, dst, index, &prev);
+    if (ret < 0) {
+        dedup_ref_put(fs, block);
+        return ret;
+    }
+    release_block(fs, prev);
+    stats_add(STAT_CLONE_BLOCKS, 1);
+    return 0;
+}
+
+/**
+ * Copy len bytes of src at off_in to dst at off_out, which may be the
+ * same inode. Whole blocks are shared instead of copied where both
+ * offsets are equally aligned and neither file is compressed; the rest
+ * is read and written again. Caller holds fs->lock exclusively and
+ * writes dst back.
+ * @return the bytes copied, or -errno if none were
+ */
+static ssize_t copy_range(sfs_fs *fs, const inode *src, off_t off_in, inode *dst, off_t off_out, size_t len) {
+    if (src->type != REGULAR_FILE || dst->type != REGULAR_FILE) {
+        return src->type == DIRECTORY || dst->type == DIRECTORY ? -EISDIR : -EINVAL;
+    }
+    if (off_in < 0 || off_out < 0) {
+        return -EINVAL;
+    }
+    if (off_in >= src->size) {
+        return 0;
+    }
+    if ((uint64_t) off_in + len > (uint64_t) src->size) {
+        len = (size_t) (src->size - off_in);
+    }
+    if (src->inum == dst->inum && off_in < off_out + (off_t) len && off_out < off_in + (off_t) len) {
+        return -EINVAL;
+    }
+    if (off_out + (off_t) len > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+
+    size_t head = (size_t) ((BLOCK_SIZE - off_in % BLOCK_SIZE) % BLOCK_SIZE);
+    head = head < len ? head : len;
+    uint64_t blocks = (len - head) / BLOCK_SIZE, k;
+    if (off_in % BLOCK_SIZE != off_out % BLOCK_SIZE || ((src->flags | dst->flags) & INODE_COMPRESSED)
+        || (src->flags & INODE_INLINE_DATA)) {
+        blocks = 0;
+    }
+    if (blocks == 0) {
+        return copy_bytes(fs, src, off_in, dst, off_out, len);
+    }
+
+    ssize_t ret = head > 0 ? copy_bytes(fs, src, off_in, dst, off_out, head) : 0;
+    if (ret < (ssize_t) head) {
+        return ret;
+    }
+    // The blocks are about to be pointed at directly, so dst must have a
+    // block map, and no packed tail where they go
+    int err = 0;
+    if (dst->flags & INODE_INLINE_DATA) {
+        err = inode_uninline(fs, dst);
+    }
+    off_t end = off_out + (off_t) (head + blocks * BLOCK_SIZE);
+    if (err == 0 && (dst->flags & INODE_TAIL_PACKED) && end > dst->size - dst->size % BLOCK_SIZE) {
+        err = inode_unpack_tail(fs, dst);
+    }
+    uint64_t src_index = (uint64_t) (off_in + (off_t) head) / BLOCK_SIZE;
+    uint64_t index = (uint64_t) (off_out + (off_t) head) / BLOCK_SIZE;
+    for (k = 0; k < blocks && err == 0; k++) {
+        err = share_block(fs, src, src_index + k, dst, index + k);
+        // Committed a batch at a time, with the size covering what is shared
+        if (err == 0 && (k + 1) % JOURNAL_SPLIT_BLOCKS == 0) {
+            off_t shared = off_out + (off_t) (head + (k + 1) * BLOCK_SIZE);
+            dst->size = shared > dst->size ? shared : dst->size;
+            err = journal_split(fs, dst);
+        }
+    }
+    size_t done = head + (size_t) (err == 0 ? k : k - 1) * BLOCK_SIZE;
+    if (done == 0) {
+        return err;
+    }
+    if (off_out + (off_t) done > dst->size) {
+        dst->size = off_out + (off_t) done;
+    }
+    dst->mtime = time(NULL);
+    dst->ctime = dst->mtime;
+    if (err < 0 || done == len) {
+        return (ssize_t) done;
+    }
+    ret = copy_bytes(fs, src, off_in + (off_t) done, dst, off_out + (off_t) done, len - done);
+    return ret < 0 ? (ssize_t) done : (ssize_t) done + ret;
+}
+
+/**
+ * Copy len bytes of in at off_in to out at off_out, as copy_file_range(2)
+ * does. Whole blocks end up shared between the two files rather than
+ * copied, and a later write to either gives it a copy of its own.
+ * @return the bytes copied, fewer at the end of in, or -errno
+ */
+ssize_t libsfs_copy_file_range(libsfs_file *in, off_t off_in, libsfs_file *out, off_t off_out, size_t len) {
+    sfs_fs *fs = out->fs;
+    inode src, dst;
+
+    if ((in->flags & O_ACCMODE) == O_WRONLY || (out->flags & O_ACCMODE) == O_RDONLY) {
+        return -EBADF;
+    }
+    if (in->fs != out->fs) {
+        return -EXDEV;
+    }
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = read_inode(fs, in->inum, &src);
+    if (ret == 0) {
+        ret = read_inode(fs, out->inum, &dst);
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+    // Within one file, the one inode is both read and written
+    ssize_t done = copy_range(fs, in->inum == out->inum ? &dst : &src, off_in, &dst, off_out, len);
+    if (done > 0) {
+        write_inode(fs, &dst);
+        write_superblock(fs);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return done;
+}
+
+/**
+ * Make dest a copy of all of src, sharing its blocks, as the FICLONE
+ * ioctl does
+ */
+int libsfs_clone(libsfs_file *src, libsfs_file *dest) {
+    sfs_fs *fs = dest->fs;
+    inode from, to;
+
+    if ((src->flags & O_ACCMODE) == O_WRONLY || (dest->flags & O_ACCMODE) == O_RDONLY) {
+        return -EBADF;
+    }
+    if (src->fs != dest->fs) {
+        return -EXDEV;
+    }
+    if (src->inum == dest->inum) {
+        return -EINVAL;
+    }
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = read_inode(fs, src->inum, &from);
+    if (ret == 0) {
+        ret = read_inode(fs, dest->inum, &to);
+    }
+    if (ret == 0 && (from.type != REGULAR_FILE || to.type != REGULAR_FILE)) {
+        ret = from.type == DIRECTORY || to.type == DIRECTORY ? -EISDIR : -EINVAL;
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+    ret = orphan_truncate(fs, &to);
+    if (ret == 0) {
+        to.size = 0;
+        ssize_t done = copy_range(fs, &from, 0, &to, 0, (size_t) from.size);
+        ret = done < 0 ? (int) done : done < from.size ? -ENOSPC : 0;
+    }
+    to.mtime = time(NULL);
+    to.ctime = to.mtime;
+    write_inode(fs, &to);
+    write_superblock(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+/**
+ * Find the next data or hole at or after offset, as lseek(2) does with
+ * SEEK_DATA or SEEK_HOLE; there is no other kind of seek, since handles
+ * have no position of their own. A packed tail or inline data is data.
+ * @return the offset found, or -ENXIO at or past the end of the file
+ */
+off_t libsfs_lseek(libsfs_file *file, off_t offset, int whence) {
+    sfs_fs *fs = file->fs;
+    inode ino;
+    uint64_t found;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+    pthread_rwlock_rdlock(&fs->lock);
+    int ret = read_inode(fs, file->inum, &ino);
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+    off_t result = -ENXIO;
+    if (offset >= 0 && offset < ino.size) {
+        // The block map ends where a packed tail begins
+        uint64_t end = (ino.flags & INODE_TAIL_PACKED) ? (uint64_t) ino.size / BLOCK_SIZE
+                                                        : ((uint64_t) ino.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int data = whence == SEEK_DATA;
+        if (ino.flags & INODE_INLINE_DATA) {
+            result = data ? offset : ino.size;
+        } else if (inode_seek(fs, &ino, (uint64_t) offset / BLOCK_SIZE, end, data, &found)) {
+            result = (off_t) found * BLOCK_SIZE > offset ? (off_t) found * BLOCK_SIZE : offset;
+        } else if (!data) {
+            result = ino.size;
+        } else if (ino.flags & INODE_TAIL_PACKED) {
+            result = (off_t) end * BLOCK_SIZE > offset ? (off_t) end * BLOCK_SIZE : offset;
+        }
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return result;
+}
+
+/**
+ * Write zeros over bytes start to end of ino, skipping what is a hole
+ * already. Compressed files are done a cluster at a time.
+ */
+static int zero_range(sfs_fs *fs, inode *ino, off_t start, off_t end) {
+    static const char zeros[COMPRESS_CLUSTER_SIZE];
+    off_t unit = (ino->flags & INODE_COMPRESSED) ? COMPRESS_CLUSTER_SIZE : BLOCK_SIZE;
+    while (start < end) {
+        off_t stop = (start / unit + 1) * unit < end ? (start / unit + 1) * unit : end;
+        uint64_t index = (uint64_t) start / BLOCK_SIZE, block = 1;
+        if (!(ino->flags & INODE_INLINE_DATA)
+            && !((ino->flags & INODE_TAIL_PACKED) && index == (uint64_t) ino->size / BLOCK_SIZE)) {
+            inode_bmap(fs, ino, index, &block);
+        }
+        if (block != 0 && !BMAP_IS_UNWRITTEN(block)) {
+            ssize_t ret = inode_write(fs, ino, zeros, (size_t) (stop - start), start);
+            if (ret < 0) {
+                return (int) ret;
+            }
+        }
+        start = stop;
+    }
+    return 0;
+}
+
+/**
+ * Free the blocks wholly inside bytes offset to offset + len of ino and
+ * zero the rest of the range, leaving the size alone. Caller holds
+ * fs->lock exclusively and writes ino back.
+ */
+static int punch_hole(sfs_fs *fs, inode *ino, off_t offset, off_t len) {
+    off_t end = len > ino->size - offset ? ino->size : offset + len;
+    off_t unit = (ino->flags & INODE_COMPRESSED) ? COMPRESS_CLUSTER_SIZE : BLOCK_SIZE;
+    off_t first = (offset + unit - 1) / unit * unit, last = end / unit * unit;
+    if (offset >= end) {
+        return 0;
+    }
+    // Inline data and a packed tail are not in the block map
+    if (ino->flags & INODE_INLINE_DATA) {
+        last = first;
+    } else if ((ino->flags & INODE_TAIL_PACKED) && last > ino->size - ino->size % BLOCK_SIZE) {
+        last = ino->size - ino->size % BLOCK_SIZE;
+    }
+    if (first >= last) {
+        return zero_range(fs, ino, offset, end);
+    }
+    int ret = zero_range(fs, ino, offset, first);
+    if (ret == 0) {
+        ret = zero_range(fs, ino, last, end);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    ret = punch_blocks_split(fs, ino, (uint64_t) first / BLOCK_SIZE, (uint64_t) last / BLOCK_SIZE);
+    ino->mtime = time(NULL);
+    ino->ctime = ino->mtime;
+    return ret;
+}
+
+/**
+ * Reserve blocks wherever bytes offset to offset + len of ino have a hole,
+ * in runs as long as the allocator can find, up to a bitmap block's worth
+ * at a time. They are mapped unwritten, so they read as zeros until
+ * written. Caller holds fs->lock exclusively and writes ino back.
+ */
+static int preallocate(sfs_fs *fs, inode *ino, off_t offset, off_t len, int keep_size) {
+    off_t end = offset + len;
+    uint64_t index = (uint64_t) offset / BLOCK_SIZE, last = ((uint64_t) end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t hole, block, run, first, k;
+    int ret = 0;
+
+    if ((ino->flags & INODE_INLINE_DATA) && end <= INODE_INLINE_SIZE) {
+        index = last;
+    } else {
+        ret = inode_uninline(fs, ino);
+    }
+    if (ret == 0 && (ino->flags & INODE_TAIL_PACKED) && end > ino->size - ino->size % BLOCK_SIZE) {
+        ret = inode_unpack_tail(fs, ino);
+    }
+    while (ret == 0 && inode_seek(fs, ino, index, last, 0, &hole)) {
+        // Blocks reserved before count as holes to inode_seek, and are left be
+        for (run = 0; hole + run < last && run < BITS_PER_BLOCK; run++) {
+            if (inode_bmap(fs, ino, hole + run, &block) < 0 || block != 0) break;
+        }
+        if (run == 0) {
+            index = hole + 1;
+            continue;
+        }
+        for (first = 0; run > 0 && (first = assign_block_run(fs, (unsigned int) run)) == 0; run /= 2);
+        if (first == 0) {
+            ret = -ENOSPC;
+            break;
+        }
+        for (k = 0; k < run; k++) {
+            block = BMAP_UNWRITTEN | (first + k);
+            ret = inode_bmap_store(fs, ino, hole + k, &block);
+            if (ret < 0) {
+                reclaim_blocks(fs, first + k, (unsigned int) (run - k));
+                break;
+            }
+            ino->blocks_number++;
+        }
+        index = hole + run;
+        if (ret == 0) {
+            ret = journal_split(fs, ino);
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (!keep_size && end > ino->size) {
+        ino->size = end;
+    }
+    ino->mtime = time(NULL);
+    ino->ctime = ino->mtime;
+    return 0;
+}
+
+/**
+ * Manipulate the space of a file, as fallocate(2) does: preallocate it,
+ * with or without FALLOC_FL_KEEP_SIZE, or punch a hole in it
+ * (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE). Compressed files and the
+ * log-structured mode, which place every write anew, cannot preallocate.
+ */
+int libsfs_fallocate(libsfs_file *file, int mode, off_t offset, off_t len) {
+    sfs_fs *fs = file->fs;
+    inode ino;
+
+    if ((file->flags & O_ACCMODE) == O_RDONLY) {
+        return -EBADF;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE && mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        return -EOPNOTSUPP;
+    }
+    int punch = mode & FALLOC_FL_PUNCH_HOLE;
+    if (!punch && len > MAX_FILE_SIZE - offset) {
+        return -EFBIG;
+    }
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = read_inode(fs, file->inum, &ino);
+    if (ret == 0 && ino.type != REGULAR_FILE) {
+        ret = ino.type == DIRECTORY ? -EISDIR : -ENODEV;
+    }
+    if (ret == 0 && !punch && (fs->lfs != NULL || (ino.flags & INODE_COMPRESSED))) {
+        ret = -EOPNOTSUPP;
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+    ret = punch ? punch_hole(fs, &ino, offset, len) : preallocate(fs, &ino, offset, len, mode & FALLOC_FL_KEEP_SIZE);
+    write_inode(fs, &ino);
+    write_superblock(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+/**
+ * Make the file durable: its data, and the metadata of every operation
+ * completed so far, which the journal commits as one transaction
+ */
+int libsfs_fsync(libsfs_file *file) {
+    inode_times_flush(file->fs, file->inum, time(NULL));
+    return journal_commit(file->fs);
+}
+
+/**
+ * Set access and modification times; tv == NULL means now, and
+ * UTIME_NOW/UTIME_OMIT are honoured as in utimensat(2)
+ */
+int libsfs_utimens(sfs_fs *fs, const char *path, const struct timespec tv[2]) {
+    inode ino;
+    time_t now = time(NULL);
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_path(fs, path, &ino);
+    if (ret == 0) {
+        if (tv == NULL || tv[0].tv_nsec == UTIME_NOW) {
+            ino.atime = now;
+        } else if (tv[0].tv_nsec != UTIME_OMIT) {
+            ino.atime = tv[0].tv_sec;
+        }
+        if (tv == NULL || tv[1].tv_nsec == UTIME_NOW) {
+            ino.mtime = now;
+        } else if (tv[1].tv_nsec != UTIME_OMIT) {
+            ino.mtime = tv[1].tv_sec;
+        }
+        ino.ctime = now;
+        ret = write_inode(fs, &ino);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+int libsfs_unlink(sfs_fs *fs, const char *path) {
+    inode parent, ino;
+    char name[MAX_FILE_NAME + 1];
+    unsigned int inum;
+
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_parent(fs, path, &parent, name);
+    if (ret == 0) {
+        ret = retrieve_file(fs, name, &parent, &inum);
+    }
+    if (ret == 0) {
+        ret = read_inode(fs, inum, &ino);
+    }
+    if (ret == 0 && ino.type == DIRECTORY) {
+        ret = -EISDIR;
+    }
+    if (ret == 0) {
+        ret = dir_remove_entry(fs, &parent, name);
+    }
+    if (ret == 0) {
+        drop_link(fs, &ino);
+        parent.mtime = time(NULL);
+        parent.ctime = parent.mtime;
+        write_inode(fs, &parent);
+        write_superblock(fs);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+int libsfs_mkdir(sfs_fs *fs, const char *path, mode_t mode) {
+    inode parent, ino;
+    char name[MAX_FILE_NAME + 1];
+    unsigned int existing;
+
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_parent(fs, path, &parent, name);
+    if (ret == 0 && retrieve_file(fs, name, &parent, &existing) == 0) {
+        ret = -EEXIST;
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+
+    memset(&ino, 0, sizeof(inode));
+    ino.inum = assign_inode_number(fs, parent.inum);
+    uint64_t block = ino.inum ? assign_block(fs) : 0;
+    if (block == 0) {
+        release_inode_number(fs, ino.inum);
+        pthread_rwlock_unlock(&fs->lock);
+        return -ENOSPC;
+    }
+    ino.mode = S_IFDIR | (mode & 07777);
+    ino.uid = getuid();
+    ino.gid = getgid();
+    ino.size = BLOCK_SIZE;
+    ino.type = DIRECTORY;
+    ino.atime = time(NULL);
+    ino.ctime = ino.atime;
+    ino.mtime = ino.ctime;
+    ino.blocks_number = 1;
+    ino.links_count = 2;
+    ino.parent_Ptr = parent.inum;
+    ino.block_pointers[0] = block;
+    directory_block_init(fs, block, ino.inum, parent.inum);
+    ret = write_inode(fs, &ino);
+    if (ret == 0) {
+        ret = dir_add_entry(fs, &parent, name, ino.inum);
+    }
+    if (ret == 0) {
+        parent.links_count++;
+        parent.mtime = time(NULL);
+        ret = write_inode(fs, &parent);
+    } else {
+        release_block(fs, block);
+        release_inode_number(fs, ino.inum);
+    }
+    write_superblock(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+int libsfs_rmdir(sfs_fs *fs, const char *path) {
+    inode parent, ino;
+    char name[MAX_FILE_NAME + 1];
+    unsigned int inum;
+
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_parent(fs, path, &parent, name);
+    if (ret == 0) {
+        ret = retrieve_file(fs, name, &parent, &inum);
+    }
+    if (ret == 0) {
+        ret = read_inode(fs, inum, &ino);
+    }
+    if (ret == 0 && ino.type != DIRECTORY) {
+        ret = -ENOTDIR;
+    }
+    if (ret == 0 && !dir_is_empty(fs, &ino)) {
+        ret = -ENOTEMPTY;
+    }
+    if (ret == 0) {
+        ret = dir_remove_entry(fs, &parent, name);
+    }
+    if (ret == 0) {
+        free_inode(fs, &ino);
+        parent.links_count--;
+        parent.mtime = time(NULL);
+        write_inode(fs, &parent);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+/**
+ * Check that a directory being moved under new_parent would not end up
+ * inside its own subtree, by following parent_Ptr up to the root
+ */
+static int rename_loop_check(sfs_fs *fs, unsigned int inum, const inode *new_parent) {
+    inode up = *new_parent;
+    unsigned int depth = 0;
+    while (up.inum != fs->sb.root_inode_ptr) {
+        if (up.inum == inum) {
+            return -EINVAL;
+        }
+        if (++depth > fs->sb.used_inodes || up.parent_Ptr == 0) {
+            return -EIO;
+        }
+        int ret = read_inode(fs, up.parent_Ptr, &up);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Give from the name to, replacing whatever to named, as rename(2) does.
+ * Only directory entries change, plus ".." and the link counts when a
+ * directory moves; no data is copied. The whole rename is one
+ * transaction under fs->lock, so to names either the old or the new file
+ * at every point, crash or not.
+ */
+int libsfs_rename(sfs_fs *fs, const char *from, const char *to) {
+    inode old_parent, new_parent, ino, target;
+    char old_name[MAX_FILE_NAME + 1], new_name[MAX_FILE_NAME + 1];
+    unsigned int inum, existing = 0;
+
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_parent(fs, from, &old_parent, old_name);
+    if (ret == 0) {
+        ret = resolute_parent(fs, to, &new_parent, new_name);
+    }
+    if (ret == 0 && (strcmp(old_name, ".") == 0 || strcmp(old_name, "..") == 0
+                     || strcmp(new_name, ".") == 0 || strcmp(new_name, "..") == 0)) {
+        ret = -EINVAL;
+    }
+    if (ret == 0) {
+        ret = retrieve_file(fs, old_name, &old_parent, &inum);
+    }
+    if (ret == 0) {
+        ret = read_inode(fs, inum, &ino);
+    }
+    if (ret == 0 && retrieve_file(fs, new_name, &new_parent, &existing) == 0) {
+        if (existing == inum) {
+            // Two names of one file: nothing to do
+            pthread_rwlock_unlock(&fs->lock);
+            return 0;
+        }
+        ret = read_inode(fs, existing, &target);
+        if (ret == 0 && ino.type == DIRECTORY && target.type != DIRECTORY) {
+            ret = -ENOTDIR;
+        } else if (ret == 0 && ino.type != DIRECTORY && target.type == DIRECTORY) {
+            ret = -EISDIR;
+        } else if (ret == 0 && target.type == DIRECTORY && !dir_is_empty(fs, &target)) {
+            ret = -ENOTEMPTY;
+        }
+    } else {
+        existing = 0;
+    }
+    int moved = ino.type == DIRECTORY && old_parent.inum != new_parent.inum;
+    if (ret == 0 && moved) {
+        ret = rename_loop_check(fs, inum, &new_parent);
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+
+    // Within one directory both names live in the same inode, which
+    // dir_add_entry may grow: keep a single copy of it
+    inode *src = old_parent.inum == new_parent.inum ? &new_parent : &old_parent;
+    if (existing != 0) {
+        ret = dir_set_entry(fs, &new_parent, new_name, inum);
+    } else {
+        ret = dir_add_entry(fs, &new_parent, new_name, inum);
+    }
+    if (ret == 0) {
+        ret = dir_remove_entry(fs, src, old_name);
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+
+    time_t now = time(NULL);
+    if (existing != 0 && target.type == DIRECTORY) {
+        free_inode(fs, &target);
+        new_parent.links_count--;
+    } else if (existing != 0) {
+        drop_link(fs, &target);
+    }
+    if (moved) {
+        dir_set_entry(fs, &ino, "..", new_parent.inum);
+        ino.parent_Ptr = new_parent.inum;
+        old_parent.links_count--;
+        new_parent.links_count++;
+    }
+    ino.ctime = now;
+    write_inode(fs, &ino);
+    new_parent.mtime = now;
+    new_parent.ctime = now;
+    if (src == &old_parent) {
+        old_parent.mtime = now;
+        old_parent.ctime = now;
+        write_inode(fs, &old_parent);
+    }
+    ret = write_inode(fs, &new_parent);
+    write_superblock(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+/** Give the file at from the further name to */
+int libsfs_link(sfs_fs *fs, const char *from, const char *to) {
+    inode parent, ino;
+    char name[MAX_FILE_NAME + 1];
+    unsigned int existing;
+
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_path(fs, from, &ino);
+    if (ret == 0 && ino.type == DIRECTORY) {
+        ret = -EPERM;
+    }
+    if (ret == 0 && ino.links_count >= USHRT_MAX) {
+        ret = -EMLINK;
+    }
+    if (ret == 0) {
+        ret = resolute_parent(fs, to, &parent, name);
+    }
+    if (ret == 0 && retrieve_file(fs, name, &parent, &existing) == 0) {
+        ret = -EEXIST;
+    }
+    if (ret == 0) {
+        ret = dir_add_entry(fs, &parent, name, ino.inum);
+    }
+    if (ret == 0) {
+        time_t now = time(NULL);
+        ino.links_count++;
+        ino.ctime = now;
+        write_inode(fs, &ino);
+        parent.mtime = now;
+        parent.ctime = now;
+        ret = write_inode(fs, &parent);
+        write_superblock(fs);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+/**
+ * Make path a symlink to target. A target of up to INODE_INLINE_SIZE
+ * bytes is kept in the inode, longer ones in data blocks like file data.
+ */
+int libsfs_symlink(sfs_fs *fs, const char *target, const char *path) {
+    inode parent, ino;
+    char name[MAX_FILE_NAME + 1];
+    unsigned int existing;
+    size_t len = strlen(target);
+
+    if (len == 0) {
+        return -ENOENT;
+    }
+    if (len >= PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if (journal_error(fs) < 0) {
+        return -EROFS;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    int ret = resolute_parent(fs, path, &parent, name);
+    if (ret == 0 && retrieve_file(fs, name, &parent, &existing) == 0) {
+        ret = -EEXIST;
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return ret;
+    }
+
+    memset(&ino, 0, sizeof(inode));
+    ino.inum = assign_inode_number(fs, parent.inum);
+    if (ino.inum == 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return -ENOSPC;
+    }
+    ino.mode = S_IFLNK | 0777;
+    ino.uid = getuid();
+    ino.gid = getgid();
+    ino.type = SYMLINK;
+    ino.atime = time(NULL);
+    ino.ctime = ino.atime;
+    ino.mtime = ino.ctime;
+    ino.links_count = 1;
+    ino.flags = INODE_INLINE_DATA;
+    ino.parent_Ptr = parent.inum;
+    ssize_t done = inode_write(fs, &ino, target, len, 0);
+    ret = done < 0 ? (int) done : (size_t) done < len ? -ENOSPC : 0;
+    if (ret == 0) {
+        ret = write_inode(fs, &ino);
+    }
+    if (ret == 0) {
+        ret = dir_add_entry(fs, &parent, name, ino.inum);
+    }
+    if (ret == 0) {
+        parent.mtime = ino.mtime;
+        parent.ctime = ino.mtime;
+        ret = write_inode(fs, &parent);
+    } else {
+        truncate_blocks(fs, &ino, 0);
+        release_inode_number(fs, ino.inum);
+    }
+    write_superblock(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+/**
+ * Copy the target of the symlink at path into buf, cut short to fit and
+ * always '\0'-terminated, as FUSE wants it
+ */
+int libsfs_readlink(sfs_fs *fs, const char *path, char *buf, size_t size) {
+    inode ino;
+
+    if (size == 0) {
+        return -EINVAL;
+    }
+    pthread_rwlock_rdlock(&fs->lock);
+    int ret = resolute_path(fs, path, &ino);
+    if (ret == 0 && ino.type != SYMLINK) {
+        ret = -EINVAL;
+    }
+    if (ret == 0) {
+        ssize_t done = inode_read(fs, &ino, buf, size - 1, 0);
+        ret = done < 0 ? (int) done : 0;
+        buf[done < 0 ? 0 : done] = '\0';
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+/**
+ * List a directory, "." and ".." included. st is passed as NULL; the
+ * filler must not call back into libsfs.
+ */
+int libsfs_readdir(sfs_fs *fs, const char *path, libsfs_filldir_t filler, void *ctx) {
+    inode dir;
+    char buffer[BLOCK_SIZE];
+    uint64_t i, block;
+    int j;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    int ret = resolute_path(fs, path, &dir);
+    if (ret == 0 && dir.type != DIRECTORY) {
+        ret = -ENOTDIR;
+    }
+    for (i = 0; ret == 0 && i < (uint64_t) dir.size / BLOCK_SIZE; i++) {
+        if (inode_bmap(fs, &dir, i, &block) < 0 || block == 0) {
+            continue;
+        }
+        meta_read(fs, block, buffer);
+        for (j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            file_entry *entry = (file_entry *) &buffer[j * FILE_ENTRY_SIZE];
+            if (entry->inum != 0 && filler(ctx, entry->file_name, NULL) != 0) {
+                pthread_rwlock_unlock(&fs->lock);
+                return 0;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+/**
+ * Discard the free space of the image between bytes start and start + len
+ * in runs of at least minlen bytes, one group at a time so that writers
+ * are held up only briefly
+ * @return 0 with the bytes discarded in *trimmed, or -errno
+ */
+int libsfs_trim(sfs_fs *fs, uint64_t start, uint64_t len, uint64_t minlen, uint64_t *trimmed) {
+    uint64_t first = start / BLOCK_SIZE, end, total = 0, min = (minlen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int g;
+
+    if (first >= fs->sb.total_blocks) {
+        return -EINVAL;
+    }
+    end = len / BLOCK_SIZE > fs->sb.total_blocks - first ? fs->sb.total_blocks : first + len / BLOCK_SIZE;
+    if (min > fs->sb.blocks_per_group) {
+        min = fs->sb.blocks_per_group;
+    }
+    for (g = (unsigned int) (first / fs->sb.blocks_per_group);
+         g < fs->sb.group_count && (uint64_t) g * fs->sb.blocks_per_group < end; g++) {
+        pthread_rwlock_wrlock(&fs->lock);
+        long n = trim_group(fs, g, first, end, min > 0 ? (unsigned int) min : 1);
+        pthread_rwlock_unlock(&fs->lock);
+        if (n < 0) {
+            return (int) n;
+        }
+        total += (uint64_t) n;
+    }
+    log_info(LOG_CAT_ALLOC, "libsfs_trim: discarded %llu blocks\n", (unsigned long long) total);
+    *trimmed = total * BLOCK_SIZE;
+    return 0;
+}
@@ -0,0 +1,96 @@
+//
+// libsfs: the Simple File System core as an embeddable C library.
+//
+// Everything the FUSE daemon can do is available in-process through an
+// explicit filesystem handle, so batch jobs can read and write images
+// without a mount.  The handle is safe to share between threads.
+//
+// Calls return 0 (or a byte count) on success and a negative errno value
+// on failure, the same convention FUSE uses.
+//
+
+#ifndef LIBSFS_H
+#define LIBSFS_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+typedef struct sfs_fs sfs_fs;
+typedef struct libsfs_file libsfs_file;
+
+typedef struct libsfs_options {
+    // Metadata updates are committed to the journal at least this often,
+    // in milliseconds; 0 picks the default (50)
+    unsigned int commit_interval_ms;
+    // Append all file data to a log instead of overwriting it in place,
+    // see lfs.h
+    int log_structured;
+    // Compress the data of files created from now on, see compress.h;
+    // needs LZ4 at build time
+    int compress;
+    // Share identical blocks of regular files instead of writing them
+    // again, see dedup.h
+    int dedup;
+    // Punch freed blocks out of the image file as they are freed, so the
+    // host gets the space back; needs hole punching on the host
+    int discard;
+    // Keep the timestamps a write changes in memory when it changes
+    // nothing else, until the file is closed or fsynced or an hour has
+    // passed; atime is always kept this way
+    int lazytime;
+} libsfs_options;
+
+// Geometry for libsfs_format; zero fields pick defaults
+typedef struct libsfs_format_options {
+    off_t size;                     // bytes; default: the image's size, or 16 MB if empty
+    unsigned int block_size;        // only 512 is supported
+    unsigned int blocks_per_group;  // rounded up to a multiple of 4096; default 32768
+    unsigned int journal_blocks;    // at least 16; default 1/16 of group 0, at most 4096
+} libsfs_format_options;
+
+// Called once per directory entry; return non-zero to stop early
+typedef int (*libsfs_filldir_t)(void *ctx, const char *name, const struct stat *st);
+
+int libsfs_format(const char *image_path, libsfs_format_options *opts);
+int libsfs_mount(const char *image_path, const libsfs_options *opts, sfs_fs **fsp);
+void libsfs_unmount(sfs_fs *fs);
+
+int libsfs_stat(sfs_fs *fs, const char *path, struct stat *st);
+int libsfs_create(sfs_fs *fs, const char *path, mode_t mode, libsfs_file **filep);
+int libsfs_open(sfs_fs *fs, const char *path, int flags, libsfs_file **filep);
+int libsfs_close(libsfs_file *file);
+ssize_t libsfs_read(libsfs_file *file, void *buf, size_t size, off_t offset);
+ssize_t libsfs_write(libsfs_file *file, const void *buf, size_t size, off_t offset);
+int libsfs_fstat(libsfs_file *file, struct stat *st);
+int libsfs_truncate(sfs_fs *fs, const char *path, off_t size);
+int libsfs_ftruncate(libsfs_file *file, off_t size);
+// Whole blocks are shared between the files rather than copied; either
+// file gets a copy of its own on its next write to them
+ssize_t libsfs_copy_file_range(libsfs_file *in, off_t off_in, libsfs_file *out, off_t off_out, size_t len);
+int libsfs_clone(libsfs_file *src, libsfs_file *dest);
+// SEEK_DATA and SEEK_HOLE only; holes read as zeros and take no space
+off_t libsfs_lseek(libsfs_file *file, off_t offset, int whence);
+// FALLOC_FL_* modes of <linux/falloc.h>
+int libsfs_fallocate(libsfs_file *file, int mode, off_t offset, off_t len);
+int libsfs_fsync(libsfs_file *file);
+int libsfs_utimens(sfs_fs *fs, const char *path, const struct timespec tv[2]);
+int libsfs_unlink(sfs_fs *fs, const char *path);
+int libsfs_mkdir(sfs_fs *fs, const char *path, mode_t mode);
+int libsfs_rmdir(sfs_fs *fs, const char *path);
+int libsfs_rename(sfs_fs *fs, const char *from, const char *to);
+int libsfs_link(sfs_fs *fs, const char *from, const char *to);
+int libsfs_symlink(sfs_fs *fs, const char *target, const char *path);
+int libsfs_readlink(sfs_fs *fs, const char *path, char *buf, size_t size);
+int libsfs_readdir(sfs_fs *fs, const char *path, libsfs_filldir_t filler, void *ctx);
+// Punch the free space between bytes start and start + len out of the
+// image, in runs of at least minlen bytes, as FITRIM does
+int libsfs_trim(sfs_fs *fs, uint64_t start, uint64_t len, uint64_t minlen, uint64_t *trimmed);
+
+#endif //LIBSFS_H
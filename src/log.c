@@ -13,9 +13,14 @@
 #include "params.h"
 
 #include <fuse.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -23,9 +28,40 @@
 
 #include "log.h"
 
+// Log records are not written by the calling thread.  log_msg() formats
+// into a slot of a fixed-size ring and returns; a background thread
+// drains the ring into the logfile in large write()s.  The ring is a
+// bounded multi-producer queue (each slot carries a sequence number, as
+// in Vyukov's MPMC queue), so producers never take a lock.  When the
+// ring is full the record is dropped and counted instead of blocking
+// the filesystem operation.
+#define LOG_RING_SLOTS 4096          // must be a power of two
+#define LOG_RECORD_SIZE 256
+#define LOG_DRAIN_BUFFER (64 * 1024)
+#define LOG_IDLE_SLEEP_NS (5 * 1000 * 1000)
+
+typedef struct log_record {
+    atomic_size_t seq;
+    unsigned int len;
+    char text[LOG_RECORD_SIZE - sizeof(atomic_size_t) - sizeof(unsigned int)];
+} log_record;
+
+int log_level = SFS_LOG_WARN;
+unsigned int log_mask = LOG_CAT_ALL;
+
+static log_record log_ring[LOG_RING_SLOTS];
+static atomic_size_t log_head;          // next slot claimed by a producer
+static size_t log_tail;                 // next slot read by the drainer
+static atomic_ulong log_dropped;
+static atomic_int log_running;
+static pthread_t log_thread;
+static int log_thread_started = 0;
+static int log_fd = -1;
+
 FILE *log_open()
 {
     FILE *logfile;
+    size_t i;
     
     // very first thing, open up the logfile and mark that we got in
     // here.  If we can't open the logfile, we're dead.
@@ -35,18 +71,152 @@ FILE *log_open()
 	exit(EXIT_FAILURE);
     }
     
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // the drainer writes straight to the descriptor, never through stdio
+    setvbuf(logfile, NULL, _IONBF, 0);
+    log_fd = fileno(logfile);
+
+    for (i = 0; i < LOG_RING_SLOTS; i++)
+	atomic_init(&log_ring[i].seq, i);
+    atomic_init(&log_head, 0);
+    log_tail = 0;
+    atomic_init(&log_dropped, 0);
+    atomic_init(&log_running, 0);
 
     return logfile;
 }
 
+static void log_flush(char *buf, size_t *used)
+{
+    size_t done = 0;
+    while (done < *used) {
+	ssize_t n = write(log_fd, buf + done, *used - done);
+	if (n <= 0)
+	    break;
+	done += n;
+    }
+    *used = 0;
+}
+
+// Move everything currently published in the ring into buf, writing
+// buf out whenever it fills.  Returns the number of records taken.
+static size_t log_drain(char *buf, size_t *used)
+{
+    size_t taken = 0;
+    for (;;) {
+	log_record *rec = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+	size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+	if (seq != log_tail + 1)
+	    break;
+	if (*used + rec->len > LOG_DRAIN_BUFFER)
+	    log_flush(buf, used);
+	memcpy(buf + *used, rec->text, rec->len);
+	*used += rec->len;
+	atomic_store_explicit(&rec->seq, log_tail + LOG_RING_SLOTS, memory_order_release);
+	log_tail++;
+	taken++;
+    }
+    return taken;
+}
+
+static void *log_drain_thread(void *arg)
+{
+    char *buf = malloc(LOG_DRAIN_BUFFER);
+    size_t used = 0;
+    unsigned long reported = 0;
+    struct timespec idle = {0, LOG_IDLE_SLEEP_NS};
+    (void) arg;
+
+    if (buf == NULL)
+	return NULL;
+    for (;;) {
+	int running = atomic_load(&log_running);
+	size_t taken = log_drain(buf, &used);
+	unsigned long dropped = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+	if (dropped != reported) {
+	    char note[64];
+	    int len = snprintf(note, sizeof(note), "[log: %lu records dropped]\n",
+			       dropped - reported);
+	    if (used + len > LOG_DRAIN_BUFFER)
+		log_flush(buf, &used);
+	    memcpy(buf + used, note, len);
+	    used += len;
+	    reported = dropped;
+	}
+	if (taken == 0) {
+	    log_flush(buf, &used);
+	    if (!running)
+		break;
+	    nanosleep(&idle, NULL);
+	}
+    }
+    free(buf);
+    return NULL;
+}
+
+// Start the drainer.  This has to happen in sfs_init rather than
+// log_open, because fuse_main forks into the background in between and
+// threads do not survive the fork; records logged before then simply
+// wait in the ring.
+void log_start(void)
+{
+    if (log_fd < 0 || log_thread_started)
+	return;
+    atomic_store(&log_running, 1);
+    if (pthread_create(&log_thread, NULL, log_drain_thread, NULL) == 0)
+	log_thread_started = 1;
+    else
+	atomic_store(&log_running, 0);
+}
+
+// Stop the drainer after it has written out everything still queued.
+void log_close(void)
+{
+    if (log_thread_started) {
+	atomic_store(&log_running, 0);
+	pthread_join(log_thread, NULL);
+	log_thread_started = 0;
+    }
+}
+
+unsigned long log_dropped_records(void)
+{
+    return atomic_load_explicit(&log_dropped, memory_order_relaxed);
+}
+
 void log_msg(const char *format, ...)
 {
     va_list ap;
-    va_start(ap, format);
+    log_record *rec;
+    size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    int len;
+
+    // claim a slot, or drop the record if the drainer has fallen behind
+    for (;;) {
+	rec = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+	size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+	intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+	if (diff == 0) {
+	    if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+						      memory_order_relaxed,
+						      memory_order_relaxed))
+		break;
+	} else if (diff < 0) {
+	    atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+	    return;
+	} else {
+	    pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+	}
+    }
 
-    vfprintf(SFS_DATA->logfile, format, ap);
+    va_start(ap, format);
+    len = vsnprintf(rec->text, sizeof(rec->text), format, ap);
+    va_end(ap);
+    if (len < 0)
+	len = 0;
+    else if (len >= (int) sizeof(rec->text))
+	len = sizeof(rec->text) - 1;   // long records are truncated
+    rec->len = len;
+    atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
 }
 
 // fuse context
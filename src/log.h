@@ -9,12 +9,63 @@
 #define _LOG_H_
 #include <stdio.h>
 
+struct fuse_conn_info;
+struct fuse_context;
+struct fuse_file_info;
+struct stat;
+struct statvfs;
+struct utimbuf;
+
+// Log levels.  Anything above SFS_LOG_MAX_LEVEL is compiled out
+// entirely (arguments are not even evaluated); build with e.g.
+// -DSFS_LOG_MAX_LEVEL=SFS_LOG_WARN for production.  Below that, the
+// runtime level and category mask (mount options log_level= and
+// log_mask=) decide what is written.
+#define SFS_LOG_ERROR 1
+#define SFS_LOG_WARN  2
+#define SFS_LOG_INFO  3
+#define SFS_LOG_DEBUG 4
+#define SFS_LOG_TRACE 5   // struct dumps: log_conn, log_fi, log_stat, ...
+
+#ifndef SFS_LOG_MAX_LEVEL
+#define SFS_LOG_MAX_LEVEL SFS_LOG_TRACE
+#endif
+
+// Categories, for log_mask
+#define LOG_CAT_MOUNT  0x01   // init/destroy
+#define LOG_CAT_FILE   0x02   // file operations
+#define LOG_CAT_DIR    0x04   // directory operations
+#define LOG_CAT_ALLOC  0x08   // inode/block allocation and bitmaps
+#define LOG_CAT_LOOKUP 0x10   // path resolution
+#define LOG_CAT_BLOCK  0x20   // block device I/O
+#define LOG_CAT_JOURNAL 0x40  // metadata journal
+#define LOG_CAT_ALL    0xff
+
+extern int log_level;
+extern unsigned int log_mask;
+
+#define log_enabled(level, cat) \
+  ((level) <= SFS_LOG_MAX_LEVEL && (level) <= log_level && (log_mask & (cat)))
+
+#define log_at(level, cat, ...) \
+  do { if (log_enabled(level, cat)) log_msg(__VA_ARGS__); } while (0)
+
+#define log_error(cat, ...) log_at(SFS_LOG_ERROR, cat, __VA_ARGS__)
+#define log_warn(cat, ...)  log_at(SFS_LOG_WARN, cat, __VA_ARGS__)
+#define log_info(cat, ...)  log_at(SFS_LOG_INFO, cat, __VA_ARGS__)
+#define log_debug(cat, ...) log_at(SFS_LOG_DEBUG, cat, __VA_ARGS__)
+#define log_trace(cat, ...) log_at(SFS_LOG_TRACE, cat, __VA_ARGS__)
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
   log_msg("    " #field " = " #format "\n", typecast st->field)
 
 FILE *log_open(void);
+void log_start(void);
+void log_close(void);
+unsigned long log_dropped_records(void);
 void log_conn (struct fuse_conn_info *conn);
+void log_fuse_context(struct fuse_context *context);
 void log_fi (struct fuse_file_info *fi);
 void log_stat(struct stat *si);
 void log_statvfs(struct statvfs *sv);
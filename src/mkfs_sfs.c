@@ -0,0 +1,93 @@
+/*
+  mkfs.sfs: lay out an empty Simple File System on an image file or
+  block device.
+
+  usage:  mkfs.sfs [-s size] [-b block_size] [-g blocks_per_group] [-J journal_blocks] image
+
+  Sizes take an optional K, M, G or T suffix.  Only the superblock, the
+  group descriptors, the bitmaps, the first inode chunk and the root
+  directory are written, plus an empty journal header; further inodes are carved out of the data space
+  on demand, so formatting is fast regardless of the image size.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libsfs.h"
+#include "stats.h"
+
+static void mkfs_usage(void) {
+    fprintf(stderr, "usage:  mkfs.sfs [-s size] [-b block_size] [-g blocks_per_group] [-J journal_blocks] image\n");
+    fprintf(stderr, "  -s SIZE  image size, default the current size of the image or 16M\n");
+    fprintf(stderr, "  -b SIZE  block size, only 512 is supported\n");
+    fprintf(stderr, "  -g N     blocks per group, rounded up to a multiple of 4096, default 32768\n");
+    fprintf(stderr, "  -J N     journal blocks, at least 16, default 1/16 of the first group up to 4096\n");
+    exit(EXIT_FAILURE);
+}
+
+/** Parse a number with an optional K/M/G/T suffix, or return -1 */
+static long long parse_size(const char *arg) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (errno != 0 || end == arg || value < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'T': case 't': value <<= 10; // fall through
+        case 'G': case 'g': value <<= 10; // fall through
+        case 'M': case 'm': value <<= 10; // fall through
+        case 'K': case 'k': value <<= 10; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? value : -1;
+}
+
+int main(int argc, char *argv[]) {
+    libsfs_format_options opts;
+    long long value;
+    int opt;
+
+    memset(&opts, 0, sizeof(opts));
+    while ((opt = getopt(argc, argv, "s:b:g:J:")) != -1) {
+        if ((value = parse_size(optarg)) < 0) {
+            mkfs_usage();
+        }
+        switch (opt) {
+            case 's':
+                opts.size = (off_t) value;
+                break;
+            case 'b':
+                opts.block_size = (unsigned int) value;
+                break;
+            case 'g':
+                opts.blocks_per_group = (unsigned int) value;
+                break;
+            case 'J':
+                opts.journal_blocks = (unsigned int) value;
+                break;
+            default:
+                mkfs_usage();
+        }
+    }
+    if (argc - optind != 1) {
+        mkfs_usage();
+    }
+
+    uint64_t start = stats_now();
+    int ret = libsfs_format(argv[optind], &opts);
+    if (ret < 0) {
+        fprintf(stderr, "mkfs.sfs: %s: %s\n", argv[optind], strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    printf("%s: %lld bytes, %u-byte blocks, %u blocks per group, %u journal blocks (%.3f ms)\n",
+           argv[optind], (long long) opts.size, opts.block_size,
+           opts.blocks_per_group, opts.journal_blocks, (stats_now() - start) / 1e6);
+    return 0;
+}
@@ -17,15 +17,24 @@
 #define FUSE_USE_VERSION 26
 
 // need this to get pwrite().  I have to use setvbuf() instead of
-// setlinebuf() later in consequence.
-#define _XOPEN_SOURCE 500
+// setlinebuf() later in consequence.  700 also brings in UTIME_NOW
+// and UTIME_OMIT for utimens.
+#define _XOPEN_SOURCE 700
 
 // maintain bbfs state in here
 #include <limits.h>
 #include <stdio.h>
+struct sfs_fs;
 struct sfs_state {
     FILE *logfile;
     char *diskfile;
+    struct sfs_fs *fs;
+    unsigned int commit_interval_ms; // journal commit interval, 0 for the default
+    int log_structured;  // -o log
+    int compress;        // -o compress
+    int dedup;           // -o dedup
+    int discard;         // -o discard
+    int lazytime;        // -o lazytime
 };
 #define SFS_DATA ((struct sfs_state *) fuse_get_context()->private_data)
 
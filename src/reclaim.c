@@ -0,0 +1,230 @@
+//
+// Background reclamation of orphans, see reclaim.h.
+//
+
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "journal.h"
+#include "log.h"
+#include "reclaim.h"
+#include "stats.h"
+
+// The reclaimer looks at the orphan list this often even if nobody wakes it
+#define RECLAIM_INTERVAL_MS 1000
+
+struct reclaim {
+    pthread_t thread;
+    pthread_mutex_t mutex;  // protects stop and pending
+    pthread_cond_t wake;
+    int stop;
+    int pending;            // woken since the last pass began
+};
+
+void reclaim_wake(sfs_fs *fs) {
+    struct reclaim *r = fs->reclaim;
+    if (r == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&r->mutex);
+    r->pending = 1;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+void orphan_add(sfs_fs *fs, inode *ino) {
+    ino->links_count = 0;
+    ino->dtime = time(NULL);
+    ino->next_orphan = fs->sb.orphan_head;
+    fs->sb.orphan_head = ino->inum;
+}
+
+int orphan_truncate(sfs_fs *fs, inode *ino) {
+    inode orphan;
+    // A few blocks are quicker freed than handed over
+    if ((ino->flags & INODE_INLINE_DATA) || ino->blocks_number < RECLAIM_BATCH_BLOCKS) {
+        return truncate_blocks(fs, ino, 0);
+    }
+    memset(&orphan, 0, sizeof(inode));
+    orphan.inum = assign_inode_number(fs, ino->inum);
+    if (orphan.inum == 0) {
+        return truncate_blocks(fs, ino, 0);
+    }
+    orphan.mode = S_IFREG;
+    orphan.type = REGULAR_FILE;
+    orphan.size = ino->size;
+    orphan.blocks_number = ino->blocks_number;
+    orphan.flags = ino->flags & (INODE_TAIL_PACKED | INODE_COMPRESSED);
+    orphan.parent_Ptr = ino->inum;
+    memcpy(orphan.inline_data, ino->inline_data, INODE_INLINE_SIZE);
+    orphan_add(fs, &orphan);
+    if (write_inode(fs, &orphan) < 0) {
+        fs->sb.orphan_head = orphan.next_orphan;
+        release_inode_number(fs, orphan.inum);
+        return truncate_blocks(fs, ino, 0);
+    }
+    memset(ino->inline_data, 0, INODE_INLINE_SIZE);
+    ino->blocks_number = 0;
+    ino->flags &= ~INODE_TAIL_PACKED;
+    log_debug(LOG_CAT_ALLOC, "orphan_truncate: inode %u handed %llu blocks to inode %u\n", ino->inum,
+              (unsigned long long) orphan.blocks_number, orphan.inum);
+    reclaim_wake(fs);
+    return 0;
+}
+
+/**
+ * Free the last RECLAIM_BATCH_BLOCKS or so file blocks an orphan maps,
+ * past its size too, where fallocate may have reserved some. Holes are
+ * skipped in ever larger steps, so a sparse file costs little. Caller
+ * holds fs->lock exclusively and writes ino back.
+ * @return 1 once ino owns nothing any more, or 0
+ */
+static int reclaim_batch(sfs_fs *fs, inode *ino) {
+    uint64_t end = MAX_FILE_BLOCKS, gap = RECLAIM_BATCH_BLOCKS, cut, found;
+    // Inline bytes are no block map, and own no blocks
+    if (ino->flags & INODE_INLINE_DATA) {
+        truncate_blocks(fs, ino, 0);
+        ino->size = 0;
+        return 1;
+    }
+    for (;;) {
+        cut = end > gap ? end - gap : 0;
+        cut -= cut % COMPRESS_CLUSTER_BLOCKS;
+        if (!inode_seek(fs, ino, cut, end, SEEK_MAPPED, &found)) {
+            end = cut;
+            gap *= 2;
+            if (end == 0) break;
+            continue;
+        }
+        if (gap == RECLAIM_BATCH_BLOCKS || end <= RECLAIM_BATCH_BLOCKS) break;
+        // The wide step found blocks: take a batch of them from its end
+        gap = RECLAIM_BATCH_BLOCKS;
+    }
+    uint64_t before = ino->blocks_number;
+    if ((off_t) cut * BLOCK_SIZE < ino->size) {
+        truncate_blocks(fs, ino, (off_t) cut * BLOCK_SIZE);
+        ino->size = (off_t) cut * BLOCK_SIZE;
+    } else {
+        punch_blocks(fs, ino, cut, end);
+    }
+    stats_add(STAT_RECLAIM_BLOCKS, before - ino->blocks_number);
+    return cut == 0;
+}
+
+/**
+ * Work on the first orphan that is no longer open: free a batch of its
+ * blocks, and take it off the list and give it back if that was the last
+ * @return 1 if there was such an orphan, or 0
+ */
+static int reclaim_one(sfs_fs *fs) {
+    inode ino, prev;
+    unsigned int inum, before = 0, seen = 0;
+    // Nothing freed could be committed any more
+    if (journal_error(fs) < 0) {
+        return 0;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    for (inum = fs->sb.orphan_head; inum != 0; before = inum, inum = ino.next_orphan) {
+        if (++seen > fs->sb.used_inodes || read_inode(fs, inum, &ino) < 0) {
+            log_error(LOG_CAT_ALLOC, "reclaim_one: orphan list broken at inode %u\n", inum);
+            inum = 0;
+            break;
+        }
+        // An open orphan is freed after its last handle is closed
+        if (!inode_is_open(fs, inum)) {
+            break;
+        }
+    }
+    if (inum == 0) {
+        pthread_rwlock_unlock(&fs->lock);
+        return 0;
+    }
+    if (reclaim_batch(fs, &ino)) {
+        if (before == 0) {
+            fs->sb.orphan_head = ino.next_orphan;
+        } else if (read_inode(fs, before, &prev) == 0) {
+            prev.next_orphan = ino.next_orphan;
+            write_inode(fs, &prev);
+        }
+        ino.next_orphan = 0;
+        write_inode(fs, &ino);
+        release_inode_number(fs, inum);
+        log_debug(LOG_CAT_ALLOC, "reclaim_one: gave back inode %u\n", inum);
+    } else {
+        write_inode(fs, &ino);
+    }
+    write_superblock(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return 1;
+}
+
+static void *reclaim_thread(void *arg) {
+    sfs_fs *fs = arg;
+    struct reclaim *r = fs->reclaim;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&r->mutex);
+    while (!r->stop) {
+        if (!r->pending) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += RECLAIM_INTERVAL_MS / 1000;
+            pthread_cond_timedwait(&r->wake, &r->mutex, &deadline);
+        }
+        r->pending = 0;
+        while (!r->stop) {
+            pthread_mutex_unlock(&r->mutex);
+            int more = reclaim_one(fs);
+            pthread_mutex_lock(&r->mutex);
+            if (!more) {
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return NULL;
+}
+
+int reclaim_start(sfs_fs *fs) {
+    struct reclaim *r = calloc(1, sizeof(struct reclaim));
+    if (r == NULL) {
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    // Orphans left by the last mount are worked on at once
+    r->pending = fs->sb.orphan_head != 0;
+    fs->reclaim = r;
+    int ret = pthread_create(&r->thread, NULL, reclaim_thread, fs);
+    if (ret != 0) {
+        fs->reclaim = NULL;
+        pthread_cond_destroy(&r->wake);
+        pthread_mutex_destroy(&r->mutex);
+        free(r);
+        return -ret;
+    }
+    if (fs->sb.orphan_head != 0) {
+        log_info(LOG_CAT_MOUNT, "reclaim_start: resuming the orphan list at inode %u\n", fs->sb.orphan_head);
+    }
+    return 0;
+}
+
+void reclaim_stop(sfs_fs *fs) {
+    struct reclaim *r = fs->reclaim;
+    if (r == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&r->mutex);
+    r->stop = 1;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_join(r->thread, NULL);
+    fs->reclaim = NULL;
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->mutex);
+    free(r);
+}
@@ -0,0 +1,40 @@
+//
+// Background reclamation of deleted and truncated files.
+//
+// Unlinking the last name of a file does not free its blocks: the inode
+// goes on the orphan list (see sfs.h) in the same transaction that removes
+// the name, and unlink returns.  Truncating a file to zero hands its whole
+// block map to a fresh inode on the orphan list the same way.  A reclaimer
+// thread then frees the blocks of each orphan that is not open any more,
+// RECLAIM_BATCH_BLOCKS at a time from the end of the file so that fs->lock
+// is only held briefly, and gives the inode back once it owns nothing.
+// The list is on disk, so after a crash the reclaimer carries on at mount.
+//
+
+#ifndef SFS_RECLAIM_H
+#define SFS_RECLAIM_H
+
+#include "sfs_helper_functions.h"
+
+// Blocks freed per hold of fs->lock; a multiple of COMPRESS_CLUSTER_BLOCKS
+#define RECLAIM_BATCH_BLOCKS 1024
+
+int reclaim_start(sfs_fs *fs);
+
+// Stop the reclaimer; whatever is left on the orphan list stays there
+void reclaim_stop(sfs_fs *fs);
+
+// Have the reclaimer look at the orphan list again
+void reclaim_wake(sfs_fs *fs);
+
+// Put ino, whose last name is gone, on the orphan list. Caller holds
+// fs->lock exclusively and writes ino and the superblock back.
+void orphan_add(sfs_fs *fs, inode *ino);
+
+// Empty ino, leaving its size to the caller: its blocks go to a new
+// orphan inode, or are freed at once if there are few. Caller holds
+// fs->lock exclusively and writes ino and the superblock back. Returns 0
+// or -errno.
+int orphan_truncate(sfs_fs *fs, inode *ino);
+
+#endif //SFS_RECLAIM_H
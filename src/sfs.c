@@ -8,7 +8,6 @@
 */
 
 #include "params.h"
-#include "block.h"
 
 #include <ctype.h>
 #include <dirent.h>
@@ -17,21 +16,24 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <math.h>
 #include <fuse/fuse_common.h>
+#include <linux/fs.h>
 
 #ifdef HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
 #endif
 
 #include "log.h"
-#include "sfs.h"
-#include "sfs_helper_functions.h"
+#include "libsfs.h"
+#include "sfs_ioctl.h"
+#include "stats.h"
+#include "trace.h"
 
 
 ///////////////////////////////////////////////////////////
@@ -39,185 +41,37 @@
 // Prototypes for all these functions, and the C-style comments,
 // come indirectly from /usr/include/fuse.h
 //
+// Each operation is a thin adapter over libsfs (libsfs.h): the
+// filesystem handle lives in SFS_DATA->fs, and fi->fh carries an
+// sfs_handle for every open file.
+//
 
-// block_size = 512 = 2^9
-#define BLOCK_SIZE 512
-#define DISK_SIZE (16*1024*1024)
-//At most 4096 inodes, which needs 4096 / 4 = 1024 = 2^10 inode blocks
-//and needs bitmap of 4096 bits = 2^12 bits = 2^9 bytes = 512 bytes = 1 block
-#define MAX_FILE_NUMBER 4096
-//total_blocks = 16 * 1024 * 2 = 2^15, need bitmap of 2^15 bits = 2^12 bytes = 8 blocks
-//So in 2^15 blocks, 1+1+8=10 was used for superblock and bitmap
-#define TOTAL_BLOCKS (DISK_SIZE / BLOCK_SIZE)
-#define INODE_SIZE 128  //2^7
-#define MAX_BLOCKS_OF_FILE 12 //A file can have at most 12 blocks
-#define FILE_ENTRY_SIZE 128
-#define MAX_OPENED_FILES 100
-
-#define INODE_BITMAP_UPDATE 0
-#define DATA_BITMAP_UPDATE 1
-/***************************************************************************************************
- ***************************************************************************************************
- * Distribution of Blocks
- * superblock | inode bitmap | data block bitmap | inode block | data block
- * 0            1              2 - 9               10 - 1033     1034 - 32768
- * 1 block      1 block        8 blocks            1024 blocks   31735 blocks
- ***************************************************************************************************
- ***************************************************************************************************/
-
-
-superblock *sb;
-inode *current_dir;
-filehandler_entry opened_files[MAX_OPENED_FILES];
-int fh_cursor = 0;
-
-
-/***************************************************************************************************
- ***************************************************************************************************
- * Some helper functions
- ***************************************************************************************************
- ***************************************************************************************************/
- 
 /**
- * Given the index of newly allocated inode or data block, update the bitmap
- * @param index: The ith inode, or the ith data block. An index of data block is not the absolute
- *               data block number, but the relative index related to superBlock.data_begin
- * @param mode: INODE_BITMAP_UPDATE == 0; DATA_BITMAP_UPDATE == 1
+ * Per-open state. Regular files hold a libsfs_file; the synthetic stats
+ * file holds the snapshot rendered when it was opened.
  */
-void update_bitmap(unsigned int index, unsigned int mode) {
-    if (sb == NULL) {
-        sb = malloc(BLOCK_SIZE * sizeof(char));
-        block_read(0, (void *) sb);
-    }
-    int absolute_char_address = index / 8;
-    int bitmap_block_offset = absolute_char_address / BLOCK_SIZE;
-    int char_offset = absolute_char_address % BLOCK_SIZE;
-    int bit_offset = index % 8;
-    int bitmap_block_base = -1;
-    if (mode == INODE_BITMAP_UPDATE) {
-        bitmap_block_base = sb->inode_bitmap_begin;
-        if (bitmap_block_offset >= sb->inode_bitmap_blocks) {
-            printf("Inode bitmap calculation error~\n");
-            abort();
-        }
-    } else if (mode == DATA_BITMAP_UPDATE) {
-        bitmap_block_base = sb->data_bitmap_begin;
-        if (bitmap_block_offset >= sb->data_bitmap_blocks) {
-            printf("Data block bitmap calculation error~\n");
-            abort();
-        }
-    }
-    int block_to_update = bitmap_block_base + bitmap_block_offset;
-    unsigned char buffer[BLOCK_SIZE];
-    block_read(block_to_update, buffer);
-    buffer[char_offset] = buffer[char_offset] | (128 >> bit_offset);
-    block_write(block_to_update, buffer);
-}
-
-void directory_block_init(unsigned int block_id, unsigned int inum, unsigned int parent_inum) {
-    block_id += sb->data_begin;
-    char buffer[BLOCK_SIZE];
-    memset(buffer, 0, BLOCK_SIZE);
-    file_entry *fe = (file_entry *) &buffer[0];
-    fe->inum = inum;
-    strcpy(fe->file_name, ".");
-    fe = (file_entry *) ((void *) fe + sizeof(file_entry));
-    fe->inum = parent_inum;
-    strcpy(fe->file_name, "..");
-    block_write(block_id, buffer);
-}
-
-inode *get_inode_by_inum(int inum) {
-    if (inum >= MAX_FILE_NUMBER) {
-        printf("Wrong inode number!\n");
-        abort();
-    }
-    inode *target_file = (inode *) malloc(sizeof(inode));
-    char buffer[BLOCK_SIZE];
-    int block_offset = inum / 4; // One block can store 4 inodes
-    int byte_offset = inum % 4 * INODE_SIZE;
-    block_read(sb->inode_begin + block_offset, buffer);
-    memcpy(target_file, &buffer[byte_offset], INODE_SIZE);
-    return target_file;
-}
-
-inode *retrieve_file(char *filename, inode *current_dir) {
-    // To simplify, we assume that we only have a root directory. All the file is under this directory
-    inode *target_file = NULL;
-    char buffer[BLOCK_SIZE];
-    int i = 0;
-    for (; i < current_dir->blocks_number; i++) {
-        int absolute_block_id = current_dir->block_pointers[i] + sb->data_begin;
-        block_read(absolute_block_id, buffer);
-        file_entry *entry;
-        int j;
-        for (j = 0; j < 4; j++) {
-            entry = (file_entry *) &buffer[j * 128];
-            if (strcmp(entry->file_name, filename) == 0) {
-                target_file = get_inode_by_inum(entry->inum);
-                return target_file;
-            }
-        }
-    }
-    printf("No such file or directory exists in current directory\n");
-    return NULL;
-}
-
-inode *resolute_path(char *path, inode *current_dir) {
-    inode *target_file = NULL;
-    // Target is the root directory
-    if (strcmp(path, "/") == 0) {
-        target_file = get_inode_by_inum(sb->root_inode_ptr);
-        return target_file;
-    }
-    // Otherwise, target is a file under root directory
-    int start = (path[0] == '/') ? 1 : 0;
-    size_t length = strlen(path) - start + 1;
-    char filename[length];
-    memcpy(filename, &path[start], length - 1);
-    filename[length - 1] = '\0';
-    target_file = retrieve_file(filename, current_dir);
-    return target_file;
-}
-
-
-unsigned int assign_block() {
-    char buffer[BLOCK_SIZE];
-    if (sb->free_data_blocks == 0) return 0;
-    unsigned int block_offset = 0, byte_offset = 0, bit_offset = 0;
-    for (; block_offset < sb->data_bitmap_blocks; block_offset++) {
-        block_read(sb->data_bitmap_begin + block_offset, buffer);
-        byte_offset = 0;
-        for (; byte_offset < BLOCK_SIZE; byte_offset++) {
-            unsigned char c = (unsigned char) buffer[byte_offset];
-            for (bit_offset = 0; bit_offset < 8; bit_offset++) {
-                if (c == 128 >> bit_offset) {
-                    unsigned int ret = block_offset * BLOCK_SIZE * 8 + byte_offset * 8 + bit_offset;
-                    update_bitmap(ret, DATA_BITMAP_UPDATE);
-                    return ret;
-                }
-            }
-        }
+typedef struct sfs_handle {
+    libsfs_file *file;
+    char *snapshot;
+    size_t snapshot_len;
+} sfs_handle;
+
+#define SFS_HANDLE(fi) ((sfs_handle *) (uintptr_t) (fi)->fh)
+
+static int sfs_new_handle(struct fuse_file_info *fi, libsfs_file *file) {
+    sfs_handle *h = calloc(1, sizeof(sfs_handle));
+    if (h == NULL) {
+        return -ENOMEM;
     }
+    h->file = file;
+    fi->fh = (uint64_t) (uintptr_t) h;
     return 0;
 }
 
-unsigned int assign_inode_number() {
-    char buffer[BLOCK_SIZE];
-    unsigned int block_offset, byte_offset, bit_offset = 0;
-    for (block_offset = 0; block_offset < sb->inode_bitmap_blocks; block_offset++) {
-        block_read(sb->inode_bitmap_begin + block_offset, buffer);
-        for (byte_offset = 0; byte_offset < BLOCK_SIZE; byte_offset++) {
-            unsigned char c = (unsigned char) buffer[byte_offset];
-            for (bit_offset = 0; bit_offset < 8; bit_offset++) {
-                if (c == 128 >> bit_offset) {
-                    unsigned int ret = block_offset * BLOCK_SIZE * 8 + byte_offset * 8 + bit_offset;
-                    return ret;
-                }
-            }
-        }
-    }
-    return 0;
+static int sfs_filldir(void *ctx, const char *name, const struct stat *st) {
+    void **args = ctx;
+    fuse_fill_dir_t filler = (fuse_fill_dir_t) args[1];
+    return filler(args[0], name, st, 0);
 }
 
 
@@ -233,86 +87,32 @@ unsigned int assign_inode_number() {
  */
 void *sfs_init(struct fuse_conn_info *conn) {
     fprintf(stderr, "in bb-init\n");
-    log_msg("\nsfs_init()\n");
-
-    log_conn(conn);
-    log_fuse_context(fuse_get_context());
-
-    char buffer[BLOCK_SIZE];
-    //Disk initialization
-    disk_open(SFS_DATA->diskfile);
-    //File handler array initialization
-    int i;
-    for (i = 0; i < MAX_OPENED_FILES; i++) {
-        opened_files[i].filehandler = (unsigned int) i;
-        opened_files[i].inum = 0;
-    }
-
-    //Superblock initialization
-    sb = (superblock *) malloc(sizeof(superblock));
-    sb->total_blocks = TOTAL_BLOCKS;
-    sb->inode_bitmap_begin = 1;
-    sb->inode_bitmap_blocks = 1;
-    sb->data_bitmap_begin = sb->inode_bitmap_begin + sb->inode_bitmap_blocks;
-    sb->data_bitmap_blocks = (unsigned int) ceil(
-            ((double) TOTAL_BLOCKS) / 8 / BLOCK_SIZE
-    );
-    sb->inode_begin = sb->data_bitmap_begin + sb->data_bitmap_blocks;
-    sb->inode_blocks = (unsigned int) ceil(
-            ((double) MAX_FILE_NUMBER) / (unsigned int) (BLOCK_SIZE / INODE_SIZE)
-    );
-    sb->data_begin = sb->inode_begin + sb->inode_blocks;
-    sb->data_blocks = TOTAL_BLOCKS - sb->data_begin;
-    sb->free_data_blocks = sb->data_blocks;
-    sb->root_inode_ptr = 1;
-    memset(buffer, 0, BLOCK_SIZE);
-    memcpy(&buffer, &sb, sizeof(superblock));
-    block_write(0, buffer);
-
-    //Root directory '/' inode initialization
-    inode *ino;
-    ino = (inode *) malloc(sizeof(ino));
-    ino->inum = 1;
-//    inum->mode =???
-    ino->uid = getuid();
-    ino->gid = getgid();
-    ino->size = 0; //I assume that directory size has no practical meaning, though it does have size
-    ino->type = DIRECTORY;
-    ino->atime = time(NULL);
-    ino->ctime = ino->atime;
-    ino->mtime = ino->ctime;
-//    inum->dtime = 0;
-    ino->blocks_number = 1;
-    ino->links_count = 0;
-//    ino->flags = 0;
-    ino->parent_Ptr = 1;
-    ino->block_pointers[0] = 1; // We reserve the first data block empty
-    current_dir = ino; //This inum will not be freed here
-    memset(buffer, 0, BLOCK_SIZE);
-    memcpy(&buffer[128], &ino, sizeof(inode));
-    block_write(sb->inode_begin, buffer);
-    //Root directory '/' data block initialization
-    memset(buffer, 0, BLOCK_SIZE);
-    directory_block_init(ino->block_pointers[0], ino->inum, ino->inum);
-
-    //Inode block bitmap initialization and update
-    memset(buffer, 0, BLOCK_SIZE);
-    for (i = 0; i < sb->inode_bitmap_blocks; i++) {
-        int block_id = sb->inode_bitmap_begin + i;
-        block_write(block_id, buffer);
-    }
-    update_bitmap(0, INODE_BITMAP_UPDATE);
-    update_bitmap(1, INODE_BITMAP_UPDATE);
-
-    //Data block bitmap initialization and update
-    memset(buffer, 0, BLOCK_SIZE);
-    for (i = 0; i < sb->data_bitmap_blocks; i++) {
-        int block_id = sb->data_bitmap_begin + i;
-        block_write(block_id, buffer);
-    }
-    update_bitmap(0, DATA_BITMAP_UPDATE);
-    update_bitmap(1, DATA_BITMAP_UPDATE);
-    sb->free_data_blocks = sb->free_data_blocks - 2;
+    log_start();
+    log_info(LOG_CAT_MOUNT, "\nsfs_init()\n");
+
+    if (log_enabled(SFS_LOG_TRACE, LOG_CAT_MOUNT)) {
+        log_conn(conn);
+        log_fuse_context(fuse_get_context());
+    }
+
+    // Let the kernel send writes larger than one page
+    conn->want |= FUSE_CAP_BIG_WRITES;
+
+    libsfs_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.commit_interval_ms = SFS_DATA->commit_interval_ms;
+    opts.log_structured = SFS_DATA->log_structured;
+    opts.compress = SFS_DATA->compress;
+    opts.dedup = SFS_DATA->dedup;
+    opts.discard = SFS_DATA->discard;
+    opts.lazytime = SFS_DATA->lazytime;
+    int ret = libsfs_mount(SFS_DATA->diskfile, &opts, &SFS_DATA->fs);
+    if (ret < 0) {
+        log_error(LOG_CAT_MOUNT, "sfs_init: cannot mount %s: %s\n",
+                  SFS_DATA->diskfile, strerror(-ret));
+        fprintf(stderr, "cannot mount %s: %s\n", SFS_DATA->diskfile, strerror(-ret));
+        fuse_exit(fuse_get_context()->fuse);
+    }
     return SFS_DATA;
 }
 
@@ -324,8 +124,10 @@ void *sfs_init(struct fuse_conn_info *conn) {
  * Introduced in version 2.3
  */
 void sfs_destroy(void *userdata) {
-    disk_close();
-    log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
+    libsfs_unmount(((struct sfs_state *) userdata)->fs);
+    log_info(LOG_CAT_MOUNT, "\nsfs_destroy(userdata=0x%08x)\n", userdata);
+    trace_close();
+    log_close();
 }
 
 /** Get file attributes.
@@ -335,25 +137,21 @@ void sfs_destroy(void *userdata) {
  * mount option is given.
  */
 int sfs_getattr(const char *path, struct stat *statbuf) {
-    int retstat = 0;
-    char fpath[PATH_MAX];
-
-    log_msg("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
+    trace_scope(STAT_GETATTR, path, 0, 0, 0);
+    log_debug(LOG_CAT_FILE, "\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
             path, statbuf);
 
-    inode *target_file = resolute_path(path, current_dir);
-    statbuf->st_ino = target_file->inum;
-    statbuf->st_mode = target_file->mode;
-    statbuf->st_uid = target_file->uid;
-    statbuf->st_gid = target_file->gid;
-//    statbuf->st_rdev = 0;
-    statbuf->st_atime = target_file->atime;
-    statbuf->st_ctime = target_file->ctime;
-    statbuf->st_mtime = target_file->mtime;
-    statbuf->st_blocks = target_file->blocks_number;
-    statbuf->st_nlink = target_file->links_count;
-    statbuf->st_size = target_file->size;
-    return retstat;
+    if (strcmp(path, STATS_FILE_PATH) == 0) {
+        size_t len;
+        free(stats_snapshot(&len));
+        memset(statbuf, 0, sizeof(struct stat));
+        statbuf->st_mode = S_IFREG | 0444;
+        statbuf->st_nlink = 1;
+        statbuf->st_size = len;
+        statbuf->st_mtime = time(NULL);
+        return 0;
+    }
+    return libsfs_stat(SFS_DATA->fs, path, statbuf);
 }
 
 /**
@@ -369,45 +167,28 @@ int sfs_getattr(const char *path, struct stat *statbuf) {
  * Introduced in version 2.5
  */
 int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    int retstat = 0;
-    log_msg("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
+    trace_scope(STAT_CREATE, path, 0, 0, mode);
+    log_debug(LOG_CAT_FILE, "\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
             path, mode, fi);
 
-    inode ino;
-    ino.inum = assign_inode_number();
-    if (ino.inum == 0) {
-        printf("You have reached the maximum number of files!\n");
-        return -1;
-    }
-    ino.mode = mode;
-    ino.uid = getuid();
-    ino.gid = getgid();
-    ino.size = 0;
-    ino.type = REGULAR_FILE;
-    ino.atime = time(NULL);
-    ino.ctime = ino.atime;
-    ino.mtime = ino.ctime;
-    ino.blocks_number = 0;
-    ino.links_count = 0;
-    ino.flags = 0;
-    ino.parent_Ptr = 1;
-
-    char buffer[BLOCK_SIZE];
-    int block_offset = ino.inum / 4;
-    int byte_offset = ino.inum % 4 * INODE_SIZE;
-    block_read(sb->inode_begin + block_offset, buffer);
-    memcpy(&buffer[byte_offset], &ino, INODE_SIZE);
-    block_write(sb->inode_begin + block_offset, buffer);
+    libsfs_file *file;
+    int retstat = libsfs_create(SFS_DATA->fs, path, mode, &file);
+    if (retstat < 0) {
+        return retstat;
+    }
+    retstat = sfs_new_handle(fi, file);
+    if (retstat < 0) {
+        libsfs_close(file);
+    }
     return retstat;
 }
 
 /** Remove a file */
 int sfs_unlink(const char *path) {
-    int retstat = 0;
-    log_msg("sfs_unlink(path=\"%s\")\n", path);
-
+    trace_scope(STAT_UNLINK, path, 0, 0, 0);
+    log_debug(LOG_CAT_FILE, "sfs_unlink(path=\"%s\")\n", path);
 
-    return retstat;
+    return libsfs_unlink(SFS_DATA->fs, path);
 }
 
 /** File open operation
@@ -421,35 +202,35 @@ int sfs_unlink(const char *path) {
  * Changed in version 2.2
  */
 int sfs_open(const char *path, struct fuse_file_info *fi) {
-    int retstat = 0;
-    log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n",
+    trace_scope(STAT_OPEN, path, 0, 0, fi->flags);
+    log_debug(LOG_CAT_FILE, "\nsfs_open(path\"%s\", fi=0x%08x)\n",
             path, fi);
 
-    inode *ino = resolute_path(path, current_dir);
-    if (ino == NULL) {
-        return -1;
-    }
-    int i = fh_cursor;
-    for (; i < MAX_OPENED_FILES; i++) {
-        if (opened_files[i].inum == 0) {
-            opened_files[i].inum = ino->inum;
-            opened_files[i].pid = getpid();
-            fi->fh = (uint64_t) i;
-            fh_cursor = (i + 1) % MAX_OPENED_FILES;
-            return 0;
+    if (strcmp(path, STATS_FILE_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
         }
-    }
-    for (i = 0; i < fh_cursor; i++) {
-        if (opened_files[i].inum != 0) {
-            opened_files[i].inum = ino->inum;
-            opened_files[i].pid = getpid();
-            fi->fh = (uint64_t) i;
-            fh_cursor = (i + 1) % MAX_OPENED_FILES;
-            return 0;
+        int retstat = sfs_new_handle(fi, NULL);
+        if (retstat < 0) {
+            return retstat;
         }
+        // Render once at open so every read of this handle sees one
+        // consistent snapshot; the size is not known in advance
+        sfs_handle *h = SFS_HANDLE(fi);
+        h->snapshot = stats_snapshot(&h->snapshot_len);
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    libsfs_file *file;
+    int retstat = libsfs_open(SFS_DATA->fs, path, fi->flags, &file);
+    if (retstat < 0) {
+        return retstat;
+    }
+    retstat = sfs_new_handle(fi, file);
+    if (retstat < 0) {
+        libsfs_close(file);
     }
-    retstat = -1;
-    printf("This process can not open more files!\n");
     return retstat;
 }
 
@@ -468,14 +249,18 @@ int sfs_open(const char *path, struct fuse_file_info *fi) {
  * Changed in version 2.2
  */
 int sfs_release(const char *path, struct fuse_file_info *fi) {
-    int retstat = 0;
-    log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",
+    trace_scope(STAT_RELEASE, path, 0, 0, 0);
+    log_debug(LOG_CAT_FILE, "\nsfs_release(path=\"%s\", fi=0x%08x)\n",
             path, fi);
 
-    unsigned long i = fi->fh;
-    opened_files[i].inum = 0;
+    sfs_handle *h = SFS_HANDLE(fi);
+    if (h->file != NULL) {
+        libsfs_close(h->file);
+    }
+    free(h->snapshot);
+    free(h);
 
-    return retstat;
+    return 0;
 }
 
 /** Read data from an open file
@@ -490,28 +275,22 @@ int sfs_release(const char *path, struct fuse_file_info *fi) {
  * Changed in version 2.2
  */
 int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    int retstat = 0;
-    log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+    trace_scope(STAT_READ, path, offset, size, 0);
+    log_debug(LOG_CAT_FILE, "\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
             path, buf, size, offset, fi);
-    inode *ino = resolute_path(path, current_dir);
-    if (ino == NULL) {
-        return -1;
-    }
-    char buffer[BLOCK_SIZE];
-    memset(buf, 0, size);
-    size_t cursor = 0;
-    unsigned int ptr_offset = (unsigned int) (offset / BLOCK_SIZE);
-    unsigned int byte_offset = (unsigned int) (offset % BLOCK_SIZE);
-    for (; ptr_offset < (offset + size) / BLOCK_SIZE && ptr_offset < ino->blocks_number; ptr_offset++) {
-        block_read(sb->data_begin + ino->block_pointers[ptr_offset], buffer);
-        size_t next_read = (size - cursor < BLOCK_SIZE - byte_offset) ?
-                           (size - cursor) : (BLOCK_SIZE - byte_offset);
-        memcpy(&buf[cursor], &buffer[byte_offset], next_read);
-        cursor += next_read;
-        byte_offset = 0;
-    }
-    retstat = cursor;
-    return retstat;
+
+    sfs_handle *h = SFS_HANDLE(fi);
+    if (h->file == NULL) {
+        if (offset >= (off_t) h->snapshot_len) {
+            return 0;
+        }
+        if (offset + size > h->snapshot_len) {
+            size = h->snapshot_len - offset;
+        }
+        memcpy(buf, h->snapshot + offset, size);
+        return size;
+    }
+    return libsfs_read(h->file, buf, size, offset);
 }
 
 /** Write data to an open file
@@ -524,59 +303,231 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
  */
 int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-    int retstat = 0;
-    log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+    trace_scope(STAT_WRITE, path, offset, size, 0);
+    log_debug(LOG_CAT_FILE, "\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
             path, buf, size, offset, fi);
 
-    inode *ino = resolute_path(path, current_dir);
-    if (ino == NULL) {
-        return -1;
-    }
-    char buffer[BLOCK_SIZE];
-    size_t cursor = 0;
-    unsigned int ptr_offset = (unsigned int) (offset / BLOCK_SIZE);
-    unsigned int byte_offset = (unsigned int) (offset % BLOCK_SIZE);
-    for (; ptr_offset < (offset + size) / BLOCK_SIZE; ptr_offset++) {
-        if (ptr_offset == ino->blocks_number) { // Need to enlarge this file
-            if (ino->blocks_number == MAX_BLOCKS_OF_FILE) break;
-            else {
-                unsigned int new_block = assign_block();
-                if (new_block != 0) ino->block_pointers[ino->blocks_number++] = new_block;
-                else break;
-            }
-        }
-        block_read(sb->data_begin + ino->block_pointers[ptr_offset], buffer);
-        size_t next_read = (size - cursor < BLOCK_SIZE - byte_offset) ?
-                           (size - cursor) : (BLOCK_SIZE - byte_offset);
-        memcpy(&buffer[byte_offset], &buf[cursor], next_read);
-        cursor += next_read;
-        byte_offset = 0;
+    sfs_handle *h = SFS_HANDLE(fi);
+    if (h->file == NULL) {
+        return -EBADF;
+    }
+    return libsfs_write(h->file, buf, size, offset);
+}
+
+/** Change the size of a file */
+int sfs_truncate(const char *path, off_t newsize) {
+    trace_scope(STAT_TRUNCATE, path, newsize, 0, 0);
+    log_debug(LOG_CAT_FILE, "\nsfs_truncate(path=\"%s\", newsize=%lld)\n",
+            path, newsize);
+
+    if (strcmp(path, STATS_FILE_PATH) == 0) {
+        return -EACCES;
+    }
+    return libsfs_truncate(SFS_DATA->fs, path, newsize);
+}
+
+/** Change the size of an open file */
+int sfs_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi) {
+    trace_scope(STAT_FTRUNCATE, path, newsize, 0, 0);
+    log_debug(LOG_CAT_FILE, "\nsfs_ftruncate(path=\"%s\", newsize=%lld, fi=0x%08x)\n",
+            path, newsize, fi);
+
+    sfs_handle *h = SFS_HANDLE(fi);
+    if (h == NULL) {
+        return libsfs_truncate(SFS_DATA->fs, path, newsize);
+    }
+    if (h->file == NULL) {
+        return -EACCES;
+    }
+    return libsfs_ftruncate(h->file, newsize);
+}
+
+/** Synchronize file contents
+ *
+ * The datasync flag is ignored: the metadata that makes the data
+ * reachable has to be committed either way.
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    trace_scope(STAT_FSYNC, path, datasync, 0, 0);
+    log_debug(LOG_CAT_FILE, "\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
+            path, datasync, fi);
+
+    sfs_handle *h = SFS_HANDLE(fi);
+    if (h->file == NULL) {
+        return 0;
     }
-    retstat = cursor;
+    return libsfs_fsync(h->file);
+}
 
+/**
+ * Ioctl
+ *
+ * flags will have FUSE_IOCTL_COMPAT set for 32bit ioctls in
+ * 64bit environment.  The size and direction of data is
+ * determined by _IOC_*() decoding of cmd.  For _IOC_NONE,
+ * data will be NULL, for _IOC_WRITE data is out area, for
+ * _IOC_READ in area and if both are set in/out area.  In all
+ * non-NULL cases, the area is of _IOC_SIZE(cmd) bytes.
+ *
+ * Only the sfs ioctls of sfs_ioctl.h are known: server-side clones and
+ * range copies, with the source opened here by its path, and the lseek
+ * and fallocate modes FUSE 2.x has no operations for; and FITRIM, on any
+ * file or directory.
+ *
+ * Introduced in version 2.8
+ */
+/** Run a clone or range copy ioctl from the file named in data */
+static int sfs_ioctl_copy(libsfs_file *dest, unsigned int cmd, void *data) {
+    // Both argument structures start with the source path
+    char *src_path = data;
+    src_path[SFS_IOC_PATH_MAX - 1] = '\0';
+    if (strcmp(src_path, STATS_FILE_PATH) == 0) {
+        return -EINVAL;
+    }
+    libsfs_file *src;
+    int retstat = libsfs_open(SFS_DATA->fs, src_path, O_RDONLY, &src);
+    if (retstat < 0) {
+        return retstat;
+    }
+    if (cmd == SFS_IOC_CLONE) {
+        retstat = libsfs_clone(src, dest);
+    } else {
+        struct sfs_copy_range_args *range = data;
+        ssize_t copied = libsfs_copy_file_range(src, (off_t) range->src_offset, dest,
+                                                (off_t) range->dest_offset, (size_t) range->length);
+        range->copied = copied < 0 ? 0 : (uint64_t) copied;
+        retstat = copied < 0 ? (int) copied : 0;
+    }
+    libsfs_close(src);
     return retstat;
 }
 
+int sfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+              unsigned int flags, void *data) {
+    trace_scope(STAT_IOCTL, path, 0, 0, (unsigned int) cmd);
+    log_debug(LOG_CAT_FILE, "\nsfs_ioctl(path=\"%s\", cmd=%#x, arg=0x%08x, fi=0x%08x, flags=%#x, data=0x%08x)\n",
+            path, cmd, arg, fi, flags, data);
+
+    sfs_handle *h = SFS_HANDLE(fi);
+    if (flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+    // fstrim issues FITRIM on the mount point, which has no sfs_handle
+    if ((unsigned int) cmd == FITRIM) {
+        struct fstrim_range *range = data;
+        uint64_t trimmed;
+        int retstat = libsfs_trim(SFS_DATA->fs, range->start, range->len, range->minlen, &trimmed);
+        if (retstat == 0) {
+            range->len = trimmed;
+        }
+        return retstat;
+    }
+    if (flags & FUSE_IOCTL_DIR) {
+        return -ENOTTY;
+    }
+    switch ((unsigned int) cmd) {
+        case SFS_IOC_CLONE:
+        case SFS_IOC_COPY_RANGE:
+        case SFS_IOC_SEEK:
+        case SFS_IOC_FALLOCATE:
+            break;
+        default:
+            return -ENOTTY;
+    }
+    if (h->file == NULL) {
+        return -EBADF;
+    }
+
+    if ((unsigned int) cmd == SFS_IOC_SEEK) {
+        struct sfs_seek_args *seek = data;
+        off_t found = libsfs_lseek(h->file, (off_t) seek->offset, seek->whence);
+        if (found < 0) {
+            return (int) found;
+        }
+        seek->offset = found;
+        return 0;
+    }
+    if ((unsigned int) cmd == SFS_IOC_FALLOCATE) {
+        struct sfs_fallocate_args *falloc = data;
+        return libsfs_fallocate(h->file, falloc->mode, (off_t) falloc->offset, (off_t) falloc->length);
+    }
+    return sfs_ioctl_copy(h->file, (unsigned int) cmd, data);
+}
+
+/** Change the access and modification times of a file */
+int sfs_utimens(const char *path, const struct timespec tv[2]) {
+    trace_scope(STAT_UTIMENS, path, 0, 0, 0);
+    log_debug(LOG_CAT_FILE, "\nsfs_utimens(path=\"%s\", tv=0x%08x)\n",
+            path, tv);
+
+    return libsfs_utimens(SFS_DATA->fs, path, tv);
+}
+
 
 /** Create a directory */
 int sfs_mkdir(const char *path, mode_t mode) {
-    int retstat = 0;
-    log_msg("\nsfs_mkdir(path=\"%s\", mode=0%3o)\n",
+    trace_scope(STAT_MKDIR, path, 0, 0, mode);
+    log_debug(LOG_CAT_DIR, "\nsfs_mkdir(path=\"%s\", mode=0%3o)\n",
             path, mode);
 
-
-    return retstat;
+    return libsfs_mkdir(SFS_DATA->fs, path, mode);
 }
 
 
 /** Remove a directory */
 int sfs_rmdir(const char *path) {
-    int retstat = 0;
-    log_msg("sfs_rmdir(path=\"%s\")\n",
+    trace_scope(STAT_RMDIR, path, 0, 0, 0);
+    log_debug(LOG_CAT_DIR, "sfs_rmdir(path=\"%s\")\n",
             path);
 
+    return libsfs_rmdir(SFS_DATA->fs, path);
+}
 
-    return retstat;
+
+/** Rename a file */
+int sfs_rename(const char *path, const char *newpath) {
+    trace_scope2(STAT_RENAME, path, newpath);
+    log_debug(LOG_CAT_DIR, "sfs_rename(path=\"%s\", newpath=\"%s\")\n",
+            path, newpath);
+
+    return libsfs_rename(SFS_DATA->fs, path, newpath);
+}
+
+
+/** Create a hard link to a file */
+int sfs_link(const char *path, const char *newpath) {
+    trace_scope2(STAT_LINK, path, newpath);
+    log_debug(LOG_CAT_DIR, "sfs_link(path=\"%s\", newpath=\"%s\")\n",
+            path, newpath);
+
+    return libsfs_link(SFS_DATA->fs, path, newpath);
+}
+
+
+/** Create a symbolic link */
+int sfs_symlink(const char *path, const char *link) {
+    trace_scope2(STAT_SYMLINK, link, path);
+    log_debug(LOG_CAT_DIR, "sfs_symlink(path=\"%s\", link=\"%s\")\n",
+            path, link);
+
+    return libsfs_symlink(SFS_DATA->fs, path, link);
+}
+
+
+/** Read the target of a symbolic link
+ *
+ * The buffer should be filled with a null terminated string.  The
+ * buffer size argument includes the space for the terminating
+ * null character.  If the linkname is too long to fit in the
+ * buffer, it should be truncated.  The return value should be 0
+ * for success.
+ */
+int sfs_readlink(const char *path, char *link, size_t size) {
+    trace_scope(STAT_READLINK, path, 0, 0, 0);
+    log_debug(LOG_CAT_FILE, "sfs_readlink(path=\"%s\", size=%zu)\n",
+            path, size);
+
+    return libsfs_readlink(SFS_DATA->fs, path, link, size);
 }
 
 
@@ -588,11 +539,15 @@ int sfs_rmdir(const char *path) {
  * Introduced in version 2.3
  */
 int sfs_opendir(const char *path, struct fuse_file_info *fi) {
-    int retstat = 0;
-    log_msg("\nsfs_opendir(path=\"%s\", fi=0x%08x)\n",
+    trace_scope(STAT_OPENDIR, path, 0, 0, 0);
+    log_debug(LOG_CAT_DIR, "\nsfs_opendir(path=\"%s\", fi=0x%08x)\n",
             path, fi);
 
-
+    struct stat st;
+    int retstat = libsfs_stat(SFS_DATA->fs, path, &st);
+    if (retstat == 0 && !S_ISDIR(st.st_mode)) {
+        retstat = -ENOTDIR;
+    }
     return retstat;
 }
 
@@ -619,10 +574,13 @@ int sfs_opendir(const char *path, struct fuse_file_info *fi) {
  */
 int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
                 struct fuse_file_info *fi) {
-    int retstat = 0;
-
+    trace_scope(STAT_READDIR, path, offset, 0, 0);
+    log_debug(LOG_CAT_DIR, "\nsfs_readdir(path=\"%s\", buf=0x%08x, offset=%lld, fi=0x%08x)\n",
+            path, buf, offset, fi);
 
-    return retstat;
+    // Mode 1 of the two described above: the whole directory in one call
+    void *args[2] = {buf, (void *) filler};
+    return libsfs_readdir(SFS_DATA->fs, path, sfs_filldir, args);
 }
 
 /** Release directory
@@ -630,7 +588,9 @@ int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
  * Introduced in version 2.3
  */
 int sfs_releasedir(const char *path, struct fuse_file_info *fi) {
+    trace_scope(STAT_RELEASEDIR, path, 0, 0, 0);
     int retstat = 0;
+    (void) fi;
 
 
     return retstat;
@@ -647,17 +607,70 @@ struct fuse_operations sfs_oper = {
         .release = sfs_release,
         .read = sfs_read,
         .write = sfs_write,
+        .truncate = sfs_truncate,
+        .ftruncate = sfs_ftruncate,
+        .utimens = sfs_utimens,
+        .fsync = sfs_fsync,
+        .ioctl = sfs_ioctl,
 
         .rmdir = sfs_rmdir,
         .mkdir = sfs_mkdir,
+        .rename = sfs_rename,
+        .link = sfs_link,
+        .symlink = sfs_symlink,
+        .readlink = sfs_readlink,
 
         .opendir = sfs_opendir,
         .readdir = sfs_readdir,
         .releasedir = sfs_releasedir
 };
 
+/**
+ * sfs-specific mount options, consumed before the rest go to fuse:
+ *   -o log_level=N   1=error 2=warn 3=info 4=debug 5=trace (default 2)
+ *   -o log_mask=M    bitmask of LOG_CAT_* categories (default 0xff)
+ *   -o trace=FILE    record every operation to FILE for sfs-replay
+ *   -o format        lay out an empty filesystem on diskFile before mounting
+ *   -o commit=MS     commit metadata to the journal every MS milliseconds (default 50)
+ *   -o log           log-structured mode: append file data instead of overwriting it
+ *   -o compress      compress the data of newly created files (needs LZ4)
+ *   -o dedup         share identical data blocks instead of writing them again
+ *   -o discard       punch freed blocks out of diskFile (FITRIM works without it)
+ *   -o lazytime      keep the timestamps of overwrites in memory for a while
+ */
+struct sfs_mount_options {
+    int log_level;
+    int log_mask;
+    char *trace_file;
+    int format;
+    int commit;
+    int log;
+    int compress;
+    int dedup;
+    int discard;
+    int lazytime;
+};
+
+#define SFS_OPT(t, p) { t, offsetof(struct sfs_mount_options, p), 0 }
+
+static const struct fuse_opt sfs_mount_opts[] = {
+        SFS_OPT("log_level=%i", log_level),
+        SFS_OPT("log_mask=%i", log_mask),
+        SFS_OPT("trace=%s", trace_file),
+        {"format", offsetof(struct sfs_mount_options, format), 1},
+        SFS_OPT("commit=%i", commit),
+        {"log", offsetof(struct sfs_mount_options, log), 1},
+        {"compress", offsetof(struct sfs_mount_options, compress), 1},
+        {"dedup", offsetof(struct sfs_mount_options, dedup), 1},
+        {"discard", offsetof(struct sfs_mount_options, discard), 1},
+        {"lazytime", offsetof(struct sfs_mount_options, lazytime), 1},
+        FUSE_OPT_END
+};
+
 void sfs_usage() {
     fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+    fprintf(stderr, "sfs options:  -o log_level=N -o log_mask=M -o trace=FILE -o format -o commit=MS -o log"
+            " -o compress -o dedup -o discard -o lazytime\n");
     abort();
 }
 
@@ -675,17 +688,67 @@ int main(int argc, char *argv[]) {
         abort();
     }
 
-    // Pull the diskfile and save it in internal data
-    sfs_data->diskfile = argv[argc - 2];
+    // Pull the diskfile and save it in internal data. fuse_main changes
+    // to / when it daemonizes, so keep an absolute path.
+    sfs_data->diskfile = realpath(argv[argc - 2], NULL);
+    if (sfs_data->diskfile == NULL) {
+        int fd = open(argv[argc - 2], O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+        if (fd >= 0) {
+            close(fd);
+        }
+        sfs_data->diskfile = realpath(argv[argc - 2], NULL);
+    }
+    if (sfs_data->diskfile == NULL) {
+        perror(argv[argc - 2]);
+        abort();
+    }
     argv[argc - 2] = argv[argc - 1];
     argv[argc - 1] = NULL;
     argc--;
 
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct sfs_mount_options options = {log_level, (int) log_mask, NULL, 0, 0, 0, 0, 0, 0, 0};
+    if (fuse_opt_parse(&args, &options, sfs_mount_opts, NULL) == -1 || options.commit < 0)
+        sfs_usage();
+    log_level = options.log_level;
+    log_mask = (unsigned int) options.log_mask;
+
+    // Formatting is explicit; otherwise check the image now, while errors
+    // can still reach the terminal, rather than in sfs_init
+    int ret;
+    if (options.format) {
+        ret = libsfs_format(sfs_data->diskfile, NULL);
+    } else {
+        sfs_fs *probe;
+        ret = libsfs_mount(sfs_data->diskfile, NULL, &probe);
+        if (ret == 0) {
+            libsfs_unmount(probe);
+        }
+    }
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s%s\n", sfs_data->diskfile, strerror(-ret),
+                ret == -EINVAL ? " (not an sfs image, use -o format)" : "");
+        return 1;
+    }
+
+    // Open the trace before fuse_main daemonizes and changes directory
+    if (options.trace_file != NULL && trace_open(options.trace_file) < 0) {
+        perror("trace_open");
+        abort();
+    }
+
     sfs_data->logfile = log_open();
+    sfs_data->commit_interval_ms = (unsigned int) options.commit;
+    sfs_data->log_structured = options.log;
+    sfs_data->compress = options.compress;
+    sfs_data->dedup = options.dedup;
+    sfs_data->discard = options.discard;
+    sfs_data->lazytime = options.lazytime;
 
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-    fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
+    fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
+    fuse_opt_free_args(&args);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
 
     return fuse_stat;
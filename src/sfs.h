@@ -5,44 +5,184 @@
 #ifndef ASSIGNMENT3_SFS_H
 #define ASSIGNMENT3_SFS_H
 
-#endif //ASSIGNMENT3_SFS_H
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "block.h"  // BLOCK_SIZE = 512 = 2^9
 
-// block_size = 512 = 2^9
-#define BLOCK_SIZE 512
+// Size of an image formatted without an explicit size
 #define DISK_SIZE (16*1024*1024)
-//At most 4096 inodes, which needs 4096 / 4 = 1024 = 2^10 inode blocks
-//and needs bitmap of 4096 bits = 2^12 bits = 2^9 bytes = 512 bytes = 1 block
-#define MAX_FILE_NUMBER 4096
-//total_blocks = 16 * 1024 * 2 = 2^15, need bitmap of 2^15 bits = 2^12 bytes = 8 blocks
-//So in 2^15 blocks, 1+1+8=10 was used for superblock and bitmap
-#define TOTAL_BLOCKS (DISK_SIZE / BLOCK_SIZE)
-#define INODE_SIZE 128  //2^7
-#define MAX_BLOCKS_OF_FILE 12 //A file can have at most 12 blocks
+#define INODE_SIZE 512  //2^9, one inode per block
+#define DIRECT_BLOCKS 12 //Blocks mapped straight from the inode
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
+// Blocks reachable through the direct, single, double and triple indirect pointers
+#define MAX_FILE_BLOCKS (DIRECT_BLOCKS + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK \
+                         + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
 #define FILE_ENTRY_SIZE 128
-#define MAX_OPENED_FILES 100
+#define ENTRIES_PER_BLOCK (BLOCK_SIZE / FILE_ENTRY_SIZE)
+#define MAX_FILE_NAME (FILE_ENTRY_SIZE - sizeof(unsigned int) - 1)
+#define ROOT_INUM 1
+// Block 0 of every image starts with this, "SFS1" read little-endian
+#define SFS_MAGIC 0x31534653
+#define SFS_VERSION 14
+// Format default: 16 MB groups (8 bitmap blocks each)
+#define DEFAULT_BLOCKS_PER_GROUP (8 * BLOCK_SIZE * 8)
+// Inodes are allocated in chunks of contiguous blocks, 64 inodes (32 KB) at a time
+#define INODE_CHUNK_INODES 64
+#define INODE_CHUNK_BLOCKS INODE_CHUNK_INODES
+// Entries of the chunk and fragment indexes
+#define INDEX_ENTRY_SIZE 16
+#define INDEX_ENTRIES_PER_BLOCK (BLOCK_SIZE / INDEX_ENTRY_SIZE)
+// Short file tails are packed into shared blocks of FRAGS_PER_BLOCK fragment slots
+#define FRAG_SIZE 32
+#define FRAGS_PER_BLOCK (BLOCK_SIZE / FRAG_SIZE)
+#define TAIL_PACK_MAX (BLOCK_SIZE / 2)
+// Metadata journal: by default a sixteenth of group 0, at most DEFAULT_JOURNAL_BLOCKS; see journal.h
+#define DEFAULT_JOURNAL_BLOCKS 4096
+#define MIN_JOURNAL_BLOCKS 16
+#define JOURNAL_MAGIC 0x4c4e524a  // "JRNL" read little-endian
+#define JOURNAL_TAGS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
+#define JOURNAL_RUNS_PER_BLOCK (BLOCK_SIZE / sizeof(journal_run))
+#define SEGMENT_SUMMARY_MAGIC 0x4d4d5553  // "SUMM" read little-endian
+#define SEGMENT_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(segment_entry))
+// Compressed files are stored in clusters of this many blocks, see compress.h. A block pointer
+// with BMAP_COMPRESSED set maps a block of a compressed cluster: bits 48-62 hold the compressed
+// length in bytes and the low bits the first block of the run holding it. Block numbers are
+// limited to BMAP_BLOCK_MASK.
+#define COMPRESS_CLUSTER_BLOCKS 8
+#define BMAP_COMPRESSED (1ULL << 63)
+#define BMAP_LENGTH_SHIFT 48
+#define BMAP_BLOCK_MASK ((1ULL << BMAP_LENGTH_SHIFT) - 1)
+#define BMAP_LENGTH(pointer) ((unsigned int) (((pointer) & ~BMAP_COMPRESSED) >> BMAP_LENGTH_SHIFT))
+#define BMAP_RUN_BLOCKS(pointer) ((BMAP_LENGTH(pointer) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+// A plain block pointer with BMAP_UNWRITTEN set maps a block reserved by fallocate that was
+// never written: it reads as zeros, and the first write to it clears the bit
+#define BMAP_UNWRITTEN (1ULL << 62)
+#define BMAP_IS_UNWRITTEN(pointer) (((pointer) & (BMAP_COMPRESSED | BMAP_UNWRITTEN)) == BMAP_UNWRITTEN)
+#define GROUP_DESC_SIZE 64
+#define GROUP_DESCS_PER_BLOCK (BLOCK_SIZE / GROUP_DESC_SIZE)
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
 /***************************************************************************************************
  ***************************************************************************************************
  * Distribution of Blocks
- * superblock | inode bitmap | data block bitmap | inode block | data block
- * 0            1              2 - 9               10 - 1033     1034 - 32768
- * 1 block      1 block        8 blocks            1024 blocks   31735 blocks
+ * The disk is cut into groups of blocks_per_group blocks. Block 0 holds the superblock and is
+ * followed by the group descriptor table; then every group starts with its own metadata:
+ *
+ * superblock | group descriptors | group 0             | group 1             | ...
+ *                                  block bitmap | data | block bitmap | data |
+ *
+ * Block numbers are absolute and 64-bit everywhere, so block 0 (the superblock) doubles as
+ * "no block"; groups and inode numbers stay 32-bit.
+ * There is no fixed inode table. Inodes live in chunks of INODE_CHUNK_BLOCKS contiguous blocks
+ * taken from the data space as needed; inode i is slot i % INODE_CHUNK_INODES of chunk
+ * i / INODE_CHUNK_INODES. The chunk index, an array of inode_chunk entries, is stored like the
+ * contents of a file whose block map sits in the superblock. Each inode fills one block. Inode 0
+ * is reserved and ROOT_INUM is the root. Chunks are never zeroed: a slot is only read once its
+ * used bit is set.
+ * A regular file whose last block would hold at most TAIL_PACK_MAX bytes may keep that tail in
+ * a few FRAG_SIZE slots of a block shared with other files' tails. The fragment index, an array
+ * of frag_block entries saying which slots of each shared block are taken, is stored like the
+ * chunk index.
+ * A data block may be pointed to by more than one file (see dedup.h). The block reference index,
+ * an array of block_ref entries stored like the chunk index, counts the pointers to every shared
+ * block and holds the fingerprint of every block that was hashed for deduplication; any other
+ * allocated data block has exactly one pointer to it.
+ * Group 0 also holds the journal, journal_blocks contiguous blocks at journal_start, in two
+ * halves that transactions take turns in by sequence number. Each half is a journal_header
+ * block, then run blocks listing the blocks the transaction freed, tag blocks listing the home
+ * block of each image, and the images of the metadata blocks it wrote. The half with the newer
+ * committed transaction is the one replayed on mount.
+ * A segment the log-structured mode (see lfs.h) has written to ends in a segment summary,
+ * blocks of segment_entry written as metadata that name the file block each block of the
+ * segment was written for.
+ * Inodes that no name refers to any more, but that still own blocks or are still open, are kept
+ * on the orphan list, which starts at orphan_head in the superblock and is chained through
+ * next_orphan; their blocks are freed in the background (see reclaim.h), after a crash too.
  ***************************************************************************************************
  ***************************************************************************************************/
 
 
-typedef struct superblock {
-    unsigned int total_blocks;
-    unsigned int inode_bitmap_begin; // inode bitmap only takes one block
-    unsigned int inode_bitmap_blocks;
-    unsigned int data_bitmap_begin;
-    unsigned int data_bitmap_blocks;
-    unsigned int inode_begin;
-    unsigned int inode_blocks;
-    unsigned int data_begin;
-    unsigned int data_blocks;
-    unsigned int free_data_blocks;
-    unsigned int root_inode_ptr;
-} superblock;
+/**
+ * Total size == 64 bytes
+ */
+typedef struct group_desc {
+    uint64_t block_bitmap;      // first block of the block bitmap
+    unsigned int free_blocks;
+    unsigned int reserved[13];
+} group_desc;
+
+/**
+ * Total size == 16 bytes
+ */
+typedef struct inode_chunk {
+    uint64_t start;     // first block of the chunk, 0 if the chunk was given back
+    uint64_t used;      // bit i set: inode slot i is allocated
+} inode_chunk;
+
+/**
+ * Total size == 16 bytes
+ */
+typedef struct frag_block {
+    uint64_t block;         // the shared block, 0 if it was given back
+    unsigned int used;      // bit i set: fragment slot i holds (part of) a tail
+    unsigned int reserved;
+} frag_block;
+
+/**
+ * Total size == 16 bytes
+ */
+typedef struct block_ref {
+    uint64_t block;         // the data block, 0 if the entry was given back
+    unsigned int refs;      // block pointers to it
+    unsigned int hash;      // CRC32C of its contents, 0 if it is not in the fingerprint index
+} block_ref;
+
+/**
+ * First block of either half of the journal. magic is JOURNAL_MAGIC once a transaction has been
+ * committed there, until the journal is cleared on unmount; checksum covers its run, tag and
+ * image blocks. Once replayed, a transaction is rewritten with no images, so that only its runs
+ * are left to give back.
+ */
+typedef struct journal_header {
+    unsigned int magic;
+    unsigned int count;     // images in the transaction
+    uint64_t sequence;
+    uint64_t checksum;      // FNV-1a
+    unsigned int runs;      // journal_run entries
+    unsigned int reserved;
+} journal_header;
+
+/**
+ * Blocks a transaction freed, which may only be reused once it is checkpointed.
+ * Total size == 16 bytes
+ */
+typedef struct journal_run {
+    uint64_t block;
+    unsigned int count;     // all in the group of block
+    unsigned int reserved;
+} journal_run;
+
+/**
+ * One entry of a segment summary: the file block written to a block of the segment, inum 0 for
+ * none. The first two entries are the header, SEGMENT_SUMMARY_MAGIC and the segment number, then
+ * the low and high halves of log_id; entry i + 2 is for block i of the segment.
+ * Total size == 8 bytes
+ */
+typedef struct segment_entry {
+    unsigned int inum;
+    unsigned int index;
+} segment_entry;
+
+/**
+ * Where an index of INDEX_ENTRY_SIZE entries is stored: its size, block count and block map
+ * (direct, indirect, double and triple indirect pointers), as for the contents of a file.
+ * Total size == 136 bytes
+ */
+typedef struct index_map {
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t map[DIRECT_BLOCKS + 3];
+} index_map;
 
 /**
  * Size table:
@@ -57,12 +197,20 @@ typedef struct superblock {
 
 
 typedef enum Type{
-    DIRECTORY = 0, REGULAR_FILE = 1
+    DIRECTORY = 0, REGULAR_FILE = 1, SYMLINK = 2
 }Type;
 
+// Inode flags
+#define INODE_INLINE_DATA 0x1   // the file's bytes live in inline_data, it owns no blocks
+#define INODE_TAIL_PACKED 0x2   // the partial last block lives in fragment slots at tail_frag
+#define INODE_COMPRESSED 0x4    // data is written in compressed clusters, see compress.h
+
 /**
- * Total size == 128 bytes
+ * Total size == INODE_SIZE == 512 bytes. A regular file no larger than INODE_INLINE_SIZE keeps
+ * its data in the inode itself, in place of the block map, and moves to blocks once it grows.
+ * A symlink keeps its target the same way, so a target that fits needs no block to read.
  */
+#define INODE_INLINE_SIZE 424
 typedef struct inode {
     unsigned int inum;    //4
     mode_t mode;    //4 can this file be read/written/executed?
@@ -74,18 +222,56 @@ typedef struct inode {
     time_t ctime;   //8 Created atime
     time_t mtime;   //8 Last modified atime
     time_t dtime;   //8 Deleted atime
-    unsigned int blocks_number;   //4 How many blocks this file owns
+    uint64_t blocks_number;   //8 How many blocks this file owns, indirect blocks included
     unsigned short links_count;   //2 How many hard links are there to this file?
     unsigned int flags;    //4 how should ext2 use this inode?
-//    unsigned int osd1;    //4 an OS-dependent field
     unsigned int parent_Ptr;
-    //So far, the total size is 74
-    unsigned int block_pointers[MAX_BLOCKS_OF_FILE];
-    //MAX_BLOCKS_OF_FILE == 12. So far, the total size is 126
-    //But as a 64-bit machine, this struct will be automatically padded to 128 bytes
-    /** Recalculate it !!!!*/
+    unsigned int next_orphan;   //4 the next inode on the orphan list, 0 at its end
+    union {
+        struct {
+            uint64_t block_pointers[DIRECT_BLOCKS];   //96
+            uint64_t indirect;          //8 block of POINTERS_PER_BLOCK pointers
+            uint64_t double_indirect;   //8 block of pointers to indirect blocks
+            uint64_t triple_indirect;   //8 block of pointers to double indirect blocks
+            unsigned int tail_frag;     //4 with INODE_TAIL_PACKED: fragment index entry
+            unsigned int tail_slot;     //4 and the first of its slots there
+        };
+        unsigned char inline_data[INODE_INLINE_SIZE];   // with INODE_INLINE_DATA
+    };
 } inode;
 
+typedef struct superblock {
+    unsigned int magic;     // SFS_MAGIC
+    unsigned int version;   // SFS_VERSION, bumped on any on-disk format change
+    unsigned int block_size;
+    unsigned int blocks_per_group;
+    uint64_t total_blocks;
+    unsigned int group_count;
+    unsigned int gdt_blocks;
+    uint64_t gdt_begin;
+    uint64_t free_blocks;
+    unsigned int inode_chunks;      // entries in the chunk index, given-back ones included
+    unsigned int used_inodes;
+    unsigned int root_inode_ptr;
+    unsigned int frag_blocks;       // entries in the fragment index, given-back ones included
+    uint64_t journal_start;
+    unsigned int journal_blocks;
+    unsigned int ref_entries;       // entries in the block reference index, given-back ones included
+    unsigned int orphan_head;       // the first inode on the orphan list, 0 if it is empty
+    unsigned int log_segments;      // segments that have a segment summary
+    uint64_t log_id;                // random, in the header of every segment summary
+    index_map chunk_index;
+    index_map frag_index;
+    index_map ref_index;
+} superblock;
+
+_Static_assert(sizeof(inode) == INODE_SIZE && INODE_SIZE == BLOCK_SIZE, "an inode fills its block");
+_Static_assert(sizeof(superblock) <= BLOCK_SIZE, "superblock does not fit block 0");
+_Static_assert(sizeof(inode_chunk) == INDEX_ENTRY_SIZE, "inode_chunk size");
+_Static_assert(sizeof(frag_block) == INDEX_ENTRY_SIZE, "frag_block size");
+_Static_assert(sizeof(block_ref) == INDEX_ENTRY_SIZE, "block_ref size");
+_Static_assert(sizeof(group_desc) == GROUP_DESC_SIZE, "group_desc size");
+
 /**
  * Total size = 128 bytes
  */
@@ -94,10 +280,4 @@ typedef struct __filename_inum_pair{
     char file_name[124];
 } file_entry;
 
-//char byte_vector[4] = {0x10000000, 0x01000000, 0x00100000, 0x00010000};
-
-typedef struct __filehandler_process_inode_tuple{
-    unsigned long filehandler;
-    __pid_t pid;
-    unsigned int inum;
-} filehandler_entry;
+#endif //ASSIGNMENT3_SFS_H
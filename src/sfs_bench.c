@@ -0,0 +1,413 @@
+/*
+  sfs-bench: in-process benchmark of the filesystem core.
+
+  Runs each workload directly against libsfs on a scratch image, with
+  no FUSE mount and no kernel round trips, for 1, 2, 4, ... up to N
+  threads, and reports throughput and latency percentiles.
+
+  usage:  sfs-bench [-t threads] [-f files] [-s file_size] [-r rounds]
+                    [-w workload] [-d scratch_dir] [-L] [-C] [-D]
+
+  -L mounts the scratch images in log-structured mode.
+  -C compresses the files the workloads create (needs LZ4).
+  -D mounts the scratch images with dedup on.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libsfs.h"
+#include "stats.h"
+
+#define IO_SIZE 4096
+#define DEFAULT_FILE_SIZE (1024 * 1024)
+#define DEFAULT_FILES 256
+#define DEFAULT_ROUNDS 20
+#define MAX_THREADS 64
+
+typedef struct bench_config {
+    int max_threads;
+    int files;          // per thread, or in total for largedir
+    size_t file_size;
+    int rounds;
+    const char *only;
+    const char *dir;
+    libsfs_options opts;
+} bench_config;
+
+struct workload;
+
+typedef struct bench_thread {
+    pthread_t thread;
+    const struct workload *workload;
+    int id;
+    sfs_fs *fs;
+    const bench_config *cfg;
+    uint64_t *lat;      // one latency sample per timed op
+    size_t nlat;
+    size_t cap;
+    unsigned long errors;
+    uint64_t bytes;
+    uint64_t begin, end;    // wall clock of the timed phase
+    unsigned int seed;
+    char *buf;
+} bench_thread;
+
+typedef struct workload {
+    const char *name;
+    void (*setup)(bench_thread *t);     // untimed, per thread
+    void (*run)(bench_thread *t);       // timed
+} workload;
+
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t fill_barrier;     // largedir: all names exist
+
+static void bench_sample(bench_thread *t, uint64_t start, int ret) {
+    if (t->nlat == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 4096;
+        t->lat = realloc(t->lat, t->cap * sizeof(uint64_t));
+    }
+    t->lat[t->nlat++] = stats_now() - start;
+    if (ret < 0) {
+        t->errors++;
+    }
+}
+
+static void thread_dir(bench_thread *t, char *out) {
+    snprintf(out, PATH_MAX, "/t%d", t->id);
+}
+
+static void file_path(bench_thread *t, int i, char *out) {
+    snprintf(out, PATH_MAX, "/t%d/f%d", t->id, i);
+}
+
+static void setup_thread_dir(bench_thread *t) {
+    char path[PATH_MAX];
+    thread_dir(t, path);
+    libsfs_mkdir(t->fs, path, 0755);
+}
+
+static void setup_files(bench_thread *t) {
+    char path[PATH_MAX];
+    int i;
+    setup_thread_dir(t);
+    for (i = 0; i < t->cfg->files; i++) {
+        file_path(t, i, path);
+        libsfs_create(t->fs, path, 0644, NULL);
+    }
+}
+
+static void setup_data_file(bench_thread *t) {
+    char path[PATH_MAX];
+    libsfs_file *file;
+    size_t off;
+    setup_thread_dir(t);
+    file_path(t, 0, path);
+    if (libsfs_create(t->fs, path, 0644, &file) < 0) {
+        return;
+    }
+    for (off = 0; off < t->cfg->file_size; off += IO_SIZE) {
+        size_t n = t->cfg->file_size - off < IO_SIZE ? t->cfg->file_size - off : IO_SIZE;
+        libsfs_write(file, t->buf, n, off);
+    }
+    libsfs_close(file);
+}
+
+static void run_create(bench_thread *t) {
+    char path[PATH_MAX];
+    libsfs_file *file;
+    int i;
+    for (i = 0; i < t->cfg->files; i++) {
+        file_path(t, i, path);
+        uint64_t start = stats_now();
+        int ret = libsfs_create(t->fs, path, 0644, &file);
+        if (ret == 0) {
+            libsfs_close(file);
+        }
+        bench_sample(t, start, ret);
+    }
+}
+
+static void run_stat(bench_thread *t) {
+    char path[PATH_MAX];
+    struct stat st;
+    int r, i;
+    for (r = 0; r < t->cfg->rounds; r++) {
+        for (i = 0; i < t->cfg->files; i++) {
+            file_path(t, i, path);
+            uint64_t start = stats_now();
+            bench_sample(t, start, libsfs_stat(t->fs, path, &st));
+        }
+    }
+}
+
+static void run_seq(bench_thread *t, int writing) {
+    char path[PATH_MAX];
+    libsfs_file *file;
+    size_t off;
+    int r;
+    file_path(t, 0, path);
+    if (libsfs_open(t->fs, path, O_RDWR, &file) < 0) {
+        t->errors++;
+        return;
+    }
+    for (r = 0; r < t->cfg->rounds; r++) {
+        for (off = 0; off < t->cfg->file_size; off += IO_SIZE) {
+            size_t n = t->cfg->file_size - off < IO_SIZE ? t->cfg->file_size - off : IO_SIZE;
+            uint64_t start = stats_now();
+            ssize_t ret = writing ? libsfs_write(file, t->buf, n, off)
+                                  : libsfs_read(file, t->buf, n, off);
+            bench_sample(t, start, ret < 0 ? (int) ret : 0);
+            if (ret > 0) {
+                t->bytes += ret;
+            }
+        }
+    }
+    libsfs_close(file);
+}
+
+static void run_seqwrite(bench_thread *t) {
+    run_seq(t, 1);
+}
+
+static void run_seqread(bench_thread *t) {
+    run_seq(t, 0);
+}
+
+static void run_rand(bench_thread *t, int writing) {
+    char path[PATH_MAX];
+    libsfs_file *file;
+    size_t slots = t->cfg->file_size / IO_SIZE;
+    size_t i, count = (slots ? slots : 1) * t->cfg->rounds;
+    file_path(t, 0, path);
+    if (slots == 0 || libsfs_open(t->fs, path, O_RDWR, &file) < 0) {
+        t->errors++;
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        off_t off = (off_t) (rand_r(&t->seed) % slots) * IO_SIZE;
+        uint64_t start = stats_now();
+        ssize_t ret = writing ? libsfs_write(file, t->buf, IO_SIZE, off)
+                              : libsfs_read(file, t->buf, IO_SIZE, off);
+        bench_sample(t, start, ret < 0 ? (int) ret : 0);
+        if (ret > 0) {
+            t->bytes += ret;
+        }
+    }
+    libsfs_close(file);
+}
+
+static void run_randwrite(bench_thread *t) {
+    run_rand(t, 1);
+}
+
+static void run_randread(bench_thread *t) {
+    run_rand(t, 0);
+}
+
+// All threads fill one shared directory, then look names up in it at random
+static void setup_largedir(bench_thread *t) {
+    if (t->id == 0) {
+        libsfs_mkdir(t->fs, "/big", 0755);
+    }
+}
+
+static void run_largedir(bench_thread *t) {
+    char path[PATH_MAX];
+    struct stat st;
+    int nthreads = t->cfg->max_threads;
+    int i, r;
+    for (i = t->id; i < t->cfg->files; i += nthreads) {
+        snprintf(path, PATH_MAX, "/big/entry-%d", i);
+        uint64_t start = stats_now();
+        bench_sample(t, start, libsfs_create(t->fs, path, 0644, NULL));
+    }
+    pthread_barrier_wait(&fill_barrier);
+    for (r = 0; r < t->cfg->rounds; r++) {
+        snprintf(path, PATH_MAX, "/big/entry-%d", rand_r(&t->seed) % t->cfg->files);
+        uint64_t start = stats_now();
+        bench_sample(t, start, libsfs_stat(t->fs, path, &st));
+    }
+}
+
+static const workload workloads[] = {
+        {"create",    setup_thread_dir, run_create},
+        {"stat",      setup_files,      run_stat},
+        {"seqwrite",  setup_data_file,  run_seqwrite},
+        {"seqread",   setup_data_file,  run_seqread},
+        {"randwrite", setup_data_file,  run_randwrite},
+        {"randread",  setup_data_file,  run_randread},
+        {"largedir",  setup_largedir,   run_largedir},
+};
+
+static void *bench_thread_main(void *arg) {
+    bench_thread *t = arg;
+    t->workload->setup(t);
+    pthread_barrier_wait(&start_barrier);
+    t->begin = stats_now();
+    t->workload->run(t);
+    t->end = stats_now();
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = (size_t) (n * p);
+    return sorted[i < n ? i : n - 1] / 1000.0;
+}
+
+static void run_workload(const workload *w, int nthreads, bench_config *cfg) {
+    char image[PATH_MAX];
+    bench_thread threads[MAX_THREADS];
+    sfs_fs *fs;
+    int i, fd, ret;
+
+    snprintf(image, sizeof(image), "%s/sfs-bench-XXXXXX", cfg->dir);
+    fd = mkstemp(image);
+    if (fd < 0) {
+        perror(image);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    ret = libsfs_format(image, NULL);
+    if (ret == 0) {
+        ret = libsfs_mount(image, &cfg->opts, &fs);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", image, strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    // run_largedir spreads entries over the threads of this run
+    cfg->max_threads = nthreads;
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    pthread_barrier_init(&fill_barrier, NULL, nthreads);
+    memset(threads, 0, sizeof(threads));
+    for (i = 0; i < nthreads; i++) {
+        threads[i].id = i;
+        threads[i].fs = fs;
+        threads[i].cfg = cfg;
+        threads[i].seed = 12345 + i;
+        threads[i].buf = malloc(IO_SIZE > cfg->file_size ? IO_SIZE : cfg->file_size);
+        memset(threads[i].buf, 'a' + i % 26, IO_SIZE);
+        threads[i].workload = w;
+        pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&fill_barrier);
+
+    size_t total = 0, k = 0;
+    unsigned long errors = 0;
+    uint64_t bytes = 0, begin = threads[0].begin, end = threads[0].end;
+    for (i = 0; i < nthreads; i++) {
+        begin = threads[i].begin < begin ? threads[i].begin : begin;
+        end = threads[i].end > end ? threads[i].end : end;
+        total += threads[i].nlat;
+        errors += threads[i].errors;
+        bytes += threads[i].bytes;
+    }
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    for (i = 0; i < nthreads; i++) {
+        memcpy(all + k, threads[i].lat, threads[i].nlat * sizeof(uint64_t));
+        k += threads[i].nlat;
+        free(threads[i].lat);
+        free(threads[i].buf);
+    }
+    double elapsed = (end - begin) / 1e9;
+    qsort(all, total, sizeof(uint64_t), cmp_u64);
+    printf("%-10s %7d %10zu %12.0f %9.1f %9.2f %9.2f %9.2f %9.2f %7lu\n",
+           w->name, nthreads, total, total / elapsed, bytes / elapsed / (1024 * 1024),
+           percentile_us(all, total, 0.50), percentile_us(all, total, 0.90),
+           percentile_us(all, total, 0.99), total ? all[total - 1] / 1000.0 : 0, errors);
+    free(all);
+
+    libsfs_unmount(fs);
+    unlink(image);
+}
+
+static void bench_usage(void) {
+    fprintf(stderr, "usage:  sfs-bench [-t threads] [-f files] [-s file_size] [-r rounds]\n"
+                    "                  [-w workload] [-d scratch_dir] [-L] [-C] [-D]\n");
+    fprintf(stderr, "workloads: create stat seqwrite seqread randwrite randread largedir\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    bench_config cfg = {1, DEFAULT_FILES, DEFAULT_FILE_SIZE, DEFAULT_ROUNDS, NULL, "/tmp", {0}};
+    int opt, threads = 4;
+    size_t w;
+
+    while ((opt = getopt(argc, argv, "t:f:s:r:w:d:LCD")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'f':
+                cfg.files = atoi(optarg);
+                break;
+            case 's':
+                cfg.file_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                cfg.rounds = atoi(optarg);
+                break;
+            case 'w':
+                cfg.only = optarg;
+                break;
+            case 'd':
+                cfg.dir = optarg;
+                break;
+            case 'L':
+                cfg.opts.log_structured = 1;
+                break;
+            case 'C':
+                cfg.opts.compress = 1;
+                break;
+            case 'D':
+                cfg.opts.dedup = 1;
+                break;
+            default:
+                bench_usage();
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || cfg.files < 1 || cfg.rounds < 1) {
+        bench_usage();
+    }
+
+    printf("%-10s %7s %10s %12s %9s %9s %9s %9s %9s %7s\n", "workload", "threads", "ops",
+           "ops/s", "MB/s", "p50_us", "p90_us", "p99_us", "max_us", "errors");
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        int n;
+        if (cfg.only != NULL && strcmp(cfg.only, workloads[w].name) != 0) {
+            continue;
+        }
+        // 1, 2, 4, ... and finally the requested count itself
+        for (n = 1; n < threads; n *= 2) {
+            run_workload(&workloads[w], n, &cfg);
+        }
+        run_workload(&workloads[w], threads, &cfg);
+    }
+    return 0;
+}
@@ -5,70 +5,701 @@
 #include "params.h"
 #include "block.h"
 
-#include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
-#include <libgen.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/random.h>
 #include <sys/types.h>
-#include <math.h>
-
-#ifdef HAVE_SYS_XATTR_H
-#include <sys/xattr.h>
-#endif
 
+#include "compress.h"
+#include "dedup.h"
+#include "journal.h"
+#include "lfs.h"
 #include "log.h"
 #include "sfs.h"
+#include "stats.h"
 #include "sfs_helper_functions.h"
 
 
-superblock *sb = NULL;
-int block_cur = 1;
+/***************************************************************************************************
+ ***************************************************************************************************
+ * Distribution of Blocks: see sfs.h
+ * superblock | group descriptors | block bitmap, data of group 0 | group 1 | ...
+ ***************************************************************************************************
+ ***************************************************************************************************/
+
+#define BLOCK_BITMAP_BLOCKS(sb) ((sb)->blocks_per_group / BITS_PER_BLOCK)
+
+/** Number of blocks in group g; only the last group may be short */
+static unsigned int group_size(const superblock *sb, unsigned int g) {
+    uint64_t first = (uint64_t) g * sb->blocks_per_group;
+    return sb->total_blocks - first < sb->blocks_per_group ? (unsigned int) (sb->total_blocks - first)
+                                                           : sb->blocks_per_group;
+}
+
+/** Blocks at the start of group g taken by the superblock, descriptors and block bitmap */
+static unsigned int group_overhead(const superblock *sb, unsigned int g) {
+    unsigned int overhead = BLOCK_BITMAP_BLOCKS(sb);
+    return g == 0 ? overhead + (unsigned int) sb->gdt_begin + sb->gdt_blocks : overhead;
+}
+
+static void bitmap_set_range(unsigned char *bitmap, unsigned int from, unsigned int to) {
+    for (; from < to; from++) {
+        bitmap[from / 8] |= 128 >> (from % 8);
+    }
+}
+
+/** Copy the block map of an in-memory index file into its superblock record */
+static void index_map_store(index_map *map, const inode *file) {
+    map->size = (uint64_t) file->size;
+    map->blocks = file->blocks_number;
+    memcpy(map->map, file->block_pointers, sizeof(file->block_pointers));
+    map->map[DIRECT_BLOCKS] = file->indirect;
+    map->map[DIRECT_BLOCKS + 1] = file->double_indirect;
+    map->map[DIRECT_BLOCKS + 2] = file->triple_indirect;
+}
+
+static void index_map_load(inode *file, const index_map *map) {
+    memset(file, 0, sizeof(inode));
+    file->size = (off_t) map->size;
+    file->blocks_number = map->blocks;
+    memcpy(file->block_pointers, map->map, sizeof(file->block_pointers));
+    file->indirect = map->map[DIRECT_BLOCKS];
+    file->double_indirect = map->map[DIRECT_BLOCKS + 1];
+    file->triple_indirect = map->map[DIRECT_BLOCKS + 2];
+}
+
+int write_superblock(sfs_fs *fs) {
+    char buffer[BLOCK_SIZE];
+    index_map_store(&fs->sb.chunk_index, &fs->chunk_index);
+    index_map_store(&fs->sb.frag_index, &fs->frag_index);
+    index_map_store(&fs->sb.ref_index, &fs->ref_index);
+    memset(buffer, 0, BLOCK_SIZE);
+    memcpy(buffer, &fs->sb, sizeof(superblock));
+    return meta_write(fs, 0, buffer) == BLOCK_SIZE ? 0 : -EIO;
+}
+
+/** Write back the block of the group descriptor table that holds group g */
+int write_group_desc(sfs_fs *fs, unsigned int g) {
+    char buffer[BLOCK_SIZE];
+    unsigned int first = g - g % GROUP_DESCS_PER_BLOCK;
+    unsigned int n = fs->sb.group_count - first;
+    if (n > GROUP_DESCS_PER_BLOCK) {
+        n = GROUP_DESCS_PER_BLOCK;
+    }
+    memset(buffer, 0, BLOCK_SIZE);
+    memcpy(buffer, &fs->groups[first], n * sizeof(group_desc));
+    return meta_write(fs, fs->sb.gdt_begin + g / GROUP_DESCS_PER_BLOCK, buffer) == BLOCK_SIZE
+           ? 0 : -EIO;
+}
 
 /**
- * Given the index of newly allocated inode or data block, update the bitmap
- * @param index: The ith inode, or the ith data block. An index of data block is not the absolute
- *               data block number, but the relative index related to superBlock.data_begin
- * @param mode: INODE_BITMAP_UPDATE == 0; DATA_BITMAP_UPDATE == 1
+ * Make room for at least count entries in an in-memory index. The
+ * capacity stays a multiple of INDEX_ENTRIES_PER_BLOCK and entries past
+ * the used ones are zero, so whole index blocks can be written from it.
  */
-void update_bitmap(unsigned int index, unsigned int mode) {
-    if (sb == NULL) {
-        sb = malloc(BLOCK_SIZE * sizeof(char));
-        block_read(0, (void *) sb);
+static int index_reserve(void **entries, unsigned int *capacity, unsigned int count) {
+    if (count <= *capacity) {
+        return 0;
+    }
+    unsigned int grown = *capacity ? *capacity : INDEX_ENTRIES_PER_BLOCK;
+    while (grown < count) {
+        grown *= 2;
     }
-    int absolute_char_address = index / 8;
-    int bitmap_block_offset = absolute_char_address / BLOCK_SIZE;
-    int char_offset = absolute_char_address % BLOCK_SIZE;
-    int bit_offset = index % 8;
-    int bitmap_block_base = -1;
-    if (mode == INODE_BITMAP_UPDATE) {
-        bitmap_block_base = sb->inode_bitmap_begin;
-        if (bitmap_block_offset >= sb->inode_bitmap_blocks) {
-            printf("Inode bitmap calculation error~\n");
-            abort();
+    char *p = realloc(*entries, (size_t) grown * INDEX_ENTRY_SIZE);
+    if (p == NULL) {
+        return -ENOMEM;
+    }
+    memset(&p[(size_t) *capacity * INDEX_ENTRY_SIZE], 0, (size_t) (grown - *capacity) * INDEX_ENTRY_SIZE);
+    *entries = p;
+    *capacity = grown;
+    return 0;
+}
+
+static int chunk_index_reserve(sfs_fs *fs, unsigned int count) {
+    return index_reserve((void **) &fs->chunks, &fs->chunk_capacity, count);
+}
+
+static int frag_index_reserve(sfs_fs *fs, unsigned int count) {
+    return index_reserve((void **) &fs->frags, &fs->frag_capacity, count);
+}
+
+int ref_index_reserve(sfs_fs *fs, unsigned int count) {
+    return index_reserve((void **) &fs->refs, &fs->ref_capacity, count);
+}
+
+/** Write back the block of an index that holds entry e, growing the index file if needed */
+static int write_index_entry(sfs_fs *fs, inode *file, const void *entries, unsigned int e) {
+    uint64_t block;
+    int ret = inode_bmap_alloc(fs, file, e / INDEX_ENTRIES_PER_BLOCK, &block);
+    if (ret < 0) {
+        return ret;
+    }
+    int grown = ret == 1;
+    if (grown) {
+        file->size = (off_t) (e / INDEX_ENTRIES_PER_BLOCK + 1) * BLOCK_SIZE;
+    }
+    const char *first = (const char *) entries + (size_t) (e - e % INDEX_ENTRIES_PER_BLOCK) * INDEX_ENTRY_SIZE;
+    if (meta_write(fs, block, first) != BLOCK_SIZE) {
+        return -EIO;
+    }
+    return grown ? write_superblock(fs) : 0;
+}
+
+static int write_chunk_entry(sfs_fs *fs, unsigned int c) {
+    return write_index_entry(fs, &fs->chunk_index, fs->chunks, c);
+}
+
+static int write_frag_entry(sfs_fs *fs, unsigned int f) {
+    return write_index_entry(fs, &fs->frag_index, fs->frags, f);
+}
+
+int write_ref_entry(sfs_fs *fs, unsigned int e) {
+    return write_index_entry(fs, &fs->ref_index, fs->refs, e);
+}
+
+/** Read the first count entries of an index whose in-memory copy has room for them */
+static int read_index(sfs_fs *fs, const inode *file, void *entries, unsigned int count) {
+    unsigned int e;
+    if ((uint64_t) file->size / INDEX_ENTRY_SIZE < count) {
+        return -EINVAL;
+    }
+    for (e = 0; e < count; e += INDEX_ENTRIES_PER_BLOCK) {
+        uint64_t block;
+        int ret = inode_bmap(fs, file, e / INDEX_ENTRIES_PER_BLOCK, &block);
+        if (ret < 0) {
+            return ret;
         }
-    } else if (mode == DATA_BITMAP_UPDATE) {
-        bitmap_block_base = sb->data_bitmap_begin;
-        if (bitmap_block_offset >= sb->data_bitmap_blocks) {
-            printf("Data block bitmap calculation error~\n");
-            abort();
+        if (block == 0 || block >= fs->sb.total_blocks) {
+            return -EINVAL;
+        }
+        if (block_read(fs->disk, block, (char *) entries + (size_t) e * INDEX_ENTRY_SIZE) < 0) {
+            return -EIO;
         }
     }
-    int block_to_update = bitmap_block_base + bitmap_block_offset;
-    unsigned char buffer[BLOCK_SIZE];
-    block_read(block_to_update, buffer);
-    buffer[char_offset] = buffer[char_offset] | (128 >> bit_offset);
-    block_write(block_to_update, buffer);
+    return 0;
+}
+
+/**
+ * Load the superblock, the group descriptor table and the inode chunk
+ * index, and check that they describe an image this code can use.
+ * Nothing is written except by replaying a transaction left in the journal.
+ * @return 0, -EIO if the metadata cannot be read, -ENOMEM, or -EINVAL if
+ *         the image is not an sfs image of a supported version or its
+ *         geometry is broken
+ */
+int read_superblock(sfs_fs *fs) {
+    char buffer[BLOCK_SIZE];
+    superblock *sb = &fs->sb;
+    struct stat st;
+    unsigned int g, c;
+
+    if (block_read(fs->disk, 0, buffer) < 0) {
+        return -EIO;
+    }
+    memcpy(sb, buffer, sizeof(superblock));
+    if (sb->magic != SFS_MAGIC) {
+        log_error(LOG_CAT_MOUNT, "read_superblock: bad magic 0x%08x, not an sfs image\n", sb->magic);
+        return -EINVAL;
+    }
+    if (sb->version != SFS_VERSION) {
+        log_error(LOG_CAT_MOUNT, "read_superblock: unsupported version %u (expected %u)\n",
+                  sb->version, SFS_VERSION);
+        return -EINVAL;
+    }
+    if (sb->block_size != BLOCK_SIZE
+        || sb->blocks_per_group == 0 || sb->blocks_per_group % BITS_PER_BLOCK != 0
+        || sb->group_count != (sb->total_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group
+        || sb->total_blocks > (uint64_t) INT64_MAX / BLOCK_SIZE || sb->total_blocks > BMAP_BLOCK_MASK
+        || sb->gdt_begin != 1
+        || sb->gdt_blocks != (sb->group_count + GROUP_DESCS_PER_BLOCK - 1) / GROUP_DESCS_PER_BLOCK
+        || sb->inode_chunks == 0 || sb->inode_chunks > UINT_MAX / INODE_CHUNK_INODES
+        || sb->root_inode_ptr != ROOT_INUM
+        || sb->journal_blocks < MIN_JOURNAL_BLOCKS || sb->journal_start <= sb->gdt_begin + sb->gdt_blocks
+        || sb->journal_start + sb->journal_blocks > sb->total_blocks) {
+        log_error(LOG_CAT_MOUNT, "read_superblock: inconsistent geometry\n");
+        return -EINVAL;
+    }
+    if (fstat(fs->disk, &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_size < (off_t) sb->total_blocks * BLOCK_SIZE) {
+        log_error(LOG_CAT_MOUNT, "read_superblock: image is %lld bytes, superblock says %llu blocks\n",
+                  (long long) st.st_size, (unsigned long long) sb->total_blocks);
+        return -EINVAL;
+    }
+    // Everything below may be stale until a committed transaction is replayed,
+    // and replaying one may change the superblock itself
+    int ret = journal_recover(fs);
+    if (ret != 0) {
+        return ret < 0 ? ret : read_superblock(fs);
+    }
+
+    fs->groups = malloc((size_t) sb->gdt_blocks * BLOCK_SIZE);
+    if (fs->groups == NULL) {
+        return -ENOMEM;
+    }
+    if (block_read_range(fs->disk, sb->gdt_begin, sb->gdt_blocks, fs->groups) < 0) {
+        return -EIO;
+    }
+    for (g = 0; g < sb->group_count; g++) {
+        const group_desc *gd = &fs->groups[g];
+        uint64_t first = (uint64_t) g * sb->blocks_per_group;
+        if (gd->block_bitmap != first + group_overhead(sb, g) - BLOCK_BITMAP_BLOCKS(sb)
+            || gd->free_blocks > group_size(sb, g) - group_overhead(sb, g)) {
+            log_error(LOG_CAT_MOUNT, "read_superblock: bad descriptor for group %u\n", g);
+            return -EINVAL;
+        }
+    }
+
+    // The indexes are read whole; inode lookups, tail reads and shared
+    // blocks go through them
+    index_map_load(&fs->chunk_index, &sb->chunk_index);
+    index_map_load(&fs->frag_index, &sb->frag_index);
+    index_map_load(&fs->ref_index, &sb->ref_index);
+    ret = chunk_index_reserve(fs, sb->inode_chunks);
+    if (ret == 0) {
+        ret = read_index(fs, &fs->chunk_index, fs->chunks, sb->inode_chunks);
+    }
+    if (ret == 0) {
+        memset(&fs->chunks[sb->inode_chunks], 0,
+               (size_t) (fs->chunk_capacity - sb->inode_chunks) * sizeof(inode_chunk));
+        for (c = 0; c < sb->inode_chunks; c++) {
+            if (fs->chunks[c].start != 0 && fs->chunks[c].start + INODE_CHUNK_BLOCKS > sb->total_blocks) {
+                ret = -EINVAL;
+            }
+        }
+    }
+    if (ret == 0 && (fs->chunks[0].start == 0 || !(fs->chunks[0].used & (1ULL << ROOT_INUM)))) {
+        ret = -EINVAL;
+    }
+    if (ret < 0) {
+        log_error(LOG_CAT_MOUNT, "read_superblock: bad inode chunk index\n");
+        return ret;
+    }
+    ret = frag_index_reserve(fs, sb->frag_blocks);
+    if (ret == 0 && sb->frag_blocks > 0) {
+        ret = read_index(fs, &fs->frag_index, fs->frags, sb->frag_blocks);
+    }
+    if (ret == 0) {
+        memset(&fs->frags[sb->frag_blocks], 0,
+               (size_t) (fs->frag_capacity - sb->frag_blocks) * sizeof(frag_block));
+        for (c = 0; c < sb->frag_blocks; c++) {
+            if (fs->frags[c].block >= sb->total_blocks) {
+                ret = -EINVAL;
+            }
+        }
+    }
+    if (ret < 0) {
+        log_error(LOG_CAT_MOUNT, "read_superblock: bad fragment index\n");
+        return ret;
+    }
+    ret = ref_index_reserve(fs, sb->ref_entries);
+    if (ret == 0 && sb->ref_entries > 0) {
+        ret = read_index(fs, &fs->ref_index, fs->refs, sb->ref_entries);
+    }
+    if (ret == 0) {
+        memset(&fs->refs[sb->ref_entries], 0,
+               (size_t) (fs->ref_capacity - sb->ref_entries) * sizeof(block_ref));
+        for (c = 0; c < sb->ref_entries; c++) {
+            if (fs->refs[c].block >= sb->total_blocks || (fs->refs[c].block != 0 && fs->refs[c].refs == 0)) {
+                ret = -EINVAL;
+            }
+        }
+    }
+    if (ret < 0) {
+        log_error(LOG_CAT_MOUNT, "read_superblock: bad block reference index\n");
+    }
+    return ret;
+}
+
+/**
+ * Lay out a fresh filesystem on the disk
+ *
+ * Only the superblock, the group descriptors, the block bitmaps, the
+ * first block of the chunk index and the root directory are written,
+ * each group's bitmap in one request. No inode table is laid out: inode
+ * chunks are allocated from the data space as files are created.
+ * Zero fields of opts are filled in with the defaults that were used.
+ */
+int format_disk(sfs_fs *fs, libsfs_format_options *opts) {
+    superblock *sb = &fs->sb;
+    struct stat st;
+    unsigned int g;
+
+    if (opts->block_size == 0) {
+        opts->block_size = BLOCK_SIZE;
+    }
+    if (opts->block_size != BLOCK_SIZE) {
+        log_error(LOG_CAT_MOUNT, "format_disk: block size %u not supported\n", opts->block_size);
+        return -EINVAL;
+    }
+    if (opts->size == 0) {
+        opts->size = fstat(fs->disk, &st) == 0 && st.st_size > 0 ? st.st_size : DISK_SIZE;
+    }
+    if (opts->blocks_per_group == 0) {
+        opts->blocks_per_group = DEFAULT_BLOCKS_PER_GROUP;
+    }
+    opts->blocks_per_group = (opts->blocks_per_group + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK * BITS_PER_BLOCK;
+    // Groups are numbered in 32 bits, blocks in the 48 that compressed pointers leave them
+    if ((uint64_t) opts->size / BLOCK_SIZE / opts->blocks_per_group >= UINT_MAX
+        || (uint64_t) opts->size / BLOCK_SIZE > BMAP_BLOCK_MASK) {
+        return -EFBIG;
+    }
+
+    //Superblock initialization
+    memset(sb, 0, sizeof(superblock));
+    sb->magic = SFS_MAGIC;
+    sb->version = SFS_VERSION;
+    sb->block_size = BLOCK_SIZE;
+    sb->total_blocks = (uint64_t) opts->size / BLOCK_SIZE;
+    sb->blocks_per_group = opts->blocks_per_group;
+    sb->gdt_begin = 1;
+    sb->root_inode_ptr = ROOT_INUM;
+    // Tells the log's segment summaries from file data that looks like one
+    if (getrandom(&sb->log_id, sizeof(sb->log_id), 0) != sizeof(sb->log_id)) {
+        sb->log_id = (uint64_t) time(NULL) << 32 ^ (uint64_t) getpid();
+    }
+    if (opts->journal_blocks == 0) {
+        uint64_t group0 = sb->total_blocks < sb->blocks_per_group ? sb->total_blocks : sb->blocks_per_group;
+        opts->journal_blocks = group0 / 16 < DEFAULT_JOURNAL_BLOCKS ? (unsigned int) (group0 / 16)
+                                                                     : DEFAULT_JOURNAL_BLOCKS;
+        if (opts->journal_blocks < MIN_JOURNAL_BLOCKS) {
+            opts->journal_blocks = MIN_JOURNAL_BLOCKS;
+        }
+    }
+    if (opts->journal_blocks < MIN_JOURNAL_BLOCKS) {
+        log_error(LOG_CAT_MOUNT, "format_disk: journal of %u blocks is too small\n", opts->journal_blocks);
+        return -EINVAL;
+    }
+    sb->journal_blocks = opts->journal_blocks;
+    // A short last group too small for its own metadata is cut off; group 0
+    // must also hold the root's inode chunk, directory block, the chunk index
+    // and the journal
+    for (;;) {
+        sb->group_count = (unsigned int) ((sb->total_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group);
+        if (sb->group_count == 0) {
+            return -ENOSPC;
+        }
+        sb->gdt_blocks = (sb->group_count + GROUP_DESCS_PER_BLOCK - 1) / GROUP_DESCS_PER_BLOCK;
+        g = sb->group_count - 1;
+        uint64_t reserved = g == 0 ? INODE_CHUNK_BLOCKS + 2 + (uint64_t) sb->journal_blocks : 0;
+        if (group_size(sb, g) > group_overhead(sb, g) + reserved) {
+            break;
+        }
+        if (g == 0) {
+            return -ENOSPC;
+        }
+        sb->total_blocks = (uint64_t) g * sb->blocks_per_group;
+    }
+    opts->size = (off_t) sb->total_blocks * BLOCK_SIZE;
+
+    // Size the image up front so read_superblock can check it on mount
+    if (fstat(fs->disk, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < opts->size
+        && ftruncate(fs->disk, opts->size) < 0) {
+        return -errno;
+    }
+    // Invalidate any previous superblock first, so a format cut short
+    // never leaves something mountable behind
+    char buffer[BLOCK_SIZE];
+    memset(buffer, 0, BLOCK_SIZE);
+    if (block_write(fs->disk, 0, buffer) != BLOCK_SIZE) {
+        return -EIO;
+    }
+
+    fs->groups = calloc(sb->gdt_blocks, BLOCK_SIZE);
+    unsigned int bitmap_blocks = BLOCK_BITMAP_BLOCKS(sb);
+    unsigned char *bitmap = malloc((size_t) bitmap_blocks * BLOCK_SIZE);
+    if (fs->groups == NULL || bitmap == NULL || chunk_index_reserve(fs, 1) < 0) {
+        free(bitmap);
+        return -ENOMEM;
+    }
+    uint64_t root_chunk = 0, root_block = 0, index_block = 0;
+    int built = -1;     // which group the bitmap buffer currently describes, -1 for a middle group
+    for (g = 0; g < sb->group_count; g++) {
+        group_desc *gd = &fs->groups[g];
+        uint64_t first = (uint64_t) g * sb->blocks_per_group;
+        unsigned int size = group_size(sb, g);
+        unsigned int used = group_overhead(sb, g);
+        gd->block_bitmap = first + used - bitmap_blocks;
+        if (g == 0) {
+            // The first inode chunk (inode 0 reserved, ROOT_INUM), the root
+            // directory block, the first chunk index block and the journal
+            root_chunk = first + used;
+            root_block = root_chunk + INODE_CHUNK_BLOCKS;
+            index_block = root_block + 1;
+            sb->journal_start = index_block + 1;
+            used += INODE_CHUNK_BLOCKS + 2 + sb->journal_blocks;
+        }
+        gd->free_blocks = size - used;
+        sb->free_blocks += gd->free_blocks;
+
+        // Every middle group has the same bitmap, build that once
+        int kind = (g == 0 || size < sb->blocks_per_group) ? (int) g : -1;
+        if (kind != -1 || built != -1) {
+            memset(bitmap, 0, (size_t) bitmap_blocks * BLOCK_SIZE);
+            bitmap_set_range(bitmap, 0, used);
+            bitmap_set_range(bitmap, size, sb->blocks_per_group);
+            built = kind;
+        }
+        if (block_write_range(fs->disk, gd->block_bitmap, bitmap_blocks, bitmap) < 0) {
+            free(bitmap);
+            return -EIO;
+        }
+    }
+    free(bitmap);
+    if (block_write_range(fs->disk, sb->gdt_begin, sb->gdt_blocks, fs->groups) < 0) {
+        return -EIO;
+    }
+
+    //Inode chunk index, a one-block file mapped from the superblock
+    sb->inode_chunks = 1;
+    sb->used_inodes = 1;
+    fs->chunks[0].start = root_chunk;
+    fs->chunks[0].used = 1ULL | 1ULL << ROOT_INUM;
+    memset(&fs->chunk_index, 0, sizeof(inode));
+    memset(&fs->frag_index, 0, sizeof(inode));
+    memset(&fs->ref_index, 0, sizeof(inode));
+    fs->chunk_index.size = BLOCK_SIZE;
+    fs->chunk_index.blocks_number = 1;
+    fs->chunk_index.block_pointers[0] = index_block;
+    if (block_write(fs->disk, index_block, fs->chunks) != BLOCK_SIZE) {
+        return -EIO;
+    }
+    // An empty journal: no valid header in either half
+    memset(buffer, 0, BLOCK_SIZE);
+    if (block_write(fs->disk, sb->journal_start, buffer) != BLOCK_SIZE
+        || block_write(fs->disk, sb->journal_start + sb->journal_blocks / 2, buffer) != BLOCK_SIZE) {
+        return -EIO;
+    }
+
+    //Root directory '/' inode initialization, in the first block of the first chunk
+    inode *ino = (inode *) buffer;
+    memset(buffer, 0, BLOCK_SIZE);
+    ino->inum = ROOT_INUM;
+    ino->mode = S_IFDIR | 0755;
+    ino->uid = getuid();
+    ino->gid = getgid();
+    ino->size = BLOCK_SIZE;
+    ino->type = DIRECTORY;
+    ino->atime = time(NULL);
+    ino->ctime = ino->atime;
+    ino->mtime = ino->ctime;
+    ino->blocks_number = 1;
+    ino->links_count = 2;
+    ino->parent_Ptr = ROOT_INUM;
+    ino->block_pointers[0] = root_block;
+    if (block_write(fs->disk, root_chunk + ROOT_INUM, buffer) != BLOCK_SIZE) {
+        return -EIO;
+    }
+    //Root directory '/' data block initialization
+    directory_block_init(fs, root_block, ROOT_INUM, ROOT_INUM);
+
+    return write_superblock(fs);
+}
+
+/**
+ * Locate the block holding inum
+ * @return the block, or 0 if inum is not an allocated inode
+ */
+static uint64_t inode_block(sfs_fs *fs, unsigned int inum) {
+    unsigned int c = inum / INODE_CHUNK_INODES, slot = inum % INODE_CHUNK_INODES;
+    if (inum == 0 || c >= fs->sb.inode_chunks || !(fs->chunks[c].used & (1ULL << slot))) {
+        return 0;
+    }
+    return fs->chunks[c].start + slot;
+}
+
+/** Give ino the timestamps it has in memory only, if it has any */
+static void inode_times_load(sfs_fs *fs, unsigned int inum, inode *ino) {
+    open_inode *oi;
+    if (atomic_load(&fs->dirty_times) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fs->open_lock);
+    for (oi = fs->open_inodes; oi != NULL; oi = oi->next) {
+        if (oi->inum == inum) {
+            if (oi->times_dirty != 0) {
+                ino->atime = oi->atime;
+                ino->mtime = oi->mtime;
+                ino->ctime = oi->ctime;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+}
+
+/** The timestamps of inum are on disk: forget the in-memory ones */
+static void inode_times_clean(sfs_fs *fs, unsigned int inum) {
+    open_inode **link, *oi;
+    if (atomic_load(&fs->dirty_times) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fs->open_lock);
+    for (link = &fs->open_inodes; (oi = *link) != NULL; link = &oi->next) {
+        if (oi->inum == inum) {
+            if (oi->times_dirty != 0) {
+                oi->times_dirty = 0;
+                atomic_fetch_sub(&fs->dirty_times, 1);
+            }
+            // Only its timestamps kept a closed inode in the table
+            if (oi->refs == 0) {
+                *link = oi->next;
+                free(oi);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+}
+
+int read_inode(sfs_fs *fs, unsigned int inum, inode *ino) {
+    uint64_t block = inode_block(fs, inum);
+    if (block == 0) {
+        log_error(LOG_CAT_LOOKUP, "Wrong inode number %d!\n", inum);
+        return -EIO;
+    }
+    if (meta_read(fs, block, ino) < 0) {
+        return -EIO;
+    }
+    inode_times_load(fs, inum, ino);
+    return 0;
+}
+
+/**
+ * Write an in-memory inode back to its slot in its inode chunk. An inode
+ * fills its block, so there is nothing to read first.
+ */
+int write_inode(sfs_fs *fs, const inode *ino) {
+    uint64_t block = inode_block(fs, ino->inum);
+    if (block == 0) {
+        log_error(LOG_CAT_ALLOC, "write_inode: inode %u is not allocated\n", ino->inum);
+        return -EIO;
+    }
+    if (meta_write(fs, block, ino) != BLOCK_SIZE) {
+        return -EIO;
+    }
+    inode_times_clean(fs, ino->inum);
+    return 0;
+}
+
+/**
+ * Change the timestamps of an open inode in memory only, to the ones of
+ * ino. They reach the disk with the next write of the inode: when its
+ * last handle is closed, on fsync, or LAZYTIME_EXPIRE_SECS later. Caller
+ * holds fs->lock, shared is enough.
+ * @return 0, or -ENOENT if the inode is not open and must be written
+ */
+int inode_times_defer(sfs_fs *fs, const inode *ino) {
+    open_inode *oi;
+    pthread_mutex_lock(&fs->open_lock);
+    for (oi = fs->open_inodes; oi != NULL; oi = oi->next) {
+        if (oi->inum == ino->inum) {
+            oi->atime = ino->atime;
+            oi->mtime = ino->mtime;
+            oi->ctime = ino->ctime;
+            if (oi->times_dirty == 0) {
+                oi->times_dirty = time(NULL);
+                atomic_fetch_add(&fs->dirty_times, 1);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    if (oi == NULL) {
+        return -ENOENT;
+    }
+    stats_add(STAT_TIMES_DEFERRED, 1);
+    return 0;
+}
+
+/** Whether inum has timestamps that are not on disk yet */
+int inode_times_dirty(sfs_fs *fs, unsigned int inum) {
+    open_inode *oi;
+    int dirty = 0;
+    if (atomic_load(&fs->dirty_times) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&fs->open_lock);
+    for (oi = fs->open_inodes; oi != NULL; oi = oi->next) {
+        if (oi->inum == inum) {
+            dirty = oi->times_dirty != 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    return dirty;
+}
+
+/** Whether inum has a libsfs_file open on it */
+int inode_is_open(sfs_fs *fs, unsigned int inum) {
+    open_inode *oi;
+    int open = 0;
+    pthread_mutex_lock(&fs->open_lock);
+    for (oi = fs->open_inodes; oi != NULL; oi = oi->next) {
+        if (oi->inum == inum) {
+            open = oi->refs > 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    return open;
+}
+
+/**
+ * Write back the in-memory timestamps of inum, or of every inode if inum
+ * is 0, that changed at or before dirtied_before. Takes fs->lock
+ * exclusively.
+ */
+void inode_times_flush(sfs_fs *fs, unsigned int inum, time_t dirtied_before) {
+    unsigned int *inums, n = 0, k;
+    open_inode *oi;
+    inode ino;
+    if (atomic_load(&fs->dirty_times) == 0) {
+        return;
+    }
+    pthread_rwlock_wrlock(&fs->lock);
+    // Nothing defers timestamps while the lock is held, so the count holds
+    pthread_mutex_lock(&fs->open_lock);
+    inums = malloc(atomic_load(&fs->dirty_times) * sizeof(unsigned int) + 1);
+    for (oi = fs->open_inodes; inums != NULL && oi != NULL; oi = oi->next) {
+        if (oi->times_dirty != 0 && oi->times_dirty <= dirtied_before && (inum == 0 || oi->inum == inum)) {
+            inums[n++] = oi->inum;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    for (k = 0; k < n; k++) {
+        if (read_inode(fs, inums[k], &ino) == 0) {
+            write_inode(fs, &ino);
+        }
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    free(inums);
+    if (n > 0) {
+        log_debug(LOG_CAT_FILE, "inode_times_flush: wrote back the timestamps of %u inodes\n", n);
+    }
+}
+
+void fill_stat(const inode *ino, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = ino->inum;
+    st->st_mode = ino->mode;
+    st->st_uid = ino->uid;
+    st->st_gid = ino->gid;
+    st->st_atime = ino->atime;
+    st->st_ctime = ino->ctime;
+    st->st_mtime = ino->mtime;
+    st->st_blksize = BLOCK_SIZE;
+    st->st_blocks = ino->blocks_number * (BLOCK_SIZE / 512);
+    st->st_nlink = ino->links_count;
+    st->st_size = ino->size;
 }
 
-void directory_block_init(unsigned int block_id, unsigned int inum, unsigned int parent_inum) {
-    block_id += sb->data_begin;
+void directory_block_init(sfs_fs *fs, uint64_t block_id, unsigned int inum, unsigned int parent_inum) {
     char buffer[BLOCK_SIZE];
     memset(buffer, 0, BLOCK_SIZE);
     file_entry *fe = (file_entry *) &buffer[0];
@@ -77,100 +708,1076 @@ void directory_block_init(unsigned int block_id, unsigned int inum, unsigned int
     fe = (file_entry *) ((void *) fe + sizeof(file_entry));
     fe->inum = parent_inum;
     strcpy(fe->file_name, "..");
-    block_write(block_id, buffer);
+    meta_write(fs, block_id, buffer);
 }
 
-inode *get_inode_by_inum(int inum) {
-    if (inum >= MAX_FILE_NUMBER) {
-        printf("Wrong inode number!\n");
-        abort();
+/** Number of file blocks covered by one pointer at the given indirection depth */
+static uint64_t tree_span(int depth) {
+    uint64_t span = 1;
+    while (depth-- > 0) {
+        span *= POINTERS_PER_BLOCK;
     }
-    inode *target_file = (inode *) malloc(sizeof(inode));
-    char buffer[BLOCK_SIZE];
-    int block_offset = inum / 4; // One block can store 4 inodes
-    int byte_offset = inum % 4 * INODE_SIZE;
-    block_read(sb->inode_begin + block_offset, buffer);
-    memcpy(target_file, &buffer[byte_offset], INODE_SIZE);
-    return target_file;
+    return span;
+}
+
+/**
+ * Find the slot in the inode that roots the mapping of file block index,
+ * and how deep the tree under it is; index is made relative to that tree
+ */
+static uint64_t *bmap_root(inode *ino, uint64_t *index, int *depth) {
+    if (*index < DIRECT_BLOCKS) {
+        *depth = 0;
+        return &ino->block_pointers[*index];
+    }
+    *index -= DIRECT_BLOCKS;
+    if (*index < tree_span(1)) {
+        *depth = 1;
+        return &ino->indirect;
+    }
+    *index -= tree_span(1);
+    if (*index < tree_span(2)) {
+        *depth = 2;
+        return &ino->double_indirect;
+    }
+    *index -= tree_span(2);
+    if (*index < tree_span(3)) {
+        *depth = 3;
+        return &ino->triple_indirect;
+    }
+    return NULL;
 }
 
-inode *retrieve_file(char *filename, inode *current_dir) {
-    // To simplify, we assume that we only have a root directory. All the file is under this directory
-    inode *target_file = NULL;
+// What bmap_walk does with a missing or existing data block
+#define BMAP_LOOKUP 0   // report holes as block 0
+#define BMAP_ALLOC 1    // allocate missing blocks
+#define BMAP_SET 2      // replace the data block
+#define BMAP_STORE 3    // replace the pointer, leaving blocks_number to the caller
+
+/** Allocate a block for the tree of ino, zeroing it if it will hold pointers */
+static uint64_t bmap_new_block(sfs_fs *fs, inode *ino, int pointers) {
+    uint64_t block = assign_block(fs);
+    if (block != 0) {
+        ino->blocks_number++;
+        if (pointers) {
+            char buffer[BLOCK_SIZE];
+            memset(buffer, 0, BLOCK_SIZE);
+            meta_write(fs, block, buffer);
+        }
+    }
+    return block;
+}
+
+static int bmap_walk(sfs_fs *fs, inode *ino, uint64_t index, int mode, uint64_t *block) {
+    uint64_t pointers[POINTERS_PER_BLOCK];
+    uint64_t parent = 0;    // the pointer block holding slot, 0 while slot is in the inode
+    int depth, allocated = 0;
+    uint64_t *slot = bmap_root(ino, &index, &depth);
+    if (slot == NULL) {
+        return -EFBIG;
+    }
+    for (;; depth--) {
+        uint64_t current = *slot;
+        int changed = 0;
+        if (depth == 0 && mode >= BMAP_SET) {
+            *slot = *block;
+            *block = current;
+            if (current == 0 && mode == BMAP_SET) {
+                ino->blocks_number++;
+            }
+            changed = 1;
+        } else if (depth == 0 && mode == BMAP_ALLOC && BMAP_IS_UNWRITTEN(current)) {
+            // A reserved block is as good as a new one, and is written now
+            current &= ~BMAP_UNWRITTEN;
+            *slot = current;
+            allocated = 1;
+            changed = 1;
+        } else if (current == 0) {
+            if (mode == BMAP_LOOKUP) {
+                *block = 0;
+                return 0;
+            }
+            current = bmap_new_block(fs, ino, depth > 0);
+            if (current == 0) {
+                return -ENOSPC;
+            }
+            *slot = current;
+            allocated = depth == 0;
+            changed = 1;
+        }
+        if (changed && parent != 0) {
+            meta_write(fs, parent, pointers);
+        }
+        if (depth == 0) {
+            if (mode < BMAP_SET) {
+                *block = current;
+            }
+            return allocated;
+        }
+        uint64_t span = tree_span(depth - 1);
+        unsigned int i = (unsigned int) (index / span);
+        index %= span;
+        meta_read(fs, current, pointers);
+        parent = current;
+        slot = &pointers[i];
+    }
+}
+
+/**
+ * Map block index of a file to its disk block
+ * @return 0 with *block set, or 0 in *block for a hole; -EFBIG past the
+ *         largest possible file
+ */
+int inode_bmap(sfs_fs *fs, const inode *ino, uint64_t index, uint64_t *block) {
+    return bmap_walk(fs, (inode *) ino, index, BMAP_LOOKUP, block);
+}
+
+/**
+ * Map block index of a file to its disk block, allocating the block and
+ * any indirect blocks on the way, or taking up a block fallocate reserved.
+ * The caller writes ino back.
+ * @return 1 if the data block is new (its contents are stale), 0 if it
+ *         was already there, -EFBIG or -ENOSPC
+ */
+int inode_bmap_alloc(sfs_fs *fs, inode *ino, uint64_t index, uint64_t *block) {
+    return bmap_walk(fs, ino, index, BMAP_ALLOC, block);
+}
+
+/**
+ * Point block index of a file at *block, allocating any indirect blocks
+ * on the way, and return the block it mapped before (0 for a hole) in
+ * *block. The caller releases that one and writes ino back.
+ * @return 0, -EFBIG or -ENOSPC
+ */
+int inode_bmap_set(sfs_fs *fs, inode *ino, uint64_t index, uint64_t *block) {
+    return bmap_walk(fs, ino, index, BMAP_SET, block);
+}
+
+/**
+ * Like inode_bmap_set, for a pointer that is not simply a data block of
+ * its own, such as a compressed pointer; blocks_number is left alone
+ */
+int inode_bmap_store(sfs_fs *fs, inode *ino, uint64_t index, uint64_t *pointer) {
+    return bmap_walk(fs, ino, index, BMAP_STORE, pointer);
+}
+
+/**
+ * Search the tree under block, which maps file blocks from base on at the
+ * given depth, for the first block from from up to end that is mapped
+ * (data) or a hole (!data). A missing pointer block is a hole as a whole.
+ */
+static int seek_tree(sfs_fs *fs, uint64_t block, int depth, uint64_t base, uint64_t from, uint64_t end,
+                     int data, uint64_t *found) {
+    uint64_t pointers[POINTERS_PER_BLOCK];
+    uint64_t span = tree_span(depth - 1);
+    unsigned int i;
+    if (block == 0 || depth == 0) {
+        if ((block != 0 && (data == SEEK_MAPPED || !BMAP_IS_UNWRITTEN(block))) == (data != 0)) {
+            *found = base > from ? base : from;
+            return 1;
+        }
+        return 0;
+    }
+    meta_read(fs, block, pointers);
+    for (i = 0; i < POINTERS_PER_BLOCK && base + i * span < end; i++) {
+        if (base + (i + 1) * span > from
+            && seek_tree(fs, pointers[i], depth - 1, base + i * span, from, end, data, found)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find the first block of ino from from up to end that holds data, or
+ * that is a hole if data is 0, skipping whole unmapped subtrees. Blocks
+ * reserved but never written are holes, unless data is SEEK_MAPPED. A
+ * packed tail or inline data is not in the block map; the caller sees to
+ * those.
+ * @return 1 with *found set, or 0 if there is none before end
+ */
+int inode_seek(sfs_fs *fs, const inode *ino, uint64_t from, uint64_t end, int data, uint64_t *found) {
+    uint64_t roots[] = {ino->indirect, ino->double_indirect, ino->triple_indirect};
+    uint64_t base = DIRECT_BLOCKS, i;
+    int depth;
+    if (from >= end) {
+        return 0;
+    }
+    for (i = from; i < DIRECT_BLOCKS && i < end; i++) {
+        uint64_t block = ino->block_pointers[i];
+        if ((block != 0 && (data == SEEK_MAPPED || !BMAP_IS_UNWRITTEN(block))) == (data != 0)) {
+            *found = i;
+            return 1;
+        }
+    }
+    for (depth = 1; depth <= 3 && base < end; depth++) {
+        uint64_t span = tree_span(depth);
+        if (base + span > from && seek_tree(fs, roots[depth - 1], depth, base, from, end, data, found)) {
+            return 1;
+        }
+        base += span;
+    }
+    return 0;
+}
+
+/**
+ * Look a name up in one directory
+ * @return 0 and the entry's inode number in *inum, or -ENOENT
+ */
+int retrieve_file(sfs_fs *fs, const char *filename, const inode *current_dir, unsigned int *inum) {
     char buffer[BLOCK_SIZE];
-    int i = 0;
-    for (; i < current_dir->blocks_number; i++) {
-        int absolute_block_id = current_dir->block_pointers[i] + sb->data_begin;
-        block_read(absolute_block_id, buffer);
+    uint64_t i, block;
+    for (i = 0; i < (uint64_t) current_dir->size / BLOCK_SIZE; i++) {
+        if (inode_bmap(fs, current_dir, i, &block) < 0 || block == 0) {
+            continue;
+        }
+        meta_read(fs, block, buffer);
         file_entry *entry;
         int j;
-        for (j = 0; j < 4; j++) {
-            entry = (file_entry *) &buffer[j * 128];
-            if (strcmp(entry->file_name, filename) == 0) {
-                target_file = get_inode_by_inum(entry->inum);
-                return target_file;
+        for (j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            entry = (file_entry *) &buffer[j * FILE_ENTRY_SIZE];
+            if (entry->inum != 0 && strcmp(entry->file_name, filename) == 0) {
+                *inum = entry->inum;
+                return 0;
             }
         }
     }
-    printf("No such file or directory exists in current directory\n");
-    return NULL;
+    log_debug(LOG_CAT_LOOKUP, "retrieve_file: no entry \"%s\"\n", filename);
+    return -ENOENT;
 }
 
-inode *resolute_path(char *path, inode *current_dir) {
-    inode *target_file = NULL;
-    // Target is the root directory
-    if (strcmp(path, "/") == 0) {
-        target_file = get_inode_by_inum(sb->root_inode_ptr);
-        return target_file;
+/**
+ * Walk an absolute path from the root directory, one component at a time
+ * @return 0 with the final inode in *target, or a negative errno
+ */
+int resolute_path(sfs_fs *fs, const char *path, inode *target) {
+    char name[MAX_FILE_NAME + 1];
+    int ret = read_inode(fs, fs->sb.root_inode_ptr, target);
+    while (ret == 0) {
+        while (*path == '/') path++;
+        if (*path == '\0') {
+            return 0;
+        }
+        size_t len = strcspn(path, "/");
+        if (len > MAX_FILE_NAME) {
+            return -ENAMETOOLONG;
+        }
+        if (target->type != DIRECTORY) {
+            return -ENOTDIR;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+        unsigned int inum;
+        ret = retrieve_file(fs, name, target, &inum);
+        if (ret == 0) {
+            ret = read_inode(fs, inum, target);
+        }
     }
-    // Otherwise, target is a file under root directory
-    int start = (path[0] == '/') ? 1 : 0;
-    size_t length = strlen(path) - start + 1;
-    char filename[length];
-    memcpy(filename, &path[start], length - 1);
-    filename[length - 1] = '\0';
-    target_file = retrieve_file(filename, current_dir);
-    return target_file;
+    return ret;
 }
 
+/**
+ * Resolve the directory that holds the last component of path, and copy
+ * that component into name (at least MAX_FILE_NAME + 1 bytes)
+ */
+int resolute_parent(sfs_fs *fs, const char *path, inode *parent, char *name) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    size_t start = len;
+    while (start > 0 && path[start - 1] != '/') start--;
+    if (len == start) {
+        return -EINVAL; // the root has no parent entry
+    }
+    if (len - start > MAX_FILE_NAME) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(name, path + start, len - start);
+    name[len - start] = '\0';
 
+    char dir_path[start + 1];
+    memcpy(dir_path, path, start);
+    dir_path[start] = '\0';
+    int ret = resolute_path(fs, dir_path, parent);
+    if (ret == 0 && parent->type != DIRECTORY) {
+        return -ENOTDIR;
+    }
+    return ret;
+}
 
-unsigned int assign_block() {
+/**
+ * Put a (name, inum) pair into the first free slot of dir, growing the
+ * directory by one block if every slot is taken
+ */
+int dir_add_entry(sfs_fs *fs, inode *dir, const char *name, unsigned int inum) {
     char buffer[BLOCK_SIZE];
-    if (sb->free_data_blocks == 0) return 0;
-    unsigned int block_offset = 0, byte_offset = 0, bit_offset = 0;
-    for (; block_offset < sb->data_bitmap_blocks; block_offset++) {
-        block_read(sb->data_bitmap_begin + block_offset, buffer);
-        byte_offset = 0;
-        for (; byte_offset < BLOCK_SIZE; byte_offset++) {
-            unsigned char c = (unsigned char) buffer[byte_offset];
-            for (bit_offset = 0; bit_offset < 8; bit_offset++) {
-                if (c == 128 >> bit_offset) {
-                    unsigned int ret = block_offset * BLOCK_SIZE * 8 + byte_offset * 8 + bit_offset;
-                    update_bitmap(ret,DATA_BITMAP_UPDATE);
-                    return ret;
+    uint64_t i, block, nblocks = (uint64_t) dir->size / BLOCK_SIZE;
+    int j;
+    for (i = 0; i < nblocks; i++) {
+        if (inode_bmap(fs, dir, i, &block) < 0 || block == 0) {
+            continue;
+        }
+        meta_read(fs, block, buffer);
+        for (j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            file_entry *entry = (file_entry *) &buffer[j * FILE_ENTRY_SIZE];
+            if (entry->inum == 0) {
+                entry->inum = inum;
+                strncpy(entry->file_name, name, sizeof(entry->file_name) - 1);
+                entry->file_name[sizeof(entry->file_name) - 1] = '\0';
+                meta_write(fs, block, buffer);
+                return 0;
+            }
+        }
+    }
+    int ret = inode_bmap_alloc(fs, dir, nblocks, &block);
+    if (ret < 0) {
+        write_inode(fs, dir);   // keep any indirect block that was added
+        return ret == -EFBIG ? -ENOSPC : ret;
+    }
+    memset(buffer, 0, BLOCK_SIZE);
+    file_entry *entry = (file_entry *) buffer;
+    entry->inum = inum;
+    strncpy(entry->file_name, name, sizeof(entry->file_name) - 1);
+    meta_write(fs, block, buffer);
+    dir->size = (off_t) (nblocks + 1) * BLOCK_SIZE;
+    return write_inode(fs, dir);
+}
+
+int dir_remove_entry(sfs_fs *fs, inode *dir, const char *name) {
+    return dir_set_entry(fs, dir, name, 0);
+}
+
+/**
+ * Point the entry name of dir at inum in place, or clear it if inum is 0.
+ * Nothing else in the directory moves, so rename swaps a name over with a
+ * single block write.
+ */
+int dir_set_entry(sfs_fs *fs, inode *dir, const char *name, unsigned int inum) {
+    char buffer[BLOCK_SIZE];
+    uint64_t i, block;
+    int j;
+    for (i = 0; i < (uint64_t) dir->size / BLOCK_SIZE; i++) {
+        if (inode_bmap(fs, dir, i, &block) < 0 || block == 0) {
+            continue;
+        }
+        meta_read(fs, block, buffer);
+        for (j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            file_entry *entry = (file_entry *) &buffer[j * FILE_ENTRY_SIZE];
+            if (entry->inum != 0 && strcmp(entry->file_name, name) == 0) {
+                if (inum == 0) {
+                    memset(entry, 0, FILE_ENTRY_SIZE);
+                } else {
+                    entry->inum = inum;
                 }
+                meta_write(fs, block, buffer);
+                return 0;
             }
         }
     }
+    return -ENOENT;
+}
+
+/** A directory is empty when it holds nothing but "." and ".." */
+int dir_is_empty(sfs_fs *fs, const inode *dir) {
+    char buffer[BLOCK_SIZE];
+    uint64_t i, block;
+    int j;
+    for (i = 0; i < (uint64_t) dir->size / BLOCK_SIZE; i++) {
+        if (inode_bmap(fs, dir, i, &block) < 0 || block == 0) {
+            continue;
+        }
+        meta_read(fs, block, buffer);
+        for (j = 0; j < ENTRIES_PER_BLOCK; j++) {
+            file_entry *entry = (file_entry *) &buffer[j * FILE_ENTRY_SIZE];
+            if (entry->inum != 0 && strcmp(entry->file_name, ".") != 0
+                && strcmp(entry->file_name, "..") != 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Free a block, mapping file blocks from base on, and, for an indirect
+ * block, everything it points to. The run of a compressed cluster goes
+ * with the pointer of its first block.
+ */
+static void free_tree(sfs_fs *fs, inode *ino, uint64_t block, int depth, uint64_t base) {
+    if (depth > 0) {
+        uint64_t pointers[POINTERS_PER_BLOCK];
+        uint64_t span = tree_span(depth - 1);
+        unsigned int i;
+        meta_read(fs, block, pointers);
+        for (i = 0; i < POINTERS_PER_BLOCK; i++) {
+            if (pointers[i] != 0) {
+                free_tree(fs, ino, pointers[i], depth - 1, base + i * span);
+            }
+        }
+    } else if (block & BMAP_COMPRESSED) {
+        if (base % COMPRESS_CLUSTER_BLOCKS == 0) {
+            release_blocks(fs, block & BMAP_BLOCK_MASK, BMAP_RUN_BLOCKS(block));
+            ino->blocks_number -= BMAP_RUN_BLOCKS(block);
+        }
+        return;
+    }
+    release_block(fs, block);
+    ino->blocks_number--;
+}
+
+/**
+ * Free the part of the tree rooted at *slot, which maps file blocks from
+ * base on, that lies in file blocks first to end, and any pointer block
+ * left with nothing under it
+ * @return 1 if *slot was cleared
+ */
+static int punch_tree(sfs_fs *fs, inode *ino, uint64_t *slot, int depth, uint64_t base, uint64_t first, uint64_t end) {
+    uint64_t span = tree_span(depth);
+    if (*slot == 0 || base >= end || base + span <= first) {
+        return 0;
+    }
+    if (base >= first && base + span <= end) {
+        free_tree(fs, ino, *slot, depth, base);
+        *slot = 0;
+        return 1;
+    }
+    uint64_t pointers[POINTERS_PER_BLOCK];
+    unsigned int i;
+    int changed = 0, empty = 1;
+    span /= POINTERS_PER_BLOCK;
+    meta_read(fs, *slot, pointers);
+    for (i = 0; i < POINTERS_PER_BLOCK; i++) {
+        changed |= punch_tree(fs, ino, &pointers[i], depth - 1, base + i * span, first, end);
+        empty &= pointers[i] == 0;
+    }
+    if (changed && empty) {
+        release_block(fs, *slot);
+        ino->blocks_number--;
+        *slot = 0;
+        return 1;
+    }
+    if (changed) {
+        meta_write(fs, *slot, pointers);
+    }
     return 0;
 }
 
-unsigned int assign_inode_number() {
+/**
+ * Free the blocks of ino from file block first up to end, leaving a hole.
+ * A compressed file must be cut at cluster boundaries. The caller writes
+ * the inode back.
+ */
+void punch_blocks(sfs_fs *fs, inode *ino, uint64_t first, uint64_t end) {
+    unsigned int i;
+    for (i = 0; i < DIRECT_BLOCKS; i++) {
+        punch_tree(fs, ino, &ino->block_pointers[i], 0, i, first, end);
+    }
+    punch_tree(fs, ino, &ino->indirect, 1, DIRECT_BLOCKS, first, end);
+    punch_tree(fs, ino, &ino->double_indirect, 2, DIRECT_BLOCKS + tree_span(1), first, end);
+    punch_tree(fs, ino, &ino->triple_indirect, 3, DIRECT_BLOCKS + tree_span(1) + tree_span(2), first, end);
+}
+
+/**
+ * punch_blocks for a range that may map more blocks than one transaction
+ * should free: JOURNAL_SPLIT_BLOCKS at a time, skipping holes, with
+ * journal_split in between. Caller holds fs->lock exclusively.
+ * @return 0, or the error that stopped the journal
+ */
+int punch_blocks_split(sfs_fs *fs, inode *ino, uint64_t first, uint64_t end) {
+    uint64_t found, stop;
+    int ret = 0;
+    while (ret == 0 && first < end && inode_seek(fs, ino, first, end, SEEK_MAPPED, &found)) {
+        // Whole clusters of a compressed file
+        found -= found % COMPRESS_CLUSTER_BLOCKS;
+        first = found > first ? found : first;
+        stop = found + JOURNAL_SPLIT_BLOCKS < end ? found + JOURNAL_SPLIT_BLOCKS : end;
+        punch_blocks(fs, ino, first, stop);
+        ret = journal_split(fs, ino);
+        first = stop;
+    }
+    return ret;
+}
+
+/**
+ * Move the inline data of a file out to its first block, so that it can
+ * grow past INODE_INLINE_SIZE. The caller writes the inode back.
+ */
+int inode_uninline(sfs_fs *fs, inode *ino) {
+    unsigned char data[INODE_INLINE_SIZE];
     char buffer[BLOCK_SIZE];
-    unsigned int block_offset, byte_offset, bit_offset = 0;
-    for (block_offset = 0; block_offset < sb->inode_bitmap_blocks; block_offset++) {
-        block_read(sb->inode_bitmap_begin + block_offset, buffer);
+    uint64_t block;
+    if (!(ino->flags & INODE_INLINE_DATA)) {
+        return 0;
+    }
+    memcpy(data, ino->inline_data, INODE_INLINE_SIZE);
+    memset(ino->inline_data, 0, INODE_INLINE_SIZE);
+    ino->flags &= ~INODE_INLINE_DATA;
+    if (ino->size == 0) {
+        return 0;
+    }
+    int ret = inode_bmap_alloc(fs, ino, 0, &block);
+    if (ret < 0) {
+        memcpy(ino->inline_data, data, INODE_INLINE_SIZE);
+        ino->flags |= INODE_INLINE_DATA;
+        return ret;
+    }
+    memset(buffer, 0, BLOCK_SIZE);
+    memcpy(buffer, data, (size_t) ino->size);
+    return data_write(fs, block, buffer) == BLOCK_SIZE ? 0 : -EIO;
+}
+
+/**
+ * Take n contiguous free slots in a fragment block, or in a new shared
+ * block if none has room
+ * @return 0, -ENOSPC or -ENOMEM
+ */
+static int frag_alloc(sfs_fs *fs, unsigned int n, unsigned int *entry, unsigned int *slot) {
+    superblock *sb = &fs->sb;
+    unsigned int mask = (1U << n) - 1, full = (1U << FRAGS_PER_BLOCK) - 1;
+    unsigned int f, s, hole = sb->frag_blocks, hint = sb->frag_blocks;
+    for (f = fs->frag_hint; f < sb->frag_blocks; f++) {
+        frag_block *fb = &fs->frags[f];
+        if (fb->block != 0 && fb->used == full) continue;
+        if (hint == sb->frag_blocks) hint = f;
+        if (fb->block == 0) {
+            if (hole == sb->frag_blocks) hole = f;
+            continue;
+        }
+        for (s = 0; s + n <= FRAGS_PER_BLOCK; s++) {
+            if (!(fb->used & mask << s)) {
+                fs->frag_hint = hint;
+                fb->used |= mask << s;
+                *entry = f;
+                *slot = s;
+                return write_frag_entry(fs, f);
+            }
+        }
+    }
+    fs->frag_hint = hint;
+
+    // Every shared block is too full: reuse a given-back entry, or append one
+    f = hole;
+    if (f == sb->frag_blocks && frag_index_reserve(fs, f + 1) < 0) {
+        return -ENOMEM;
+    }
+    uint64_t block = assign_block(fs);
+    if (block == 0) {
+        return -ENOSPC;
+    }
+    fs->frags[f].block = block;
+    fs->frags[f].used = mask;
+    if (f == sb->frag_blocks) {
+        sb->frag_blocks++;
+        write_superblock(fs);
+    }
+    *entry = f;
+    *slot = 0;
+    return write_frag_entry(fs, f);
+}
+
+/** Free n slots of a fragment block, giving the block back once it is empty */
+static void frag_free(sfs_fs *fs, unsigned int entry, unsigned int slot, unsigned int n) {
+    frag_block *fb = &fs->frags[entry];
+    fb->used &= ~(((1U << n) - 1) << slot);
+    if (fb->used == 0) {
+        release_block(fs, fb->block);
+        fb->block = 0;
+    }
+    if (entry < fs->frag_hint) {
+        fs->frag_hint = entry;
+    }
+    write_frag_entry(fs, entry);
+}
+
+/**
+ * Move the partial last block of a regular file into slots of a shared
+ * fragment block and give the block back. Nothing is done for a file that
+ * is inline, compressed or already packed, that ends on a block boundary
+ * or in a hole, whose tail is longer than TAIL_PACK_MAX, or that has
+ * blocks reserved past its last one.
+ * @return 1 if the tail was packed and the caller must write the inode
+ *         back, 0 if there was nothing to do, or -errno
+ */
+int inode_pack_tail(sfs_fs *fs, inode *ino) {
+    unsigned int tail = (unsigned int) (ino->size % BLOCK_SIZE);
+    unsigned int n = (tail + FRAG_SIZE - 1) / FRAG_SIZE, entry, slot;
+    uint64_t last = (uint64_t) ino->size / BLOCK_SIZE, block, found;
+    char buffer[BLOCK_SIZE], shared[BLOCK_SIZE];
+    if (ino->type != REGULAR_FILE || (ino->flags & (INODE_INLINE_DATA | INODE_TAIL_PACKED | INODE_COMPRESSED))
+        || tail == 0 || tail > TAIL_PACK_MAX) {
+        return 0;
+    }
+    if (inode_bmap(fs, ino, last, &block) < 0 || block == 0 || BMAP_IS_UNWRITTEN(block)) {
+        return 0;
+    }
+    // fallocate with FALLOC_FL_KEEP_SIZE took those for the file to grow into
+    if (inode_seek(fs, ino, last + 1, MAX_FILE_BLOCKS, SEEK_MAPPED, &found)) {
+        return 0;
+    }
+    int ret = frag_alloc(fs, n, &entry, &slot);
+    if (ret < 0) {
+        return ret;
+    }
+    // Only this file's slots change; the bytes past EOF copied along are zero
+    if (data_read(fs, block, buffer) < 0 || meta_read(fs, fs->frags[entry].block, shared) < 0) {
+        frag_free(fs, entry, slot, n);
+        return -EIO;
+    }
+    memcpy(&shared[slot * FRAG_SIZE], buffer, n * FRAG_SIZE);
+    if (meta_write(fs, fs->frags[entry].block, shared) != BLOCK_SIZE) {
+        frag_free(fs, entry, slot, n);
+        return -EIO;
+    }
+    truncate_blocks(fs, ino, (off_t) last * BLOCK_SIZE);
+    ino->flags |= INODE_TAIL_PACKED;
+    ino->tail_frag = entry;
+    ino->tail_slot = slot;
+    log_debug(LOG_CAT_ALLOC, "inode_pack_tail: inode %u, %u bytes in fragment block %u slot %u\n",
+              ino->inum, tail, entry, slot);
+    return 1;
+}
+
+/** Give up the slots of a packed tail, whose bytes are no longer needed */
+static void inode_drop_tail(sfs_fs *fs, inode *ino) {
+    unsigned int n = (unsigned int) (ino->size % BLOCK_SIZE + FRAG_SIZE - 1) / FRAG_SIZE;
+    frag_free(fs, ino->tail_frag, ino->tail_slot, n);
+    ino->flags &= ~INODE_TAIL_PACKED;
+    ino->tail_frag = 0;
+    ino->tail_slot = 0;
+}
+
+/**
+ * Put a packed tail back into a block of its own, before the last block
+ * of the file is rewritten or the file grows. The caller writes the inode
+ * back.
+ */
+int inode_unpack_tail(sfs_fs *fs, inode *ino) {
+    char buffer[BLOCK_SIZE], shared[BLOCK_SIZE];
+    uint64_t block;
+    if (!(ino->flags & INODE_TAIL_PACKED)) {
+        return 0;
+    }
+    if (meta_read(fs, fs->frags[ino->tail_frag].block, shared) < 0) {
+        return -EIO;
+    }
+    memset(buffer, 0, BLOCK_SIZE);
+    memcpy(buffer, &shared[ino->tail_slot * FRAG_SIZE], (size_t) (ino->size % BLOCK_SIZE));
+    int ret = inode_bmap_alloc(fs, ino, (uint64_t) ino->size / BLOCK_SIZE, &block);
+    if (ret < 0) {
+        return ret;
+    }
+    if (data_write(fs, block, buffer) != BLOCK_SIZE) {
+        return -EIO;
+    }
+    inode_drop_tail(fs, ino);
+    return 0;
+}
+
+/**
+ * Free the blocks of ino that lie entirely beyond newsize. The caller
+ * sets ino->size and writes the inode back.
+ */
+int truncate_blocks(sfs_fs *fs, inode *ino, off_t newsize) {
+    uint64_t keep = ((uint64_t) newsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t block;
+    if (ino->flags & INODE_INLINE_DATA) {
+        if (newsize <= INODE_INLINE_SIZE) {
+            // Bytes past EOF stay zero, as in the last block of a file
+            memset(&ino->inline_data[newsize], 0, INODE_INLINE_SIZE - (size_t) newsize);
+            return 0;
+        }
+        int ret = inode_uninline(fs, ino);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (ino->flags & INODE_TAIL_PACKED) {
+        // A tail cut off entirely only needs its slots freed
+        if (newsize <= ino->size - ino->size % BLOCK_SIZE) {
+            inode_drop_tail(fs, ino);
+        } else {
+            int ret = inode_unpack_tail(fs, ino);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    if ((ino->flags & INODE_COMPRESSED) && newsize < ino->size) {
+        int ret = compress_truncate(fs, ino, newsize);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    punch_blocks(fs, ino, keep, UINT64_MAX);
+    // Zero the tail of a now-partial last block, so a later extension
+    // reads zeros rather than stale data; compress_truncate did that for
+    // a compressed one
+    if (keep > 0 && newsize % BLOCK_SIZE != 0
+        && inode_bmap(fs, ino, keep - 1, &block) == 0 && block != 0 && !(block & (BMAP_COMPRESSED | BMAP_UNWRITTEN))
+        && dedup_unshare(fs, ino, keep - 1, &block) == 0) {
+        char buffer[BLOCK_SIZE];
+        data_read(fs, block, buffer);
+        memset(&buffer[newsize % BLOCK_SIZE], 0, BLOCK_SIZE - newsize % BLOCK_SIZE);
+        data_write(fs, block, buffer);
+    }
+    return 0;
+}
+
+/**
+ * Find the first clear bit below nbits in the bitmap that starts at block
+ * begin, set it and write the bitmap block back
+ * @return the bit, or -1 if every bit is set
+ */
+static long bitmap_alloc(sfs_fs *fs, uint64_t begin, unsigned int nbits) {
+    unsigned char buffer[BLOCK_SIZE];
+    unsigned int block_offset, byte_offset, bit_offset;
+    for (block_offset = 0; block_offset * BITS_PER_BLOCK < nbits; block_offset++) {
+        meta_read(fs, begin + block_offset, buffer);
         for (byte_offset = 0; byte_offset < BLOCK_SIZE; byte_offset++) {
-            unsigned char c = (unsigned char) buffer[byte_offset];
+            unsigned char c = buffer[byte_offset];
+            if (c == 0xFF) continue;
             for (bit_offset = 0; bit_offset < 8; bit_offset++) {
-                if (c == 128 >> bit_offset) {
-                    unsigned int ret = block_offset * BLOCK_SIZE * 8 + byte_offset * 8 + bit_offset;
+                if (!(c & (128 >> bit_offset))) {
+                    unsigned int ret = block_offset * BITS_PER_BLOCK + byte_offset * 8 + bit_offset;
+                    if (ret >= nbits) return -1;
+                    buffer[byte_offset] = c | (128 >> bit_offset);
+                    meta_write(fs, begin + block_offset, buffer);
                     return ret;
                 }
             }
         }
     }
+    return -1;
+}
+
+/**
+ * Like bitmap_alloc, but find and set a run of count clear bits starting
+ * at a multiple of count; count is a multiple of 8 no larger than a block
+ */
+static long bitmap_alloc_run(sfs_fs *fs, uint64_t begin, unsigned int nbits, unsigned int count) {
+    unsigned char buffer[BLOCK_SIZE];
+    unsigned int block_offset, byte_offset, i, nbytes = count / 8;
+    for (block_offset = 0; block_offset * BITS_PER_BLOCK < nbits; block_offset++) {
+        meta_read(fs, begin + block_offset, buffer);
+        for (byte_offset = 0; byte_offset + nbytes <= BLOCK_SIZE; byte_offset += nbytes) {
+            for (i = 0; i < nbytes && buffer[byte_offset + i] == 0; i++);
+            if (i < nbytes) continue;
+            unsigned int ret = block_offset * BITS_PER_BLOCK + byte_offset * 8;
+            if (ret + count > nbits) return -1;
+            memset(&buffer[byte_offset], 0xFF, nbytes);
+            meta_write(fs, begin + block_offset, buffer);
+            return ret;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Like bitmap_alloc, but find and set count contiguous clear bits, at any
+ * position within one bitmap block
+ */
+static long bitmap_alloc_span(sfs_fs *fs, uint64_t begin, unsigned int nbits, unsigned int count) {
+    unsigned char buffer[BLOCK_SIZE];
+    unsigned int block_offset, bit, run;
+    for (block_offset = 0; block_offset * BITS_PER_BLOCK < nbits; block_offset++) {
+        meta_read(fs, begin + block_offset, buffer);
+        for (bit = 0, run = 0; bit < BITS_PER_BLOCK; bit++) {
+            if (run == 0 && bit % 8 == 0 && buffer[bit / 8] == 0xFF) {
+                bit += 7;
+                continue;
+            }
+            if (buffer[bit / 8] & (128 >> (bit % 8))) {
+                run = 0;
+                continue;
+            }
+            if (++run < count) continue;
+            unsigned int ret = block_offset * BITS_PER_BLOCK + bit + 1 - count;
+            if (ret + count > nbits) return -1;
+            for (; run > 0; run--, bit--) {
+                buffer[bit / 8] |= 128 >> (bit % 8);
+            }
+            meta_write(fs, begin + block_offset, buffer);
+            return ret;
+        }
+    }
+    return -1;
+}
+
+/** Clear count bits from index on, one read-modify-write per bitmap block */
+static void bitmap_clear(sfs_fs *fs, uint64_t begin, unsigned int index, unsigned int count) {
+    unsigned char buffer[BLOCK_SIZE];
+    while (count > 0) {
+        uint64_t block = begin + index / BITS_PER_BLOCK;
+        meta_read(fs, block, buffer);
+        do {
+            buffer[index % BITS_PER_BLOCK / 8] &= ~(128 >> (index % 8));
+            index++;
+            count--;
+        } while (count > 0 && index % BITS_PER_BLOCK != 0);
+        meta_write(fs, block, buffer);
+    }
+}
+
+/**
+ * Find a free data block, mark it used and return its block number, or 0
+ * if the disk is full
+ */
+uint64_t assign_block(sfs_fs *fs) {
+    superblock *sb = &fs->sb;
+    unsigned int g;
+    if (sb->free_blocks == 0) return 0;
+    for (g = 0; g < sb->group_count; g++) {
+        group_desc *gd = &fs->groups[g];
+        if (gd->free_blocks == 0) continue;
+        long bit = bitmap_alloc(fs, gd->block_bitmap, sb->blocks_per_group);
+        if (bit < 0) {
+            log_warn(LOG_CAT_ALLOC, "assign_block: group %u claims %u free blocks but is full\n",
+                     g, gd->free_blocks);
+            continue;
+        }
+        gd->free_blocks--;
+        sb->free_blocks--;
+        write_group_desc(fs, g);
+        return (uint64_t) g * sb->blocks_per_group + (uint64_t) bit;
+    }
+    log_warn(LOG_CAT_ALLOC, "assign_block: no free data blocks\n");
+    return 0;
+}
+
+/**
+ * Find count contiguous free blocks, aligned to count within their group,
+ * mark them used and return the first, or 0 if there is no such run
+ */
+static uint64_t assign_blocks(sfs_fs *fs, unsigned int count) {
+    superblock *sb = &fs->sb;
+    unsigned int g;
+    for (g = 0; g < sb->group_count; g++) {
+        group_desc *gd = &fs->groups[g];
+        if (gd->free_blocks < count) continue;
+        long bit = bitmap_alloc_run(fs, gd->block_bitmap, sb->blocks_per_group, count);
+        if (bit < 0) continue;
+        gd->free_blocks -= count;
+        sb->free_blocks -= count;
+        write_group_desc(fs, g);
+        return (uint64_t) g * sb->blocks_per_group + (uint64_t) bit;
+    }
+    log_warn(LOG_CAT_ALLOC, "assign_blocks: no run of %u free blocks\n", count);
+    return 0;
+}
+
+/**
+ * Find count contiguous free blocks at any alignment, within one bitmap
+ * block, mark them used and return the first, or 0 if there is no such run
+ */
+uint64_t assign_block_run(sfs_fs *fs, unsigned int count) {
+    superblock *sb = &fs->sb;
+    unsigned int g;
+    if (sb->free_blocks < count) return 0;
+    for (g = 0; g < sb->group_count; g++) {
+        group_desc *gd = &fs->groups[g];
+        if (gd->free_blocks < count) continue;
+        long bit = bitmap_alloc_span(fs, gd->block_bitmap, sb->blocks_per_group, count);
+        if (bit < 0) continue;
+        gd->free_blocks -= count;
+        sb->free_blocks -= count;
+        write_group_desc(fs, g);
+        return (uint64_t) g * sb->blocks_per_group + (uint64_t) bit;
+    }
     return 0;
 }
 
+/**
+ * Mark one particular block used
+ * @return 0, or -EBUSY if it already is
+ */
+int claim_block(sfs_fs *fs, uint64_t block) {
+    unsigned char buffer[BLOCK_SIZE];
+    unsigned int g = (unsigned int) (block / fs->sb.blocks_per_group);
+    unsigned int bit = (unsigned int) (block % fs->sb.blocks_per_group);
+    uint64_t bitmap_block = fs->groups[g].block_bitmap + bit / BITS_PER_BLOCK;
+    unsigned char mask = 128 >> (bit % 8);
+    meta_read(fs, bitmap_block, buffer);
+    if (buffer[bit % BITS_PER_BLOCK / 8] & mask) {
+        return -EBUSY;
+    }
+    buffer[bit % BITS_PER_BLOCK / 8] |= mask;
+    meta_write(fs, bitmap_block, buffer);
+    fs->groups[g].free_blocks--;
+    fs->sb.free_blocks--;
+    write_group_desc(fs, g);
+    return 0;
+}
+
+/**
+ * Count the used blocks among count blocks from block on; the range is a
+ * multiple of 8 blocks, aligned to 8, within one bitmap block
+ */
+unsigned int count_used_blocks(sfs_fs *fs, uint64_t block, unsigned int count) {
+    unsigned char buffer[BLOCK_SIZE];
+    unsigned int g = (unsigned int) (block / fs->sb.blocks_per_group);
+    unsigned int bit = (unsigned int) (block % fs->sb.blocks_per_group), i, used = 0;
+    meta_read(fs, fs->groups[g].block_bitmap + bit / BITS_PER_BLOCK, buffer);
+    for (i = bit % BITS_PER_BLOCK / 8; i < (bit % BITS_PER_BLOCK + count) / 8; i++) {
+        used += (unsigned int) __builtin_popcount(buffer[i]);
+    }
+    return used;
+}
+
+/** Mark count contiguous blocks, all in one group, free for reuse at once */
+void reclaim_blocks(sfs_fs *fs, uint64_t block, unsigned int count) {
+    unsigned int g = (unsigned int) (block / fs->sb.blocks_per_group);
+    bitmap_clear(fs, fs->groups[g].block_bitmap, (unsigned int) (block % fs->sb.blocks_per_group), count);
+    fs->groups[g].free_blocks += count;
+    fs->sb.free_blocks += count;
+    write_group_desc(fs, g);
+}
+
+/**
+ * Give back count contiguous blocks, all in one group. With the journal on they stay allocated
+ * until the transaction that frees them has committed, so they cannot be overwritten while the
+ * metadata on disk may still point at them.
+ */
+void release_blocks(sfs_fs *fs, uint64_t block, unsigned int count) {
+    if (fs->journal == NULL || journal_defer_free(fs, block, count) < 0) {
+        discard_blocks(fs, block, count);
+        reclaim_blocks(fs, block, count);
+    }
+}
+
+/**
+ * With -o discard, punch count blocks that are about to be freed out of
+ * the image, if there are enough of them. They must not be reusable yet.
+ */
+void discard_blocks(sfs_fs *fs, uint64_t block, unsigned int count) {
+    if (!fs->opts.discard || count < DISCARD_MIN_BLOCKS) {
+        return;
+    }
+    int ret = block_discard(fs->disk, block, count);
+    if (ret < 0) {
+        log_warn(LOG_CAT_ALLOC, "discard_blocks: %u blocks at %llu: %s\n",
+                 count, (unsigned long long) block, strerror(-ret));
+        return;
+    }
+    stats_add(STAT_DISCARD_BLOCKS, count);
+}
+
+/**
+ * Discard every run of at least min free blocks of group g between blocks
+ * start and end, as fstrim does. Caller holds fs->lock exclusively, so
+ * that none of them is taken meanwhile.
+ * @return the blocks discarded, or -errno
+ */
+long trim_group(sfs_fs *fs, unsigned int g, uint64_t start, uint64_t end, unsigned int min) {
+    unsigned char buffer[BLOCK_SIZE];
+    uint64_t base = (uint64_t) g * fs->sb.blocks_per_group, run = 0, bit;
+    uint64_t first = start > base ? start - base : 0;
+    uint64_t last = end - base < fs->sb.blocks_per_group ? end - base : fs->sb.blocks_per_group;
+    long trimmed = 0;
+    if (last > fs->sb.total_blocks - base) {
+        last = fs->sb.total_blocks - base;
+    }
+    for (bit = first; bit <= last; bit++) {
+        if (bit < last && (bit == first || bit % BITS_PER_BLOCK == 0)) {
+            meta_read(fs, fs->groups[g].block_bitmap + bit / BITS_PER_BLOCK, buffer);
+        }
+        // A run ends at a used block, or at the end of the range
+        if (bit < last && !(buffer[bit % BITS_PER_BLOCK / 8] & (128 >> (bit % 8)))) {
+            run++;
+            continue;
+        }
+        if (run >= min && run > 0) {
+            int ret = block_discard(fs->disk, base + bit - run, run);
+            if (ret < 0) {
+                return ret;
+            }
+            trimmed += (long) run;
+        }
+        run = 0;
+    }
+    stats_add(STAT_DISCARD_BLOCKS, (uint64_t) trimmed);
+    return trimmed;
+}
+
+/** Drop a pointer to a block, giving the block back once no other pointer shares it */
+void release_block(sfs_fs *fs, uint64_t block) {
+    if (block == 0) return;
+    block &= ~BMAP_UNWRITTEN;
+    if (fs->dedup != NULL && dedup_ref_put(fs, block) > 0) return;
+    release_blocks(fs, block, 1);
+}
+
+/** Take a free slot in chunk c, which must have one */
+static unsigned int chunk_take_slot(sfs_fs *fs, unsigned int c) {
+    unsigned int slot = (unsigned int) __builtin_ctzll(~fs->chunks[c].used);
+    fs->chunks[c].used |= 1ULL << slot;
+    fs->sb.used_inodes++;
+    write_chunk_entry(fs, c);
+    return c * INODE_CHUNK_INODES + slot;
+}
+
+/**
+ * Find a free inode number and mark it used, or return 0 if there is none
+ *
+ * The chunk of goal (usually the parent directory) is tried first, so
+ * the inodes of one directory are read from the same few blocks. When
+ * every chunk is full a new one is carved out of the data space.
+ */
+unsigned int assign_inode_number(sfs_fs *fs, unsigned int goal) {
+    superblock *sb = &fs->sb;
+    unsigned int c, hole = sb->inode_chunks;
+
+    c = goal / INODE_CHUNK_INODES;
+    if (c < sb->inode_chunks && fs->chunks[c].start != 0 && ~fs->chunks[c].used != 0) {
+        return chunk_take_slot(fs, c);
+    }
+    for (c = fs->chunk_hint; c < sb->inode_chunks; c++) {
+        if (fs->chunks[c].start == 0) {
+            if (hole == sb->inode_chunks) hole = c;
+        } else if (~fs->chunks[c].used != 0) {
+            fs->chunk_hint = c;
+            return chunk_take_slot(fs, c);
+        }
+    }
+    fs->chunk_hint = hole;
+
+    // Every chunk is full: reuse a given-back index entry, or append one
+    c = hole;
+    if (c == sb->inode_chunks
+        && (c >= UINT_MAX / INODE_CHUNK_INODES || chunk_index_reserve(fs, c + 1) < 0)) {
+        log_warn(LOG_CAT_ALLOC, "assign_inode_number: out of inodes\n");
+        return 0;
+    }
+    uint64_t start = assign_blocks(fs, INODE_CHUNK_BLOCKS);
+    if (start == 0) {
+        log_warn(LOG_CAT_ALLOC, "assign_inode_number: no space for an inode chunk\n");
+        return 0;
+    }
+    fs->chunks[c].start = start;
+    fs->chunks[c].used = 0;
+    if (c == sb->inode_chunks) {
+        // The index entry must never be written beyond what the superblock covers
+        sb->inode_chunks++;
+        write_superblock(fs);
+    }
+    log_debug(LOG_CAT_ALLOC, "assign_inode_number: new chunk %u at block %llu\n",
+              c, (unsigned long long) start);
+    return chunk_take_slot(fs, c);
+}
+
+/**
+ * Free an inode number. A chunk left with no inodes in use goes back to
+ * the data space (the first chunk, which holds the root, never does).
+ */
+void release_inode_number(sfs_fs *fs, unsigned int inum) {
+    unsigned int c = inum / INODE_CHUNK_INODES;
+    if (inum == 0 || c >= fs->sb.inode_chunks) return;
+    fs->chunks[c].used &= ~(1ULL << (inum % INODE_CHUNK_INODES));
+    fs->sb.used_inodes--;
+    if (fs->chunks[c].used == 0 && c != 0) {
+        release_blocks(fs, fs->chunks[c].start, INODE_CHUNK_BLOCKS);
+        fs->chunks[c].start = 0;
+    }
+    if (c < fs->chunk_hint) {
+        fs->chunk_hint = c;
+    }
+    write_chunk_entry(fs, c);
+}
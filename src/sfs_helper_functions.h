@@ -1,24 +1,168 @@
 //
 // Created by bh398 on 12/1/18.
 //
+// Internal helpers shared by the libsfs core: superblock, bitmaps,
+// inode chunks and directory blocks.  Every helper works on an explicit
+// sfs_fs; callers hold fs->lock as documented in libsfs.c.
+//
 
 #ifndef ASSIGNMENT3_SFS_HELPER_FUNCTIONS_H
 #define ASSIGNMENT3_SFS_HELPER_FUNCTIONS_H
 
-#endif //ASSIGNMENT3_SFS_HELPER_FUNCTIONS_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libsfs.h"
+#include "sfs.h"
+
+// Freed runs shorter than this are not worth a discard: the host frees
+// whole pages, and a later trim picks them up with their neighbours
+#define DISCARD_MIN_BLOCKS 8
+
+// Timestamps kept in memory only are written back at the latest this
+// long after they changed, so a crash loses at most this much of them
+#define LAZYTIME_EXPIRE_SECS (60 * 60)
+
+// inode_seek: any block in the block map, reserved ones included
+#define SEEK_MAPPED 2
+
+/**
+ * An inode that is open through at least one libsfs_file.  Unlinking an
+ * open inode only removes its name; the inode and its blocks are freed
+ * when the last handle is closed.
+ *
+ * An open inode may also have timestamps newer than the ones on disk
+ * (lazytime): read_inode hands them out and write_inode stores them.  An
+ * entry with such timestamps outlives its last handle until they are
+ * written back.
+ */
+typedef struct open_inode {
+    struct open_inode *next;
+    unsigned int inum;
+    unsigned int refs;
+    int unlinked;
+    time_t atime, mtime, ctime;
+    time_t times_dirty;          // when the timestamps first changed in memory, 0 if they did not
+} open_inode;
+
+struct sfs_fs {
+    int disk;
+    superblock sb;
+    group_desc *groups;          // the group descriptor table, kept in memory
+    inode_chunk *chunks;         // the inode chunk index, kept in memory
+    inode chunk_index;           // the block map of the chunk index, saved in the superblock
+    frag_block *frags;           // the fragment index, kept in memory
+    unsigned int frag_capacity;
+    unsigned int frag_hint;      // no fragment block below this has a free slot
+    inode frag_index;            // the block map of the fragment index
+    unsigned int chunk_capacity; // entries allocated in chunks
+    block_ref *refs;             // the block reference index, kept in memory
+    unsigned int ref_capacity;
+    inode ref_index;             // the block map of the block reference index
+    unsigned int chunk_hint;     // no chunk below this has a free inode
+    libsfs_options opts;
+    pthread_rwlock_t lock;       // shared for lookups and reads, exclusive for updates
+    pthread_mutex_t open_lock;   // protects open_inodes
+    open_inode *open_inodes;
+    atomic_uint dirty_times;     // open inodes with times_dirty set, so that most lookups skip the table
+    struct journal *journal;     // NULL until mounted, then metadata goes through it
+    struct lfs *lfs;             // non-NULL in log-structured mode, see lfs.h
+    struct dedup *dedup;         // lookup tables over refs, NULL until mounted
+    struct reclaim *reclaim;     // the thread freeing orphans, see reclaim.h
+};
+
+struct libsfs_file {
+    sfs_fs *fs;
+    unsigned int inum;
+    int flags;
+};
+
+int format_disk(sfs_fs *fs, libsfs_format_options *opts);
+
+int read_superblock(sfs_fs *fs);
+
+int write_superblock(sfs_fs *fs);
+
+int write_group_desc(sfs_fs *fs, unsigned int g);
+
+int ref_index_reserve(sfs_fs *fs, unsigned int count);
+
+int write_ref_entry(sfs_fs *fs, unsigned int e);
+
+int read_inode(sfs_fs *fs, unsigned int inum, inode *ino);
+
+int write_inode(sfs_fs *fs, const inode *ino);
+
+int inode_times_defer(sfs_fs *fs, const inode *ino);
+
+int inode_times_dirty(sfs_fs *fs, unsigned int inum);
+
+int inode_is_open(sfs_fs *fs, unsigned int inum);
+
+void inode_times_flush(sfs_fs *fs, unsigned int inum, time_t dirtied_before);
+
+void fill_stat(const inode *ino, struct stat *st);
+
+void directory_block_init(sfs_fs *fs, uint64_t block_id, unsigned int inum, unsigned int parent_inum);
 
+int inode_bmap(sfs_fs *fs, const inode *ino, uint64_t index, uint64_t *block);
 
-#define INODE_BITMAP_UPDATE 0
-#define DATA_BITMAP_UPDATE 1
+int inode_bmap_alloc(sfs_fs *fs, inode *ino, uint64_t index, uint64_t *block);
 
+int inode_bmap_set(sfs_fs *fs, inode *ino, uint64_t index, uint64_t *block);
 
-void update_bitmap(unsigned int index, unsigned int mode);
+int inode_bmap_store(sfs_fs *fs, inode *ino, uint64_t index, uint64_t *pointer);
 
-void directory_block_init(unsigned int block_id, unsigned int inum, unsigned int parent_inum);
+int inode_seek(sfs_fs *fs, const inode *ino, uint64_t from, uint64_t end, int data, uint64_t *found);
 
-inode* resolute_path(char *path, inode *current_dir);
+int retrieve_file(sfs_fs *fs, const char *filename, const inode *current_dir, unsigned int *inum);
 
-unsigned int assign_block();
+int resolute_path(sfs_fs *fs, const char *path, inode *target);
 
-unsigned int assign_inode_number();
+int resolute_parent(sfs_fs *fs, const char *path, inode *parent, char *name);
 
+int dir_add_entry(sfs_fs *fs, inode *dir, const char *name, unsigned int inum);
+
+int dir_remove_entry(sfs_fs *fs, inode *dir, const char *name);
+
+int dir_set_entry(sfs_fs *fs, inode *dir, const char *name, unsigned int inum);
+
+int dir_is_empty(sfs_fs *fs, const inode *dir);
+
+int inode_uninline(sfs_fs *fs, inode *ino);
+
+int inode_pack_tail(sfs_fs *fs, inode *ino);
+
+int inode_unpack_tail(sfs_fs *fs, inode *ino);
+
+void punch_blocks(sfs_fs *fs, inode *ino, uint64_t first, uint64_t end);
+
+int punch_blocks_split(sfs_fs *fs, inode *ino, uint64_t first, uint64_t end);
+
+int truncate_blocks(sfs_fs *fs, inode *ino, off_t newsize);
+
+uint64_t assign_block(sfs_fs *fs);
+
+uint64_t assign_block_run(sfs_fs *fs, unsigned int count);
+
+void release_block(sfs_fs *fs, uint64_t block);
+
+void release_blocks(sfs_fs *fs, uint64_t block, unsigned int count);
+
+void reclaim_blocks(sfs_fs *fs, uint64_t block, unsigned int count);
+
+void discard_blocks(sfs_fs *fs, uint64_t block, unsigned int count);
+
+long trim_group(sfs_fs *fs, unsigned int g, uint64_t start, uint64_t end, unsigned int min);
+
+int claim_block(sfs_fs *fs, uint64_t block);
+
+unsigned int count_used_blocks(sfs_fs *fs, uint64_t block, unsigned int count);
+
+unsigned int assign_inode_number(sfs_fs *fs, unsigned int goal);
+
+void release_inode_number(sfs_fs *fs, unsigned int inum);
+
+#endif //ASSIGNMENT3_SFS_HELPER_FUNCTIONS_H
@@ -0,0 +1,61 @@
+//
+// ioctls understood by files inside an sfs mount.
+//
+// FUSE 2.x has no copy_file_range, and the FICLONE family passes a file
+// descriptor that means nothing in the daemon's process, so the source is
+// named by its path from the root of the mount instead.  Both copy inside
+// the image, sharing whole blocks between the files.
+//
+// Nor does FUSE 2.x pass on lseek with SEEK_DATA/SEEK_HOLE, or fallocate,
+// so those have ioctls of their own too.
+//
+// The kernel keeps its own idea of the destination's size: expect stat to
+// catch up once the cached attributes expire.  Pages the kernel has
+// cached are not dropped either: reopen the file to see a punched hole.
+//
+
+#ifndef SFS_IOCTL_H
+#define SFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define SFS_IOC_PATH_MAX 1024
+
+// Make the file the ioctl is issued on a copy of all of src
+struct sfs_clone_args {
+    char src[SFS_IOC_PATH_MAX];
+};
+
+// Copy length bytes of src at src_offset to dest_offset in the file the
+// ioctl is issued on; copied gets the bytes copied
+struct sfs_copy_range_args {
+    char src[SFS_IOC_PATH_MAX];
+    uint64_t src_offset;
+    uint64_t dest_offset;
+    uint64_t length;
+    uint64_t copied;
+};
+
+// Where the next data (whence SEEK_DATA) or hole (SEEK_HOLE) at or after
+// offset is; offset gets the answer
+struct sfs_seek_args {
+    int64_t offset;
+    int32_t whence;
+    int32_t pad;
+};
+
+// fallocate(2) on the file the ioctl is issued on
+struct sfs_fallocate_args {
+    int32_t mode;
+    int32_t pad;
+    int64_t offset;
+    int64_t length;
+};
+
+#define SFS_IOC_CLONE _IOW('s', 1, struct sfs_clone_args)
+#define SFS_IOC_COPY_RANGE _IOWR('s', 2, struct sfs_copy_range_args)
+#define SFS_IOC_SEEK _IOWR('s', 3, struct sfs_seek_args)
+#define SFS_IOC_FALLOCATE _IOW('s', 4, struct sfs_fallocate_args)
+
+#endif //SFS_IOCTL_H
@@ -0,0 +1,450 @@
+/*
+  sfs-replay: drive a binary trace recorded with -o trace=FILE against
+  a mounted filesystem, or in-process against an image through libsfs,
+  either at the original pace or as fast as possible, with N replay
+  threads.
+
+  usage:  sfs-replay [-t threads] [-m] [-i [-f]] traceFile mountPoint|image
+
+  Records of one original thread always go to the same replay thread,
+  so per-thread ordering is kept.  Per-op latency is reported in the
+  same format as /.sfs-stats.
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libsfs.h"
+#include "stats.h"
+#include "trace.h"
+
+#define REPLAY_MAX_THREADS 256
+#define REPLAY_OPEN_FILES 64
+
+typedef struct replay_entry {
+    trace_record rec;
+    const char *path;       // points into the loaded trace, not terminated
+    const char *path2;      // the same, for ops on two paths
+    size_t seq;             // position in the trace file
+} replay_entry;
+
+typedef struct replay_fd {
+    char path[PATH_MAX];
+    int fd;
+    libsfs_file *file;      // in image mode, instead of fd
+} replay_fd;
+
+typedef struct replay_thread {
+    pthread_t thread;
+    replay_entry **entries;
+    size_t count;
+    size_t cap;
+    unsigned long errors;
+    char *buf;
+    replay_fd fds[REPLAY_OPEN_FILES];
+    int next_fd_slot;
+} replay_thread;
+
+static const char *mount_point;
+static sfs_fs *image_fs = NULL;
+static int max_speed = 0;
+static uint64_t replay_epoch;
+static size_t max_io_size = 0;
+
+static void replay_usage(void) {
+    fprintf(stderr, "usage:  sfs-replay [-t threads] [-m] [-i [-f]] traceFile mountPoint|image\n");
+    fprintf(stderr, "  -t N  replay with N threads (default 1)\n");
+    fprintf(stderr, "  -m    replay at maximum speed instead of the recorded pace\n");
+    fprintf(stderr, "  -i    replay in-process against an image through libsfs\n");
+    fprintf(stderr, "  -f    with -i, format the image before replaying\n");
+    exit(EXIT_FAILURE);
+}
+
+static void replay_full_path(const char *path, uint16_t len, char *out) {
+    if (image_fs != NULL) {
+        snprintf(out, PATH_MAX, "%.*s", (int) len, path);
+    } else {
+        snprintf(out, PATH_MAX, "%s%.*s", mount_point, (int) len, path);
+    }
+}
+
+static int replay_fd_find(replay_thread *t, const char *full) {
+    int i;
+    for (i = 0; i < REPLAY_OPEN_FILES; i++) {
+        if ((t->fds[i].fd >= 0 || t->fds[i].file != NULL) && strcmp(t->fds[i].path, full) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void replay_slot_close(replay_fd *slot) {
+    if (slot->file != NULL) {
+        libsfs_close(slot->file);
+        slot->file = NULL;
+    }
+    if (slot->fd >= 0) {
+        close(slot->fd);
+        slot->fd = -1;
+    }
+}
+
+static void replay_fd_close(replay_thread *t, const char *full) {
+    int i = replay_fd_find(t, full);
+    if (i >= 0) {
+        replay_slot_close(&t->fds[i]);
+    }
+}
+
+static replay_fd *replay_slot_new(replay_thread *t, const char *full) {
+    replay_fd *slot = &t->fds[t->next_fd_slot];
+    t->next_fd_slot = (t->next_fd_slot + 1) % REPLAY_OPEN_FILES;
+    replay_slot_close(slot);
+    strncpy(slot->path, full, PATH_MAX - 1);
+    return slot;
+}
+
+// Cached descriptor for a path, opening it (and evicting round-robin) on a miss
+static int replay_fd_get(replay_thread *t, const char *full, int flags, mode_t mode) {
+    int i = replay_fd_find(t, full);
+    if (i >= 0) {
+        return t->fds[i].fd;
+    }
+    int fd = open(full, flags, mode);
+    if (fd < 0 && (flags & O_ACCMODE) == O_RDWR) {
+        fd = open(full, (flags & ~O_ACCMODE) | O_RDONLY, mode);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    replay_slot_new(t, full)->fd = fd;
+    return fd;
+}
+
+// Image mode counterpart of replay_fd_get
+static libsfs_file *replay_file_get(replay_thread *t, const char *full, int create, mode_t mode) {
+    libsfs_file *file;
+    int i = replay_fd_find(t, full);
+    if (i >= 0) {
+        return t->fds[i].file;
+    }
+    if (create) {
+        if (libsfs_create(image_fs, full, mode, &file) < 0
+            && libsfs_open(image_fs, full, O_RDWR, &file) < 0) {
+            return NULL;
+        }
+    } else if (libsfs_open(image_fs, full, O_RDWR, &file) < 0) {
+        return NULL;
+    }
+    replay_slot_new(t, full)->file = file;
+    return file;
+}
+
+static int replay_filldir(void *ctx, const char *name, const struct stat *st) {
+    (void) ctx, (void) name, (void) st;
+    return 0;
+}
+
+static int replay_one_image(replay_thread *t, const replay_entry *e, const char *full, const char *full2) {
+    struct stat st;
+    libsfs_file *file;
+    char target[PATH_MAX];
+
+    switch (e->rec.op) {
+        case STAT_GETATTR:
+            return libsfs_stat(image_fs, full, &st);
+        case STAT_CREATE:
+            replay_fd_close(t, full);
+            return replay_file_get(t, full, 1, e->rec.mode) == NULL ? -1 : 0;
+        case STAT_UNLINK:
+            replay_fd_close(t, full);
+            return libsfs_unlink(image_fs, full);
+        case STAT_OPEN:
+            return replay_file_get(t, full, 0, 0) == NULL ? -1 : 0;
+        case STAT_RELEASE:
+            replay_fd_close(t, full);
+            return 0;
+        case STAT_READ:
+            file = replay_file_get(t, full, 0, 0);
+            return file == NULL ? -1 : (int) libsfs_read(file, t->buf, e->rec.size, e->rec.offset);
+        case STAT_WRITE:
+            file = replay_file_get(t, full, 0, 0);
+            return file == NULL ? -1 : (int) libsfs_write(file, t->buf, e->rec.size, e->rec.offset);
+        case STAT_TRUNCATE:
+        case STAT_FTRUNCATE:
+            return libsfs_truncate(image_fs, full, e->rec.offset);
+        case STAT_UTIMENS:
+            return libsfs_utimens(image_fs, full, NULL);
+        case STAT_MKDIR:
+            return libsfs_mkdir(image_fs, full, e->rec.mode);
+        case STAT_RMDIR:
+            return libsfs_rmdir(image_fs, full);
+        case STAT_READDIR:
+            return libsfs_readdir(image_fs, full, replay_filldir, NULL);
+        case STAT_FSYNC:
+            file = replay_file_get(t, full, 0, 0);
+            return file == NULL ? -1 : libsfs_fsync(file);
+        case STAT_RENAME:
+            replay_fd_close(t, full);
+            replay_fd_close(t, full2);
+            return libsfs_rename(image_fs, full, full2);
+        case STAT_LINK:
+            return libsfs_link(image_fs, full, full2);
+        case STAT_SYMLINK:
+            return libsfs_symlink(image_fs, full2, full);
+        case STAT_READLINK:
+            return libsfs_readlink(image_fs, full, target, sizeof(target));
+        default:
+            return 0;
+    }
+}
+
+static int replay_one(replay_thread *t, const replay_entry *e) {
+    char full[PATH_MAX], full2[PATH_MAX], target[PATH_MAX];
+    struct stat st;
+    int fd;
+    DIR *dir;
+    replay_full_path(e->path, e->rec.path_len, full);
+    replay_full_path(e->path2, e->rec.path2_len, full2);
+    if (image_fs != NULL) {
+        return replay_one_image(t, e, full, full2);
+    }
+
+    switch (e->rec.op) {
+        case STAT_GETATTR:
+            return lstat(full, &st);
+        case STAT_CREATE:
+            replay_fd_close(t, full);
+            return replay_fd_get(t, full, O_CREAT | O_RDWR, e->rec.mode) < 0 ? -1 : 0;
+        case STAT_UNLINK:
+            replay_fd_close(t, full);
+            return unlink(full);
+        case STAT_OPEN:
+            return replay_fd_get(t, full, O_RDWR, 0) < 0 ? -1 : 0;
+        case STAT_RELEASE:
+            replay_fd_close(t, full);
+            return 0;
+        case STAT_READ:
+            fd = replay_fd_get(t, full, O_RDWR, 0);
+            return fd < 0 ? -1 : (int) pread(fd, t->buf, e->rec.size, e->rec.offset);
+        case STAT_WRITE:
+            fd = replay_fd_get(t, full, O_RDWR, 0);
+            return fd < 0 ? -1 : (int) pwrite(fd, t->buf, e->rec.size, e->rec.offset);
+        case STAT_TRUNCATE:
+        case STAT_FTRUNCATE:
+            return truncate(full, e->rec.offset);
+        case STAT_UTIMENS:
+            return utimensat(AT_FDCWD, full, NULL, 0);
+        case STAT_MKDIR:
+            return mkdir(full, e->rec.mode);
+        case STAT_RMDIR:
+            return rmdir(full);
+        case STAT_READDIR:
+            dir = opendir(full);
+            if (dir == NULL) {
+                return -1;
+            }
+            while (readdir(dir) != NULL);
+            closedir(dir);
+            return 0;
+        case STAT_FSYNC:
+            fd = replay_fd_get(t, full, O_RDWR, 0);
+            // offset carries the datasync flag
+            return fd < 0 ? -1 : e->rec.offset ? fdatasync(fd) : fsync(fd);
+        case STAT_RENAME:
+            replay_fd_close(t, full);
+            replay_fd_close(t, full2);
+            return rename(full, full2);
+        case STAT_LINK:
+            return link(full, full2);
+        case STAT_SYMLINK:
+            // The target is stored as given, not below the mount point
+            snprintf(target, PATH_MAX, "%.*s", (int) e->rec.path2_len, e->path2);
+            return symlink(target, full);
+        case STAT_READLINK:
+            return readlink(full, target, sizeof(target)) < 0 ? -1 : 0;
+        default:
+            // opendir/releasedir are implied by readdir above
+            return 0;
+    }
+}
+
+static void replay_wait_until(uint64_t start_ns) {
+    uint64_t now = stats_now() - replay_epoch;
+    if (now < start_ns) {
+        struct timespec ts;
+        uint64_t delta = start_ns - now;
+        ts.tv_sec = delta / 1000000000ull;
+        ts.tv_nsec = delta % 1000000000ull;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void *replay_thread_main(void *arg) {
+    replay_thread *t = arg;
+    size_t i;
+    for (i = 0; i < t->count; i++) {
+        replay_entry *e = t->entries[i];
+        if (!max_speed) {
+            replay_wait_until(e->rec.start_ns);
+        }
+        uint64_t start = stats_now();
+        if (replay_one(t, e) < 0) {
+            t->errors++;
+        }
+        stats_record((stats_op) e->rec.op, stats_now() - start);
+    }
+    for (i = 0; i < REPLAY_OPEN_FILES; i++) {
+        replay_slot_close(&t->fds[i]);
+    }
+    return NULL;
+}
+
+static char *replay_load(const char *trace_path, size_t *len) {
+    FILE *f = fopen(trace_path, "r");
+    char *data;
+    long size;
+    if (f == NULL) {
+        perror(trace_path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size > 0 ? size : 1);
+    if (data == NULL || fread(data, 1, size, f) != (size_t) size) {
+        fprintf(stderr, "%s: cannot read trace\n", trace_path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    *len = size;
+    return data;
+}
+
+// Trace buffers are written out per FUSE thread, so the file is not in
+// start order; the trace file order breaks ties
+static int replay_entry_cmp(const void *a, const void *b) {
+    const replay_entry *x = *(replay_entry *const *) a, *y = *(replay_entry *const *) b;
+    if (x->rec.start_ns != y->rec.start_ns) {
+        return x->rec.start_ns < y->rec.start_ns ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Split the loaded trace into one list per replay thread, in start order
+static size_t replay_parse(char *data, size_t len, replay_thread *threads, int nthreads) {
+    trace_header *header = (trace_header *) data;
+    size_t pos = sizeof(trace_header), total = 0;
+    int i;
+    if (len < sizeof(trace_header) || memcmp(header->magic, TRACE_MAGIC, 8) != 0
+        || header->version != TRACE_VERSION || header->record_size != sizeof(trace_record)) {
+        fprintf(stderr, "not an sfs trace, or an unsupported version\n");
+        exit(EXIT_FAILURE);
+    }
+    while (pos + sizeof(trace_record) <= len) {
+        replay_entry *e = malloc(sizeof(replay_entry));
+        memcpy(&e->rec, data + pos, sizeof(trace_record));
+        e->path = data + pos + sizeof(trace_record);
+        e->path2 = e->path + e->rec.path_len;
+        pos += sizeof(trace_record) + e->rec.path_len + e->rec.path2_len;
+        if (pos > len || e->rec.op >= STAT_OP_NR) {
+            free(e);
+            break;
+        }
+        if ((e->rec.op == STAT_READ || e->rec.op == STAT_WRITE) && e->rec.size > max_io_size) {
+            max_io_size = e->rec.size;
+        }
+        replay_thread *t = &threads[e->rec.tid % nthreads];
+        if (t->count == t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 1024;
+            t->entries = realloc(t->entries, t->cap * sizeof(replay_entry *));
+        }
+        e->seq = total++;
+        t->entries[t->count++] = e;
+    }
+    for (i = 0; i < nthreads; i++) {
+        qsort(threads[i].entries, threads[i].count, sizeof(replay_entry *), replay_entry_cmp);
+    }
+    return total;
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = 1, opt, i, j, image_mode = 0, format_image = 0;
+    size_t len, total;
+    unsigned long errors = 0;
+    replay_thread *threads;
+
+    while ((opt = getopt(argc, argv, "t:mif")) != -1) {
+        switch (opt) {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'm':
+                max_speed = 1;
+                break;
+            case 'i':
+                image_mode = 1;
+                break;
+            case 'f':
+                format_image = 1;
+                break;
+            default:
+                replay_usage();
+        }
+    }
+    if (argc - optind != 2 || nthreads < 1 || nthreads > REPLAY_MAX_THREADS) {
+        replay_usage();
+    }
+    mount_point = argv[optind + 1];
+    if (image_mode) {
+        int ret = format_image ? libsfs_format(mount_point, NULL) : 0;
+        if (ret == 0) {
+            ret = libsfs_mount(mount_point, NULL, &image_fs);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", mount_point, strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    threads = calloc(nthreads, sizeof(replay_thread));
+    char *data = replay_load(argv[optind], &len);
+    total = replay_parse(data, len, threads, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        threads[i].buf = calloc(1, max_io_size + 1);
+        for (j = 0; j < REPLAY_OPEN_FILES; j++) {
+            threads[i].fds[j].fd = -1;
+        }
+    }
+
+    replay_epoch = stats_now();
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i].thread, NULL, replay_thread_main, &threads[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+    }
+    double elapsed = (stats_now() - replay_epoch) / 1e9;
+
+    printf("replayed %zu ops with %d threads in %.3f s (%.0f ops/s, %lu errors, %s%s)\n",
+           total, nthreads, elapsed, total / elapsed, errors,
+           max_speed ? "max speed" : "original pace", image_fs ? ", in-process" : "");
+    libsfs_unmount(image_fs);
+    char *report = stats_snapshot(&len);
+    fwrite(report, 1, len, stdout);
+    return errors ? 1 : 0;
+}
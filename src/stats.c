@@ -0,0 +1,200 @@
+//
+// Per-operation counters and latency histograms, see stats.h.
+//
+
+#include "params.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "stats.h"
+
+// Values below 16ns get one bucket each; above that, each power of two
+// is split into 8 linear sub-buckets.
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_LINEAR_MAX 16
+#define STATS_BUCKETS (STATS_LINEAR_MAX + (64 - 4) * STATS_SUB_BUCKETS)
+
+typedef struct stats_op_data {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t hist[STATS_BUCKETS];
+} stats_op_data;
+
+typedef struct stats_thread {
+    struct stats_thread *next;
+    stats_op_data ops[STAT_OP_NR];
+    atomic_uint_fast64_t counters[STAT_COUNTER_NR];
+} stats_thread;
+
+static const char *stats_op_names[STAT_OP_NR] = {
+        "getattr", "create", "unlink", "open", "release", "read", "write",
+        "truncate", "ftruncate", "utimens", "mkdir", "rmdir", "opendir",
+        "readdir", "releasedir", "block_read", "block_write", "fsync",
+        "journal_commit", "ioctl", "rename", "link", "symlink", "readlink"
+};
+
+static const char *stats_counter_names[STAT_COUNTER_NR] = {
+        "bytes_read", "bytes_written", "journal_blocks",
+        "cleaner_blocks", "compress_in", "compress_out",
+        "dedup_blocks", "clone_blocks",
+        "discard_blocks", "times_deferred", "reclaim_blocks"
+};
+
+// All per-thread blocks ever created.  Blocks are only ever pushed, and
+// are kept after their thread exits so no samples are lost.
+static _Atomic(stats_thread *) stats_threads = NULL;
+static _Thread_local stats_thread *stats_self = NULL;
+
+static stats_thread *stats_get_thread(void) {
+    if (stats_self == NULL) {
+        stats_thread *t = calloc(1, sizeof(stats_thread));
+        if (t == NULL) {
+            return NULL;
+        }
+        t->next = atomic_load(&stats_threads);
+        while (!atomic_compare_exchange_weak(&stats_threads, &t->next, t));
+        stats_self = t;
+    }
+    return stats_self;
+}
+
+// Only the owning thread writes to its block, so a relaxed load+store
+// is enough and avoids a locked read-modify-write.
+static inline void stats_bump(atomic_uint_fast64_t *v, uint64_t n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static unsigned int stats_bucket(uint64_t ns) {
+    if (ns < STATS_LINEAR_MAX) {
+        return (unsigned int) ns;
+    }
+    unsigned int msb = 63 - __builtin_clzll(ns);
+    unsigned int sub = (unsigned int) (ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return STATS_LINEAR_MAX + (msb - 4) * STATS_SUB_BUCKETS + sub;
+}
+
+// Upper bound (exclusive) of the values that land in a bucket
+static uint64_t stats_bucket_limit(unsigned int b) {
+    if (b < STATS_LINEAR_MAX) {
+        return b + 1;
+    }
+    unsigned int msb = (b - STATS_LINEAR_MAX) / STATS_SUB_BUCKETS + 4;
+    uint64_t sub = (b - STATS_LINEAR_MAX) % STATS_SUB_BUCKETS;
+    return (STATS_SUB_BUCKETS + sub + 1) << (msb - STATS_SUB_BITS);
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_record(stats_op op, uint64_t ns) {
+    stats_thread *t = stats_get_thread();
+    if (t == NULL) {
+        return;
+    }
+    stats_op_data *d = &t->ops[op];
+    stats_bump(&d->count, 1);
+    stats_bump(&d->total_ns, ns);
+    stats_bump(&d->hist[stats_bucket(ns)], 1);
+    if (ns > atomic_load_explicit(&d->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&d->max_ns, ns, memory_order_relaxed);
+    }
+}
+
+void stats_add(stats_counter counter, uint64_t n) {
+    stats_thread *t = stats_get_thread();
+    if (t != NULL) {
+        stats_bump(&t->counters[counter], n);
+    }
+}
+
+stats_timer stats_timer_start(stats_op op) {
+    stats_timer timer = {op, stats_now()};
+    return timer;
+}
+
+void stats_timer_stop(stats_timer *timer) {
+    stats_record(timer->op, stats_now() - timer->start);
+}
+
+// Bucket upper bound at the given rank, capped at the largest sample seen
+static uint64_t stats_percentile(const uint64_t *hist, uint64_t count, uint64_t max, double p) {
+    uint64_t rank = (uint64_t) (count * p);
+    uint64_t seen = 0;
+    unsigned int b;
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) {
+            uint64_t limit = stats_bucket_limit(b);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+char *stats_snapshot(size_t *len) {
+    // Per call: several threads may take a snapshot at once
+    uint64_t hist[STATS_BUCKETS];
+    size_t cap = 256 + (STAT_OP_NR + STAT_COUNTER_NR) * 128;
+    char *out = malloc(cap);
+    size_t used = 0;
+    int op, i;
+    stats_thread *t;
+    if (out == NULL) {
+        *len = 0;
+        return NULL;
+    }
+
+    used += snprintf(out + used, cap - used, "%-14s %12s %14s %10s %10s %10s %10s %10s\n",
+                     "op", "count", "total_us", "avg_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (op = 0; op < STAT_OP_NR; op++) {
+        uint64_t count = 0, total = 0, max = 0;
+        memset(hist, 0, sizeof(hist));
+        for (t = atomic_load(&stats_threads); t != NULL; t = t->next) {
+            stats_op_data *d = &t->ops[op];
+            count += atomic_load_explicit(&d->count, memory_order_relaxed);
+            total += atomic_load_explicit(&d->total_ns, memory_order_relaxed);
+            uint64_t m = atomic_load_explicit(&d->max_ns, memory_order_relaxed);
+            if (m > max) max = m;
+            for (i = 0; i < STATS_BUCKETS; i++) {
+                hist[i] += atomic_load_explicit(&d->hist[i], memory_order_relaxed);
+            }
+        }
+        if (count == 0) {
+            used += snprintf(out + used, cap - used, "%-14s %12d\n", stats_op_names[op], 0);
+            continue;
+        }
+        used += snprintf(out + used, cap - used,
+                         "%-14s %12llu %14.1f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+                         stats_op_names[op], (unsigned long long) count, total / 1000.0,
+                         (double) total / count / 1000.0,
+                         stats_percentile(hist, count, max, 0.50) / 1000.0,
+                         stats_percentile(hist, count, max, 0.90) / 1000.0,
+                         stats_percentile(hist, count, max, 0.99) / 1000.0,
+                         max / 1000.0);
+    }
+    for (i = 0; i < STAT_COUNTER_NR; i++) {
+        uint64_t sum = 0;
+        for (t = atomic_load(&stats_threads); t != NULL; t = t->next) {
+            sum += atomic_load_explicit(&t->counters[i], memory_order_relaxed);
+        }
+        used += snprintf(out + used, cap - used, "%-14s %12llu\n",
+                         stats_counter_names[i], (unsigned long long) sum);
+    }
+    used += snprintf(out + used, cap - used, "%-14s %12lu\n", "log_dropped", log_dropped_records());
+    *len = used;
+    return out;
+}
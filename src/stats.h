@@ -0,0 +1,82 @@
+//
+// Per-operation counters and latency histograms.
+//
+// Every thread that records a sample gets its own stats block, so the
+// hot path is a handful of uncontended stores with no locking; readers
+// sum the blocks of all threads.  Latencies go into HDR-style
+// log-linear buckets (8 sub-buckets per power of two, ~12% precision).
+//
+
+#ifndef SFS_STATS_H
+#define SFS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Synthetic read-only file inside the mount that renders the stats
+#define STATS_FILE_PATH "/.sfs-stats"
+
+typedef enum stats_op {
+    STAT_GETATTR = 0,
+    STAT_CREATE,
+    STAT_UNLINK,
+    STAT_OPEN,
+    STAT_RELEASE,
+    STAT_READ,
+    STAT_WRITE,
+    STAT_TRUNCATE,
+    STAT_FTRUNCATE,
+    STAT_UTIMENS,
+    STAT_MKDIR,
+    STAT_RMDIR,
+    STAT_OPENDIR,
+    STAT_READDIR,
+    STAT_RELEASEDIR,
+    STAT_BLOCK_READ,
+    STAT_BLOCK_WRITE,
+    STAT_FSYNC,
+    STAT_JOURNAL_COMMIT,
+    STAT_IOCTL,
+    STAT_RENAME,
+    STAT_LINK,
+    STAT_SYMLINK,
+    STAT_READLINK,
+    STAT_OP_NR
+} stats_op;
+
+typedef enum stats_counter {
+    STAT_BYTES_READ = 0,
+    STAT_BYTES_WRITTEN,
+    STAT_JOURNAL_BLOCKS,
+    STAT_CLEANER_BLOCKS,
+    STAT_COMPRESS_IN,
+    STAT_COMPRESS_OUT,
+    STAT_DEDUP_BLOCKS,
+    STAT_CLONE_BLOCKS,
+    STAT_DISCARD_BLOCKS,
+    STAT_TIMES_DEFERRED,
+    STAT_RECLAIM_BLOCKS,
+    STAT_COUNTER_NR
+} stats_counter;
+
+typedef struct stats_timer {
+    stats_op op;
+    uint64_t start;
+} stats_timer;
+
+uint64_t stats_now(void);
+void stats_record(stats_op op, uint64_t ns);
+void stats_add(stats_counter counter, uint64_t n);
+
+stats_timer stats_timer_start(stats_op op);
+void stats_timer_stop(stats_timer *timer);
+
+// Time the rest of the enclosing scope as one sample of op, whichever
+// return path it leaves by.
+#define stats_scope(op) \
+    stats_timer __stats_timer __attribute__((cleanup(stats_timer_stop))) = stats_timer_start(op)
+
+// Render all stats as text into a malloc'ed buffer; *len gets the length
+char *stats_snapshot(size_t *len);
+
+#endif //SFS_STATS_H
@@ -0,0 +1,154 @@
+//
+// Binary operation trace, see trace.h.
+//
+// Each thread appends records to its own buffer under its own (normally
+// uncontended) mutex, and writes the buffer out with one write() when
+// it fills.  trace_close() flushes every thread's buffer.
+//
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+typedef struct trace_buffer {
+    struct trace_buffer *next;
+    pthread_mutex_t lock;
+    size_t used;
+    char data[TRACE_BUFFER_SIZE];
+} trace_buffer;
+
+static int trace_fd = -1;
+static uint64_t trace_epoch;
+static pthread_mutex_t trace_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer *trace_buffers = NULL;
+static _Thread_local trace_buffer *trace_self = NULL;
+
+int trace_open(const char *trace_path) {
+    trace_header header;
+    trace_fd = open(trace_path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+    if (trace_fd < 0) {
+        return -errno;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record);
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -EIO;
+    }
+    trace_epoch = stats_now();
+    return 0;
+}
+
+static void trace_flush(trace_buffer *tb) {
+    size_t done = 0;
+    while (done < tb->used) {
+        ssize_t n = write(trace_fd, tb->data + done, tb->used - done);
+        if (n <= 0) {
+            log_error(LOG_CAT_MOUNT, "trace: write failed, %zu bytes lost\n", tb->used - done);
+            break;
+        }
+        done += n;
+    }
+    tb->used = 0;
+}
+
+void trace_close(void) {
+    trace_buffer *tb;
+    if (trace_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&trace_list_lock);
+    for (tb = trace_buffers; tb != NULL; tb = tb->next) {
+        pthread_mutex_lock(&tb->lock);
+        trace_flush(tb);
+        pthread_mutex_unlock(&tb->lock);
+    }
+    pthread_mutex_unlock(&trace_list_lock);
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+static trace_buffer *trace_get_buffer(void) {
+    if (trace_self == NULL) {
+        trace_buffer *tb = malloc(sizeof(trace_buffer));
+        if (tb == NULL) {
+            return NULL;
+        }
+        pthread_mutex_init(&tb->lock, NULL);
+        tb->used = 0;
+        pthread_mutex_lock(&trace_list_lock);
+        tb->next = trace_buffers;
+        trace_buffers = tb;
+        pthread_mutex_unlock(&trace_list_lock);
+        trace_self = tb;
+    }
+    return trace_self;
+}
+
+trace_timer trace_timer_start(stats_op op, const char *path, const char *path2,
+                              uint64_t offset, uint64_t size, uint32_t mode) {
+    trace_timer timer = {stats_timer_start(op), path, path2, offset, size, mode};
+    return timer;
+}
+
+void trace_timer_stop(trace_timer *timer) {
+    uint64_t end = stats_now();
+    stats_record(timer->timer.op, end - timer->timer.start);
+    if (trace_fd < 0) {
+        return;
+    }
+
+    trace_buffer *tb = trace_get_buffer();
+    if (tb == NULL) {
+        return;
+    }
+    size_t path_len = timer->path ? strlen(timer->path) : 0;
+    size_t path2_len = timer->path2 ? strlen(timer->path2) : 0;
+    if (path_len > PATH_MAX) {
+        path_len = PATH_MAX;
+    }
+    if (path2_len > PATH_MAX) {
+        path2_len = PATH_MAX;
+    }
+    trace_record rec;
+    struct fuse_context *context = fuse_get_context();
+    rec.start_ns = timer->timer.start - trace_epoch;
+    rec.duration_ns = end - timer->timer.start;
+    rec.offset = timer->offset;
+    rec.size = timer->size;
+    rec.tid = context ? (uint32_t) context->pid : 0;
+    rec.mode = timer->mode;
+    rec.op = (uint16_t) timer->timer.op;
+    rec.path_len = (uint16_t) path_len;
+    rec.path2_len = (uint16_t) path2_len;
+
+    pthread_mutex_lock(&tb->lock);
+    if (tb->used + sizeof(rec) + path_len + path2_len > TRACE_BUFFER_SIZE) {
+        trace_flush(tb);
+    }
+    memcpy(tb->data + tb->used, &rec, sizeof(rec));
+    if (path_len > 0) {
+        memcpy(tb->data + tb->used + sizeof(rec), timer->path, path_len);
+    }
+    if (path2_len > 0) {
+        memcpy(tb->data + tb->used + sizeof(rec) + path_len, timer->path2, path2_len);
+    }
+    tb->used += sizeof(rec) + path_len + path2_len;
+    pthread_mutex_unlock(&tb->lock);
+}
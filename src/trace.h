@@ -0,0 +1,64 @@
+//
+// Binary operation trace.
+//
+// With -o trace=FILE every FUSE operation is appended to FILE as a
+// fixed-size trace_record followed by path_len bytes of path, then
+// path2_len bytes of the second path of ops that have one.  The file
+// starts with a trace_header.  sfs-replay reads the same format.
+//
+
+#ifndef SFS_TRACE_H
+#define SFS_TRACE_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+#define TRACE_MAGIC "SFSTRACE"
+#define TRACE_VERSION 2
+
+typedef struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   // sizeof(trace_record), for forward compatibility
+} trace_header;
+
+typedef struct __attribute__((packed)) trace_record {
+    uint64_t start_ns;      // since the trace was opened
+    uint64_t duration_ns;
+    uint64_t offset;        // read/write offset, new size for truncate
+    uint64_t size;          // read/write length
+    uint32_t tid;           // calling thread, as reported by fuse
+    uint32_t mode;          // create/mkdir mode, open flags
+    uint16_t op;            // stats_op
+    uint16_t path_len;
+    uint16_t path2_len;     // rename/link destination, symlink target; 0 for ops with one path
+} trace_record;
+
+typedef struct trace_timer {
+    stats_timer timer;
+    const char *path;
+    const char *path2;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t mode;
+} trace_timer;
+
+int trace_open(const char *trace_path);
+void trace_close(void);
+
+trace_timer trace_timer_start(stats_op op, const char *path, const char *path2,
+                              uint64_t offset, uint64_t size, uint32_t mode);
+void trace_timer_stop(trace_timer *timer);
+
+// Like stats_scope, and also appends a trace record when tracing is on
+#define trace_scope(op, path, offset, size, mode) \
+    trace_timer __trace_timer __attribute__((cleanup(trace_timer_stop))) = \
+        trace_timer_start(op, path, NULL, offset, size, mode)
+
+// For ops on two paths: rename and link, and symlink with its target second
+#define trace_scope2(op, path, path2) \
+    trace_timer __trace_timer __attribute__((cleanup(trace_timer_stop))) = \
+        trace_timer_start(op, path, path2, 0, 0, 0)
+
+#endif //SFS_TRACE_H